@@ -0,0 +1,60 @@
+#include <Codegen/AsmWriter.h>
+
+namespace klang {
+
+void AsmWriter::Write(const char* Data, size_t Len) {
+  if(Size_ + Len > kBufferSize) {
+    Flush();
+    // too big to be worth copying
+    if(Len > kBufferSize) {
+      Failed_ |= fwrite(Data, 1, Len, File_) != Len;
+      return;
+    }
+  }
+  memcpy(Buffer_ + Size_, Data, Len);
+  Size_ += Len;
+}
+
+bool AsmWriter::Flush() {
+  if(Size_ != 0) {
+    Failed_ |= fwrite(Buffer_, 1, Size_, File_) != Size_;
+    Size_ = 0;
+  }
+  return !Failed_;
+}
+
+void AsmWriter::WriteUnsigned(uint64_t Value) {
+  char Digits[20];
+  size_t Pos = sizeof(Digits);
+  do {
+    Digits[--Pos] = '0' + Value % 10;
+    Value /= 10;
+  } while(Value != 0);
+  Write(Digits + Pos, sizeof(Digits) - Pos);
+}
+
+void AsmWriter::WriteDecimal(int64_t Value) {
+  if(Value < 0) {
+    (*this) << '-';
+    // negate in unsigned space so INT64_MIN does not overflow
+    WriteUnsigned(0 - static_cast<uint64_t>(Value));
+    return;
+  }
+  WriteUnsigned(static_cast<uint64_t>(Value));
+}
+
+AsmWriter& AsmWriter::Hex(uint64_t Value) {
+  static const char kHexDigits[] = "0123456789abcdef";
+  char Digits[18];
+  size_t Pos = sizeof(Digits);
+  do {
+    Digits[--Pos] = kHexDigits[Value & 0xf];
+    Value >>= 4;
+  } while(Value != 0);
+  Digits[--Pos] = 'x';
+  Digits[--Pos] = '0';
+  Write(Digits + Pos, sizeof(Digits) - Pos);
+  return *this;
+}
+
+} // namespace klang
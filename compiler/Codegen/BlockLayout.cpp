@@ -0,0 +1,156 @@
+#include <Codegen/BlockLayout.h>
+
+#include <algorithm>
+#include <cmath>
+#include <set>
+
+namespace klang {
+
+void BlockPlacement::ComputeLoopDepth() {
+  // back edges are found with a DFS from the entry
+  std::vector<std::pair<MachineBasicBlock*, MachineBasicBlock*>> BackEdges;
+  std::set<MachineBasicBlock*> Visited, OnStack;
+  std::vector<std::pair<MachineBasicBlock*, size_t>> Stack;
+
+  auto *Entry = Function_->Entry();
+  Visited.insert(Entry);
+  OnStack.insert(Entry);
+  Stack.emplace_back(Entry, 0);
+  while(!Stack.empty()) {
+    auto [Block, Next] = Stack.back();
+    auto Succs = Block->Successors();
+    if(Next == Succs.size()) {
+      OnStack.erase(Block);
+      Stack.pop_back();
+      continue;
+    }
+    Stack.back().second++;
+
+    auto *Succ = Succs[Next];
+    if(OnStack.count(Succ) != 0) {
+      BackEdges.emplace_back(Block, Succ);
+    } else if(Visited.insert(Succ).second) {
+      OnStack.insert(Succ);
+      Stack.emplace_back(Succ, 0);
+    }
+  }
+
+  // natural loop of each header: blocks reaching a latch without passing the header
+  std::unordered_map<MachineBasicBlock*, std::set<MachineBasicBlock*>> Loops;
+  for(auto [Latch, Header] : BackEdges) {
+    auto &Body = Loops[Header];
+    Body.insert(Header);
+    std::vector<MachineBasicBlock*> WorkList = { Latch };
+    while(!WorkList.empty()) {
+      auto *Block = WorkList.back();
+      WorkList.pop_back();
+      if(!Body.insert(Block).second) {
+        continue;
+      }
+      for(auto *Pred : Block->Predecessors()) {
+        WorkList.push_back(Pred);
+      }
+    }
+  }
+
+  for(auto &[Header, Body] : Loops) {
+    for(auto *Block : Body) {
+      LoopDepth_[Block]++;
+    }
+  }
+}
+
+double BlockPlacement::Frequency(MachineBasicBlock* Block) const {
+  auto It = LoopDepth_.find(Block);
+  size_t Depth = It == LoopDepth_.end() ? 0 : It->second;
+  return std::pow(10.0, static_cast<double>(Depth));
+}
+
+std::vector<BlockPlacement::Edge> BlockPlacement::ComputeEdges() const {
+  std::vector<Edge> Edges;
+  for(auto *Block : (*Function_)) {
+    // a conditional jump may name the same block twice, duplicates are
+    // dropped in place so ties below do not depend on block addresses
+    std::vector<MachineBasicBlock*> Succs;
+    for(auto *Succ : Block->Successors()) {
+      if(std::find(Succs.begin(), Succs.end(), Succ) == Succs.end()) {
+        Succs.push_back(Succ);
+      }
+    }
+    for(auto *Succ : Succs) {
+      // an edge leaving a loop is taken at most as often as its target runs
+      auto Weight = std::min(Frequency(Block), Frequency(Succ)) / Succs.size();
+      Edges.push_back({ Block, Succ, Weight });
+    }
+  }
+
+  // heaviest first, ties keep the original order
+  std::stable_sort(Edges.begin(), Edges.end(), [](const Edge& A, const Edge& B) {
+    return A.Weight_ > B.Weight_;
+  });
+  return Edges;
+}
+
+void BlockPlacement::Place() {
+  ComputeLoopDepth();
+
+  std::unordered_map<MachineBasicBlock*, std::vector<MachineBasicBlock*>*> ChainOf;
+  std::vector<std::vector<MachineBasicBlock*>> Chains;
+  Chains.reserve(std::distance(Function_->begin(), Function_->end()));
+  for(auto *Block : (*Function_)) {
+    Chains.push_back({ Block });
+    ChainOf[Block] = &Chains.back();
+  }
+
+  // join chains along heavy edges when the source ends one chain and the target starts another
+  auto Edges = ComputeEdges();
+  for(auto &E : Edges) {
+    auto *From = ChainOf[E.From_];
+    auto *To = ChainOf[E.To_];
+    if(From == To || From->back() != E.From_ || To->front() != E.To_ || E.To_ == Function_->Entry()) {
+      continue;
+    }
+    for(auto *Block : (*To)) {
+      From->push_back(Block);
+      ChainOf[Block] = From;
+    }
+    To->clear();
+  }
+
+  // the entry chain goes first, then the chain most strongly connected to what is already placed
+  std::vector<MachineBasicBlock*> Order;
+  std::set<std::vector<MachineBasicBlock*>*> Placed;
+  auto PlaceChain = [&](std::vector<MachineBasicBlock*>* Chain) {
+    Placed.insert(Chain);
+    Order.insert(Order.end(), Chain->begin(), Chain->end());
+  };
+  PlaceChain(ChainOf[Function_->Entry()]);
+
+  while(true) {
+    std::vector<MachineBasicBlock*>* Best = nullptr;
+    double BestWeight = -1;
+    for(auto &Chain : Chains) {
+      if(Chain.empty() || Placed.count(&Chain) != 0) {
+        continue;
+      }
+      double Weight = 0;
+      for(auto &E : Edges) {
+        if(ChainOf[E.To_] == &Chain && Placed.count(ChainOf[E.From_]) != 0) {
+          Weight += E.Weight_;
+        }
+      }
+      if(Weight > BestWeight) {
+        Best = &Chain;
+        BestWeight = Weight;
+      }
+    }
+    if(Best == nullptr) {
+      break;
+    }
+    PlaceChain(Best);
+  }
+
+  Function_->Reorder(Order);
+}
+
+} // namespace klang
@@ -1,11 +1,18 @@
 #include <Codegen/Codegen.h> 
 #include <Codegen/RegAlloc.h>
 #include <Codegen/InstSched.h>
+#include <Codegen/BlockLayout.h>
+#include <Codegen/ObjectWriter.h>
+#include <Codegen/JIT.h>
 #include <Logging.h>
 
+#include <algorithm>
 #include <exception>
+#include <functional>
+#include <sstream>
 
 const char* kFunctionPrefix = "K_";
+const char* kRuntimePrefix = "do_";
 
 namespace klang {
 
@@ -33,11 +40,17 @@ void MachineFunction::AddBasicBlock(MachineBasicBlock* BB) {
   Size_++;
 }
 
-void MachineFunction::Emit(std::stringstream& SS) const {
+void MachineFunction::Reorder(const std::vector<MachineBasicBlock*>& Order) {
+  assert(Order.size() == BasicBlocks_.size() && "Layout must contain every block");
+  assert(Order.front() == Entry() && "Entry block must stay first");
+  BasicBlocks_ = Order;
+}
+
+void MachineFunction::Emit(AsmWriter& SS) const {
   SS << ".global " << kFunctionPrefix << Name() << '\n';
   SS << kFunctionPrefix << Name() << ":\n";
-  for(auto *BB : BasicBlocks_) {
-    BB->Emit(SS);
+  for(size_t i = 0; i < BasicBlocks_.size(); i++) {
+    BasicBlocks_[i]->Emit(SS, i + 1 < BasicBlocks_.size() ? BasicBlocks_[i + 1] : nullptr);
   }
 }
 
@@ -98,11 +111,17 @@ std::vector<MachineBasicBlock*> MachineBasicBlock::Predecessors() const {
   return Preds;
 }
 
-void MachineBasicBlock::Emit(std::stringstream& SS) const {
+void MachineBasicBlock::Emit(AsmWriter& SS, const MachineBasicBlock* Next) const {
   SS << Name() << ":\n";
   for(auto *Inst = Head_; Inst != nullptr; Inst = Inst->Next()) {
-    Inst->Emit(SS);
-    SS << '\n';
+    if(Inst->GetOpcode() == MachineInstruction::Opcode::Jmp) {
+      static_cast<JmpMachineInst*>(Inst)->Emit(SS, Next);
+    } else if(Inst->GetOpcode() == MachineInstruction::Opcode::Jcc) {
+      static_cast<JccMachineInst*>(Inst)->Emit(SS, Next);
+    } else {
+      Inst->Emit(SS);
+      SS << '\n';
+    }
   }
 }
 
@@ -130,7 +149,10 @@ MachineBasicBlock::iterator MachineBasicBlock::iterator::operator++(int) {
 }
 
 bool MachineBasicBlock::IsExit() const {
-  return Tail_ != nullptr && Tail_->GetOpcode() == MachineInstruction::Opcode::Ret;
+  if(Tail_ == nullptr) {
+    return false;
+  }
+  return Tail_->GetOpcode() == MachineInstruction::Opcode::Ret || Tail_->GetOpcode() == MachineInstruction::Opcode::TailCall;
 }
 
 void MachineBasicBlock::InsertBefore(MachineInstruction* Inst, MachineInstruction* Before) {
@@ -239,7 +261,7 @@ void MachineInstruction::ReplaceOperand(size_t Idx, const MachineOperand& Op) {
   Operands_[Idx] = Op;
 }
 
-void MachineOperand::Emit(std::stringstream& SS) const {
+void MachineOperand::Emit(AsmWriter& SS) const {
   if(IsMachineRegister()) {
     EmitRegister(SS, U_.Reg_);
   } else if(IsImmediate()) {
@@ -274,15 +296,15 @@ const char* GetRegisterName(MachineRegister Reg) {
   }
 }
 
-void MachineOperand::EmitRegister(std::stringstream& SS, MachineRegister Reg) const {
+void MachineOperand::EmitRegister(AsmWriter& SS, MachineRegister Reg) const {
   SS << GetRegisterName(Reg);
 }
 
-void MachineOperand::EmitImmediate(std::stringstream& SS, int64_t Imm) const {
-  SS << std::hex << "0x" << Imm << std::dec;
+void MachineOperand::EmitImmediate(AsmWriter& SS, int64_t Imm) const {
+  SS.Hex(Imm);
 }
 
-void MachineOperand::EmitMemory(std::stringstream& SS, MachineRegister Base, MachineRegister Index, int64_t Disp) const {
+void MachineOperand::EmitMemory(AsmWriter& SS, MachineRegister Base, MachineRegister Index, int64_t Disp) const {
   SS << "qword ptr [";
   EmitRegister(SS, Base);
   if(Index != MachineRegister::None) {
@@ -322,7 +344,7 @@ bool MovMachineInst::Verify() const {
   return RMICheck(GetOperand(0), GetOperand(1));
 }
 
-void MovMachineInst::Emit(std::stringstream& SS) const {
+void MovMachineInst::Emit(AsmWriter& SS) const {
   SS << "mov ";
   GetOperand(1).Emit(SS);
   SS << ", ";
@@ -343,21 +365,21 @@ bool TestMachineInst::Verify() const {
   return RMICheck(GetOperand(0), GetOperand(1));
 }
 
-void TestMachineInst::Emit(std::stringstream& SS) const {
+void TestMachineInst::Emit(AsmWriter& SS) const {
   SS << "test ";
   GetOperand(1).Emit(SS);
   SS << ", ";
   GetOperand(0).Emit(SS);
 }
 
-void CmpMachineInst::Emit(std::stringstream& SS) const {
+void CmpMachineInst::Emit(AsmWriter& SS) const {
   SS << "cmp ";
   GetOperand(1).Emit(SS);
   SS << ", ";
   GetOperand(0).Emit(SS);
 }
 
-void CMovMachineInst::Emit(std::stringstream& SS) const {
+void CMovMachineInst::Emit(AsmWriter& SS) const {
   SS << "cmov";
   switch(Cond_) {
     case Condition::E: SS << "e"; break;
@@ -374,13 +396,32 @@ void CMovMachineInst::Emit(std::stringstream& SS) const {
   GetOperand(0).Emit(SS);
 }
 
-void JmpMachineInst::Emit(std::stringstream& SS) const {
+void JmpMachineInst::Emit(AsmWriter& SS) const {
   SS << "jmp " << Target_->Name();
 }
 
-void JccMachineInst::Emit(std::stringstream& SS) const {
+void JmpMachineInst::Emit(AsmWriter& SS, const MachineBasicBlock* Next) const {
+  if(Target_ != Next) {
+    Emit(SS);
+    SS << '\n';
+  }
+}
+
+Condition InvertCondition(Condition Cond) {
+  switch(Cond) {
+    case Condition::E: return Condition::NE;
+    case Condition::NE: return Condition::E;
+    case Condition::L: return Condition::GE;
+    case Condition::LE: return Condition::G;
+    case Condition::G: return Condition::LE;
+    case Condition::GE: return Condition::L;
+    default: __builtin_unreachable();
+  }
+}
+
+static void EmitConditionalJump(AsmWriter& SS, Condition Cond, const MachineBasicBlock* Target) {
   SS << "j";
-  switch(Cond_) {
+  switch(Cond) {
     case Condition::E: SS << "e"; break;
     case Condition::NE: SS << "ne"; break;
     case Condition::L: SS << "l"; break;
@@ -389,10 +430,26 @@ void JccMachineInst::Emit(std::stringstream& SS) const {
     case Condition::GE: SS << "ge"; break;
     default: __builtin_unreachable();
   }
-  SS << " " << True_->Name() << '\n';
+  SS << " " << Target->Name();
+}
+
+void JccMachineInst::Emit(AsmWriter& SS) const {
+  EmitConditionalJump(SS, Cond_, True_);
+  SS << '\n';
   SS << "jmp " << False_->Name();
 }
 
+void JccMachineInst::Emit(AsmWriter& SS, const MachineBasicBlock* Next) const {
+  if(False_ == Next) {
+    EmitConditionalJump(SS, Cond_, True_);
+  } else if(True_ == Next) {
+    EmitConditionalJump(SS, InvertCondition(Cond_), False_);
+  } else {
+    Emit(SS);
+  }
+  SS << '\n';
+}
+
 bool AddMachineInst::Verify() const {
   if(Size() != 2) {
     return false;
@@ -400,7 +457,7 @@ bool AddMachineInst::Verify() const {
   return RMICheck(GetOperand(0), GetOperand(1));
 }
 
-void AddMachineInst::Emit(std::stringstream& SS) const {
+void AddMachineInst::Emit(AsmWriter& SS) const {
   SS << "add ";
   GetOperand(1).Emit(SS);
   SS << ", ";
@@ -414,7 +471,7 @@ bool SubMachineInst::Verify() const {
   return RMICheck(GetOperand(0), GetOperand(1));
 }
 
-void SubMachineInst::Emit(std::stringstream& SS) const {
+void SubMachineInst::Emit(AsmWriter& SS) const {
   SS << "sub ";
   GetOperand(1).Emit(SS);
   SS << ", ";
@@ -428,7 +485,7 @@ bool IMulMachineInst::Verify() const {
   return GetOperand(1).IsRegister() && GetOperand(0).IsRM();  
 }
 
-void IMulMachineInst::Emit(std::stringstream& SS) const {
+void IMulMachineInst::Emit(AsmWriter& SS) const {
   SS << "imul ";
   GetOperand(1).Emit(SS);
   SS << ", ";
@@ -442,7 +499,7 @@ bool IDivMachineInst::Verify() const {
   return GetOperand(0).IsRM();
 }
 
-void IDivMachineInst::Emit(std::stringstream& SS) const {
+void IDivMachineInst::Emit(AsmWriter& SS) const {
   SS << "idiv ";
   GetOperand(0).Emit(SS);
 }
@@ -454,7 +511,7 @@ bool OrMachineInst::Verify() const {
   return RMICheck(GetOperand(0), GetOperand(1));
 }
 
-void OrMachineInst::Emit(std::stringstream& SS) const {
+void OrMachineInst::Emit(AsmWriter& SS) const {
   SS << "or ";
   GetOperand(1).Emit(SS);
   SS << ", ";
@@ -468,7 +525,7 @@ bool AndMachineInst::Verify() const {
   return RMICheck(GetOperand(0), GetOperand(1));
 }
 
-void AndMachineInst::Emit(std::stringstream& SS) const {
+void AndMachineInst::Emit(AsmWriter& SS) const {
   SS << "and ";
   GetOperand(1).Emit(SS);
   SS << ", ";
@@ -482,41 +539,139 @@ bool XorMachineInst::Verify() const {
   return RMICheck(GetOperand(0), GetOperand(1));
 }
 
-void XorMachineInst::Emit(std::stringstream& SS) const {
+void XorMachineInst::Emit(AsmWriter& SS) const {
   SS << "xor ";
   GetOperand(1).Emit(SS);
   SS << ", ";
   GetOperand(0).Emit(SS);
 }
 
-void RetMachineInst::Emit(std::stringstream& SS) const {
+void RetMachineInst::Emit(AsmWriter& SS) const {
   SS << "ret";
 }
 
-void PushMachineInst::Emit(std::stringstream& SS) const {
+void PushMachineInst::Emit(AsmWriter& SS) const {
   SS << "push ";
   GetOperand(0).Emit(SS);
 }
 
-void PopMachineInst::Emit(std::stringstream& SS) const {
+void PopMachineInst::Emit(AsmWriter& SS) const {
   SS << "pop ";
   GetOperand(0).Emit(SS);
 }
 
-void CallMachineInst::Emit(std::stringstream& SS) const {
-  SS << "call " << kFunctionPrefix << Callee_;
+std::string CallMachineInst::Symbol() const {
+  return (Native_ ? kRuntimePrefix : kFunctionPrefix) + Callee_;
 }
 
-void LeaMachineInst::Emit(std::stringstream& SS) const {
+std::vector<std::pair<MachineOperand, MachineOperand>> CallMachineInst::ArgumentMoves() const {
+  auto Reg = MachineOperand::CreateRegister;
+  auto Holds = [](const MachineOperand& Op, MachineRegister R) {
+    return Op.IsMachineRegister() && Op.GetRegister() == R;
+  };
+
+  std::vector<std::pair<MachineOperand, MachineOperand>> Moves;
+  if(Size() > 2) {
+    Moves.push_back({ GetOperand(2), Reg(RDX) });
+  }
+  if(Size() == 1) {
+    Moves.push_back({ GetOperand(0), Reg(RDI) });
+  } else if(Size() >= 2) {
+    auto First = GetOperand(0), Second = GetOperand(1);
+    if(!Holds(Second, RDI)) {
+      Moves.push_back({ First, Reg(RDI) });
+      Moves.push_back({ Second, Reg(RSI) });
+    } else if(!Holds(First, RSI)) {
+      Moves.push_back({ Second, Reg(RSI) });
+      Moves.push_back({ First, Reg(RDI) });
+    } else {
+      // swapped
+      Moves.push_back({ Second, Reg(RAX) });
+      Moves.push_back({ First, Reg(RDI) });
+      Moves.push_back({ Reg(RAX), Reg(RSI) });
+    }
+  }
+
+  Moves.erase(std::remove_if(Moves.begin(), Moves.end(), [&](const auto& Move) {
+    return Holds(Move.first, Move.second.GetRegister());
+  }), Moves.end());
+  return Moves;
+}
+
+void CallMachineInst::Emit(AsmWriter& SS) const {
+  for(auto &[Src, Dst] : ArgumentMoves()) {
+    SS << "mov ";
+    Dst.Emit(SS);
+    SS << ", ";
+    Src.Emit(SS);
+    SS << "\n";
+  }
+  SS << "call " << Symbol();
+}
+
+void TailCallMachineInst::Emit(AsmWriter& SS) const {
+  SS << "jmp " << kFunctionPrefix << Callee_;
+}
+
+void LeaMachineInst::Emit(AsmWriter& SS) const {
   SS << "lea ";
   GetOperand(0).Emit(SS);
   SS << ", " << Label_;
 }
 
-void CqoMachineInst::Emit(std::stringstream& SS) const {
+void CqoMachineInst::Emit(AsmWriter& SS) const {
   SS << "cqo";
 }
 
+// Shared head of the array accesses: array in rax, index in rdx, and a jump
+// to 2f once both checks pass. A negative index fails the unsigned compare.
+// The runtime call under 1: reports the error and does not return.
+static void EmitArrayCheck(AsmWriter& SS, const MachineOperand& Array, const MachineOperand& Index) {
+  SS << "mov rax, ";
+  Array.Emit(SS);
+  SS << "\nmov rdx, ";
+  Index.Emit(SS);
+  SS << "\ntest rax, rax\n";
+  SS << "je 1f\n";
+  SS << "cmp rdx, qword ptr [rax]\n";
+  SS << "jb 2f\n";
+  SS << "1:\n";
+}
+
+void ArrayLoadMachineInst::Emit(AsmWriter& SS) const {
+  EmitArrayCheck(SS, GetOperand(0), GetOperand(1));
+  SS << "mov rdi, rax\nmov rsi, rdx\n";
+  SS << "call " << kRuntimePrefix << "array_load\n";
+  SS << "2:\n";
+  auto Dst = GetOperand(2);
+  if(Dst.IsRegister()) {
+    SS << "mov ";
+    Dst.Emit(SS);
+    SS << ", qword ptr [rax + rdx*8 + " << kArrayDataOffset << "]";
+  } else {
+    SS << "mov rax, qword ptr [rax + rdx*8 + " << kArrayDataOffset << "]\nmov ";
+    Dst.Emit(SS);
+    SS << ", rax";
+  }
+}
+
+void ArrayStoreMachineInst::Emit(AsmWriter& SS) const {
+  EmitArrayCheck(SS, GetOperand(0), GetOperand(1));
+  SS << "mov rdi, rax\nmov rsi, rdx\n";
+  SS << "call " << kRuntimePrefix << "array_store\n";
+  SS << "2:\n";
+  auto Value = GetOperand(2);
+  if(Value.IsRegister()) {
+    SS << "mov qword ptr [rax + rdx*8 + " << kArrayDataOffset << "], ";
+    Value.Emit(SS);
+  } else {
+    // both scratch registers are taken, address the element through rax
+    SS << "lea rax, qword ptr [rax + rdx*8 + " << kArrayDataOffset << "]\nmov rdx, ";
+    Value.Emit(SS);
+    SS << "\nmov qword ptr [rax], rdx";
+  }
+}
+
 MachineBasicBlock* MachineFuncBuilder::CreateBlock(const char* Name) {
   auto *BB = new MachineBasicBlock(Name);
   MFunction_->AddBasicBlock(BB);
@@ -539,13 +694,20 @@ void MachineFuncBuilder::Generate() {
     }
   }
 
-  ListScheduler Scheduler(MFunction_);
+  ListScheduler Scheduler(MFunction_, Model_);
   Scheduler.Schedule();
 
   LinearScanRegAlloc RA(MFunction_);
   if(!RA.Allocate()) {
     throw std::runtime_error("Failed to allocate registers");
   }
+
+  // spill code and call-save moves are only known now
+  ListScheduler PostRAScheduler(MFunction_, Model_, SchedulePhase::PostRA);
+  PostRAScheduler.Schedule();
+
+  BlockPlacement Placement(MFunction_);
+  Placement.Place();
   return;
 }
 
@@ -575,12 +737,22 @@ MachineOperand MachineFuncBuilder::ConvertOperand(const Operand& Op) {
   return MachineOperand::CreateMemory(MachineRegister::RBP, (Op.Param() + 2) * MachineOperand::WordSize());
 }
 
+std::vector<MachineOperand> MachineFuncBuilder::ConvertArguments(Instruction& Call) {
+  std::vector<MachineOperand> Args;
+  for(size_t i = 0; i < Call.Ins(); i++) {
+    Args.push_back(ConvertOperand(Call.GetIn(i)));
+  }
+  return Args;
+}
+
 void MachineFuncBuilder::HandleLogicalBinaryInst(BinaryInst& Inst) {
   auto Op = Inst.GetOperation();
   auto Dst = Inst.GetOut(0);
   auto Src1 = Inst.GetIn(0);
   auto Src2 = Inst.GetIn(1);
 
+  // InstCombine moves immediates to the right, but functions are not
+  // always optimized before they get here
   if(Src1.IsImmediate()) {
     assert(!Src2.IsImmediate() && "Constant expressions should already be optimized");
     switch(Op) {
@@ -787,6 +959,11 @@ void MachineFuncBuilder::GenerateInstruction(Instruction& Inst) {
 
     case Instruction::Call: {
       auto &CallI = static_cast<CallInst&>(Inst);
+      if(NativeCalls_ && CallI.GetIntrinsic() != nullptr) {
+        NativeCall(CallI.Callee(), ConvertArguments(CallI));
+        Mov(MachineOperand::CreateRegister(MachineRegister::RAX), ConvertOperand(CallI.GetOut(0)));
+        break;
+      }
       for(int i = CallI.Ins() - 1; i >= 0; i--) {
         Push(ConvertOperand(CallI.GetIn(i)));
       }
@@ -800,6 +977,10 @@ void MachineFuncBuilder::GenerateInstruction(Instruction& Inst) {
     }
     case Instruction::CallVoid: {
       auto &CallI = static_cast<CallVoidInst&>(Inst);
+      if(NativeCalls_ && CallI.GetIntrinsic() != nullptr) {
+        NativeCall(CallI.Callee(), ConvertArguments(CallI));
+        break;
+      }
       for(int i = CallI.Ins() - 1; i >= 0; i--) {
         Push(ConvertOperand(CallI.GetIn(i)));
       }
@@ -811,6 +992,42 @@ void MachineFuncBuilder::GenerateInstruction(Instruction& Inst) {
       break; 
     }
 
+    case Instruction::TailCall: {
+      auto &CallI = static_cast<TailCallInst&>(Inst);
+      // the runtime does not take klang frames, return its result instead
+      if(NativeCalls_ && FindIntrinsic(CallI.Callee()) != nullptr) {
+        NativeCall(CallI.Callee(), ConvertArguments(CallI));
+        Ret();
+        break;
+      }
+
+      // the arguments may read our own parameters, so evaluate all of them
+      // before overwriting the argument area with the callee's arguments
+      std::vector<MachineOperand> Args;
+      for(size_t i = 0; i < CallI.Ins(); i++) {
+        auto Arg = NewReg();
+        Mov(ConvertOperand(CallI.GetIn(i)), Arg);
+        Args.push_back(Arg);
+      }
+      for(size_t i = 0; i < Args.size(); i++) {
+        Mov(Args[i], MachineOperand::CreateMemory(MachineRegister::RBP, (i + 2) * MachineOperand::WordSize()));
+      }
+      TailCall(CallI.Callee());
+      break;
+    }
+
+    case Instruction::ArrayNew: {
+      auto Size = ConvertOperand(Inst.GetIn(0));
+      if(NativeCalls_) {
+        NativeCall("array_new", { Size });
+      } else {
+        Push(Size);
+        Call("array_new");
+        Add(MachineOperand::CreateImmediate(MachineOperand::WordSize()), MachineOperand::CreateRegister(MachineRegister::RSP));
+      }
+      Mov(MachineOperand::CreateRegister(MachineRegister::RAX), ConvertOperand(Inst.GetOut(0)));
+      break;
+    }
     case Instruction::LoadLabel: {
       auto &LoadI = static_cast<LoadLabelInst&>(Inst);
       Lea(LoadI.Label(), ConvertOperand(LoadI.GetOut(0)));
@@ -822,11 +1039,7 @@ void MachineFuncBuilder::GenerateInstruction(Instruction& Inst) {
       auto Array = ConvertOperand(ArrayLoadI.GetIn(0));
       auto Idx = ConvertOperand(ArrayLoadI.GetIn(1));
 
-      Push(Idx);
-      Push(Array);
-      Call("array_load");
-      Add(MachineOperand::CreateImmediate(2 * MachineOperand::WordSize()), MachineOperand::CreateRegister(MachineRegister::RSP));
-      Mov(MachineOperand::CreateRegister(MachineRegister::RAX), RetVal);
+      ArrayLoad(Array, Idx, RetVal);
       break;
     }
     case Instruction::ArrayStore: {
@@ -835,11 +1048,7 @@ void MachineFuncBuilder::GenerateInstruction(Instruction& Inst) {
       auto Idx = ConvertOperand(ArrayStoreI.GetIn(1));
       auto Val = ConvertOperand(ArrayStoreI.GetIn(2));
 
-      Push(Val);
-      Push(Idx);
-      Push(Array);
-      Call("array_store");
-      Add(MachineOperand::CreateImmediate(3 * MachineOperand::WordSize()), MachineOperand::CreateRegister(MachineRegister::RSP));
+      ArrayStore(Array, Idx, Val);
       break;
     }
 
@@ -850,42 +1059,53 @@ void MachineFuncBuilder::GenerateInstruction(Instruction& Inst) {
   return;
 }
 
-bool ModuleCodegen::Generate() {
-  ModuleSS_ << ".intel_syntax noprefix\n";
-
-  ModuleSS_ << ".text\n";
-  for(auto *F : (*Module_)) {
-    MachineFuncBuilder Builder(F);
-    Builder.Generate();
-    Builder.GetFunction()->Emit(ModuleSS_);
-    ModuleSS_ << '\n';
-  }
-
-  ModuleSS_ << ".data\n";
-  GenerateStringLiterals();
-  return true; 
+// each function is built, written out and freed before the next one, so only
+// one MachineFunction is alive at a time
+MachineFunction* ModuleCodegen::GenerateFunction(Function* F) const {
+  MachineFuncBuilder Builder(F, Model_, NativeCalls_);
+  Builder.Generate();
+  return Builder.GetFunction();
 }
 
-void ModuleCodegen::GenerateStringLiterals() {
+// in the layout of runtime/api.c: the length, the characters and a NUL
+void ModuleCodegen::GenerateStringLiterals(AsmWriter& Out) {
   for(auto &KV : IRGenCtx_->StringLiterals) {
-    ModuleSS_ << KV.second << ":\n";
-    ModuleSS_ << ".byte ";
+    Out << ".balign 8\n";
+    Out << KV.second << ":\n";
+    Out << ".quad " << KV.first.size() << "\n";
+    Out << ".byte ";
     for(size_t i = 0; i < KV.first.size(); ++i) {
-      ModuleSS_ << static_cast<int>(KV.first[i]) << ", ";
+      Out << static_cast<int>(KV.first[i]) << ", ";
     }
-    ModuleSS_ << "0\n";
+    Out << "0\n";
   }
 }
 
 bool ModuleCodegen::Save(const char* FileName) {
+  if(Format_ == OutputFormat::Object) {
+    return SaveObject(FileName);
+  }
+
   FILE* F = fopen(FileName, "w");
   if(F == nullptr) {
     ERROR("Failed to open file %s", FileName);
     return false; 
   }
 
-  auto S = ModuleSS_.str();
-  if(fwrite(S.c_str(), 1, S.size(), F) != S.size()) {
+  // functions are streamed one at a time through the writer's buffer
+  AsmWriter Out(F);
+  Out << ".intel_syntax noprefix\n";
+  Out << ".text\n";
+  for(auto *Func : (*Module_)) {
+    auto *MF = GenerateFunction(Func);
+    MF->Emit(Out);
+    Out << '\n';
+    delete MF;
+  }
+  Out << ".data\n";
+  GenerateStringLiterals(Out);
+
+  if(!Out.Flush()) {
     ERROR("Failed to write to file %s", FileName);
     fclose(F);
     return false;
@@ -894,4 +1114,32 @@ bool ModuleCodegen::Save(const char* FileName) {
   return true;
 }
 
+void ModuleCodegen::Encode(ObjectBuffer& Object) const {
+  for(auto *Func : (*Module_)) {
+    auto *MF = GenerateFunction(Func);
+    Object.AddFunction(MF);
+    delete MF;
+  }
+  for(auto &KV : IRGenCtx_->StringLiterals) {
+    Object.AddStringLiteral(KV.second, KV.first);
+  }
+}
+
+bool ModuleCodegen::SaveObject(const char* FileName) {
+  ELFObjectWriter Writer;
+  Encode(Writer);
+  return Writer.Write(FileName);
+}
+
+int ModuleCodegen::Execute() {
+  ObjectBuffer Object;
+  Encode(Object);
+
+  JITModule JIT;
+  if(!JIT.Load(Object)) {
+    return 1;
+  }
+  return JIT.Run();
+}
+
 } // namespace klang
\ No newline at end of file
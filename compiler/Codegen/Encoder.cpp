@@ -0,0 +1,382 @@
+#include <Codegen/Encoder.h>
+
+#include <elf.h>
+
+namespace klang {
+
+static unsigned RegisterNumber(MachineRegister Reg) {
+  switch(Reg) {
+    case MachineRegister::RAX: return 0;
+    case MachineRegister::RCX: return 1;
+    case MachineRegister::RDX: return 2;
+    case MachineRegister::RBX: return 3;
+    case MachineRegister::RSP: return 4;
+    case MachineRegister::RBP: return 5;
+    case MachineRegister::RSI: return 6;
+    case MachineRegister::RDI: return 7;
+    case MachineRegister::R8: return 8;
+    case MachineRegister::R9: return 9;
+    case MachineRegister::R10: return 10;
+    case MachineRegister::R11: return 11;
+    case MachineRegister::R12: return 12;
+    case MachineRegister::R13: return 13;
+    case MachineRegister::R14: return 14;
+    case MachineRegister::R15: return 15;
+    default: {
+      assert(false && "Register has no encoding");
+      __builtin_unreachable();
+    }
+  }
+}
+
+static unsigned ConditionCode(Condition Cond) {
+  switch(Cond) {
+    case Condition::E: return 0x4;
+    case Condition::NE: return 0x5;
+    case Condition::L: return 0xc;
+    case Condition::GE: return 0xd;
+    case Condition::LE: return 0xe;
+    case Condition::G: return 0xf;
+    default: __builtin_unreachable();
+  }
+}
+
+static bool IsInt8(int64_t Imm) {
+  return Imm >= INT8_MIN && Imm <= INT8_MAX;
+}
+
+static bool IsInt32(int64_t Imm) {
+  return Imm >= INT32_MIN && Imm <= INT32_MAX;
+}
+
+void X86Encoder::EmitImmediate(int64_t Imm, size_t Size) {
+  for(size_t i = 0; i < Size; i++) {
+    Bytes_.push_back(static_cast<uint8_t>(static_cast<uint64_t>(Imm) >> (i * 8)));
+  }
+}
+
+void X86Encoder::EmitRM(bool Wide, std::vector<uint8_t> Opcode, unsigned Reg, const MachineOperand& RM) {
+  uint8_t Rex = 0x40 | (Wide ? 0x8 : 0) | ((Reg & 8) ? 0x4 : 0);
+  if(RM.IsRegister()) {
+    unsigned Num = RegisterNumber(RM.GetRegister());
+    Rex |= (Num & 8) ? 0x1 : 0;
+    if(Rex != 0x40) {
+      Bytes_.push_back(Rex);
+    }
+    Bytes_.insert(Bytes_.end(), Opcode.begin(), Opcode.end());
+    Bytes_.push_back(0xc0 | ((Reg & 7) << 3) | (Num & 7));
+    return;
+  }
+
+  assert(RM.IsMemory() && "Invalid r/m operand");
+  unsigned Base = RegisterNumber(RM.GetMemoryBase());
+  bool HasIndex = RM.GetMemoryIndex() != MachineRegister::None;
+  unsigned Index = HasIndex ? RegisterNumber(RM.GetMemoryIndex()) : 4;
+  int64_t Disp = RM.GetMemoryDisp();
+  assert(IsInt32(Disp) && "Displacement out of range");
+  assert((!HasIndex || Index != 4) && "rsp cannot be an index");
+
+  Rex |= (Index & 8) ? 0x2 : 0;
+  Rex |= (Base & 8) ? 0x1 : 0;
+  if(Rex != 0x40) {
+    Bytes_.push_back(Rex);
+  }
+  Bytes_.insert(Bytes_.end(), Opcode.begin(), Opcode.end());
+
+  // rbp/r13 as a base always need a displacement, rsp/r12 always need a SIB
+  uint8_t Mod = 0x80;
+  if(Disp == 0 && (Base & 7) != 5) {
+    Mod = 0x00;
+  } else if(IsInt8(Disp)) {
+    Mod = 0x40;
+  }
+  bool NeedsSIB = HasIndex || (Base & 7) == 4;
+  Bytes_.push_back(Mod | ((Reg & 7) << 3) | (NeedsSIB ? 4 : (Base & 7)));
+  if(NeedsSIB) {
+    Bytes_.push_back(((Index & 7) << 3) | (Base & 7));
+  }
+  if(Mod == 0x40) {
+    EmitImmediate(Disp, 1);
+  } else if(Mod == 0x80) {
+    EmitImmediate(Disp, 4);
+  }
+}
+
+void X86Encoder::EmitArrayElement(uint8_t Opcode, unsigned Reg) {
+  Bytes_.push_back(0x48 | ((Reg & 8) ? 0x4 : 0));
+  Bytes_.push_back(Opcode);
+  Bytes_.push_back(0x44 | ((Reg & 7) << 3));
+  // SIB: scale 8, index rdx, base rax
+  Bytes_.push_back(0xd0);
+  EmitImmediate(kArrayDataOffset, 1);
+}
+
+void X86Encoder::EncodeArith(uint8_t OpcodeMR, uint8_t OpcodeRM, uint8_t Ext, const MachineOperand& Src, const MachineOperand& Dst) {
+  if(Src.IsImmediate()) {
+    int64_t Imm = Src.GetImmediate();
+    assert(IsInt32(Imm) && "Immediate out of range");
+    EmitRM(true, {IsInt8(Imm) ? uint8_t(0x83) : uint8_t(0x81)}, Ext, Dst);
+    EmitImmediate(Imm, IsInt8(Imm) ? 1 : 4);
+  } else if(Src.IsRegister()) {
+    EmitRM(true, {OpcodeMR}, RegisterNumber(Src.GetRegister()), Dst);
+  } else {
+    assert(Dst.IsRegister() && "Memory to memory operation");
+    EmitRM(true, {OpcodeRM}, RegisterNumber(Dst.GetRegister()), Src);
+  }
+}
+
+void X86Encoder::EncodeMov(const MachineOperand& Src, const MachineOperand& Dst) {
+  if(Src.IsImmediate()) {
+    int64_t Imm = Src.GetImmediate();
+    if(IsInt32(Imm)) {
+      EmitRM(true, {0xc7}, 0, Dst);
+      EmitImmediate(Imm, 4);
+      return;
+    }
+    // movabs
+    assert(Dst.IsRegister() && "64-bit immediate needs a register destination");
+    unsigned Num = RegisterNumber(Dst.GetRegister());
+    Bytes_.push_back(0x48 | ((Num & 8) ? 0x1 : 0));
+    Bytes_.push_back(0xb8 | (Num & 7));
+    EmitImmediate(Imm, 8);
+  } else if(Src.IsRegister()) {
+    EmitRM(true, {0x89}, RegisterNumber(Src.GetRegister()), Dst);
+  } else {
+    assert(Dst.IsRegister() && "Memory to memory move");
+    EmitRM(true, {0x8b}, RegisterNumber(Dst.GetRegister()), Src);
+  }
+}
+
+void X86Encoder::EncodeTest(const MachineOperand& Op1, const MachineOperand& Op2) {
+  if(Op1.IsImmediate()) {
+    assert(IsInt32(Op1.GetImmediate()) && "Immediate out of range");
+    EmitRM(true, {0xf7}, 0, Op2);
+    EmitImmediate(Op1.GetImmediate(), 4);
+  } else if(Op1.IsRegister()) {
+    EmitRM(true, {0x85}, RegisterNumber(Op1.GetRegister()), Op2);
+  } else {
+    // test is symmetric, the memory operand goes into r/m
+    EmitRM(true, {0x85}, RegisterNumber(Op2.GetRegister()), Op1);
+  }
+}
+
+void X86Encoder::EncodeIMul(const MachineOperand& Src, const MachineOperand& Dst) {
+  unsigned Reg = RegisterNumber(Dst.GetRegister());
+  if(Src.IsImmediate()) {
+    int64_t Imm = Src.GetImmediate();
+    assert(IsInt32(Imm) && "Immediate out of range");
+    EmitRM(true, {IsInt8(Imm) ? uint8_t(0x6b) : uint8_t(0x69)}, Reg, Dst);
+    EmitImmediate(Imm, IsInt8(Imm) ? 1 : 4);
+  } else {
+    EmitRM(true, {0x0f, 0xaf}, Reg, Src);
+  }
+}
+
+void X86Encoder::EncodeSymbol(std::vector<uint8_t> Opcode, const std::string& Symbol, uint32_t Type) {
+  Bytes_.insert(Bytes_.end(), Opcode.begin(), Opcode.end());
+  // the field is the last thing in the instruction, so it is relative to its own end
+  Relocations_.push_back({Bytes_.size(), Symbol, Type, -4});
+  EmitImmediate(0, 4);
+}
+
+// Same sequence as ArrayLoadMachineInst::Emit and ArrayStoreMachineInst::Emit
+void X86Encoder::EncodeArrayAccess(const MachineInstruction* Inst) {
+  bool IsLoad = Inst->GetOpcode() == MachineInstruction::Opcode::ArrayLoad;
+  auto Array = MachineOperand::CreateRegister(MachineRegister::RAX);
+  auto Index = MachineOperand::CreateRegister(MachineRegister::RDX);
+  EncodeMov(Inst->GetOperand(0), Array);
+  EncodeMov(Inst->GetOperand(1), Index);
+  EncodeTest(Array, Array);
+  EncodeJump(Condition::E, 0, true);
+  size_t NullCheck = Bytes_.size();
+  EmitRM(true, {0x3b}, RegisterNumber(MachineRegister::RDX), MachineOperand::CreateMemory(MachineRegister::RAX));
+  // jb, there is no Condition for unsigned compares
+  Bytes_.push_back(0x72);
+  Bytes_.push_back(0);
+  size_t BoundsCheck = Bytes_.size();
+
+  // does not return
+  EncodeMov(Array, MachineOperand::CreateRegister(MachineRegister::RDI));
+  EncodeMov(Index, MachineOperand::CreateRegister(MachineRegister::RSI));
+  EncodeSymbol({0xe8}, std::string(kRuntimePrefix) + (IsLoad ? "array_load" : "array_store"), R_X86_64_PLT32);
+  Bytes_[NullCheck - 1] = static_cast<uint8_t>(BoundsCheck - NullCheck);
+  Bytes_[BoundsCheck - 1] = static_cast<uint8_t>(Bytes_.size() - BoundsCheck);
+
+  auto Value = Inst->GetOperand(2);
+  if(IsLoad) {
+    if(Value.IsRegister()) {
+      EmitArrayElement(0x8b, RegisterNumber(Value.GetRegister()));
+    } else {
+      EmitArrayElement(0x8b, RegisterNumber(MachineRegister::RAX));
+      EncodeMov(Array, Value);
+    }
+  } else if(Value.IsRegister()) {
+    EmitArrayElement(0x89, RegisterNumber(Value.GetRegister()));
+  } else {
+    EmitArrayElement(0x8d, RegisterNumber(MachineRegister::RAX));
+    EncodeMov(Value, Index);
+    EncodeMov(Index, MachineOperand::CreateMemory(MachineRegister::RAX));
+  }
+}
+
+void X86Encoder::Encode(const MachineInstruction* Inst) {
+  switch(Inst->GetOpcode()) {
+    case MachineInstruction::Opcode::Mov: {
+      EncodeMov(Inst->GetOperand(0), Inst->GetOperand(1));
+      break;
+    }
+    case MachineInstruction::Opcode::CMov: {
+      auto *CMov = static_cast<const CMovMachineInst*>(Inst);
+      uint8_t Opcode = 0x40 | ConditionCode(CMov->GetCondition());
+      EmitRM(true, {0x0f, Opcode}, RegisterNumber(Inst->GetOperand(1).GetRegister()), Inst->GetOperand(0));
+      break;
+    }
+    case MachineInstruction::Opcode::Add: {
+      EncodeArith(0x01, 0x03, 0, Inst->GetOperand(0), Inst->GetOperand(1));
+      break;
+    }
+    case MachineInstruction::Opcode::Or: {
+      EncodeArith(0x09, 0x0b, 1, Inst->GetOperand(0), Inst->GetOperand(1));
+      break;
+    }
+    case MachineInstruction::Opcode::And: {
+      EncodeArith(0x21, 0x23, 4, Inst->GetOperand(0), Inst->GetOperand(1));
+      break;
+    }
+    case MachineInstruction::Opcode::Sub: {
+      EncodeArith(0x29, 0x2b, 5, Inst->GetOperand(0), Inst->GetOperand(1));
+      break;
+    }
+    case MachineInstruction::Opcode::Xor: {
+      EncodeArith(0x31, 0x33, 6, Inst->GetOperand(0), Inst->GetOperand(1));
+      break;
+    }
+    case MachineInstruction::Opcode::Cmp: {
+      EncodeArith(0x39, 0x3b, 7, Inst->GetOperand(0), Inst->GetOperand(1));
+      break;
+    }
+    case MachineInstruction::Opcode::Test: {
+      EncodeTest(Inst->GetOperand(0), Inst->GetOperand(1));
+      break;
+    }
+    case MachineInstruction::Opcode::IMul: {
+      EncodeIMul(Inst->GetOperand(0), Inst->GetOperand(1));
+      break;
+    }
+    case MachineInstruction::Opcode::IDiv: {
+      EmitRM(true, {0xf7}, 7, Inst->GetOperand(0));
+      break;
+    }
+    case MachineInstruction::Opcode::Cqo: {
+      Bytes_.push_back(0x48);
+      Bytes_.push_back(0x99);
+      break;
+    }
+    case MachineInstruction::Opcode::Push: {
+      auto Op = Inst->GetOperand(0);
+      if(Op.IsImmediate()) {
+        int64_t Imm = Op.GetImmediate();
+        assert(IsInt32(Imm) && "Immediate out of range");
+        Bytes_.push_back(IsInt8(Imm) ? 0x6a : 0x68);
+        EmitImmediate(Imm, IsInt8(Imm) ? 1 : 4);
+        break;
+      }
+      if(Op.IsMemory()) {
+        // call arguments are pushed straight from their stack slot
+        EmitRM(false, {0xff}, 6, Op);
+        break;
+      }
+      unsigned Num = RegisterNumber(Op.GetRegister());
+      if(Num & 8) {
+        Bytes_.push_back(0x41);
+      }
+      Bytes_.push_back(0x50 | (Num & 7));
+      break;
+    }
+    case MachineInstruction::Opcode::Pop: {
+      auto Op = Inst->GetOperand(0);
+      if(Op.IsMemory()) {
+        EmitRM(false, {0x8f}, 0, Op);
+        break;
+      }
+      unsigned Num = RegisterNumber(Op.GetRegister());
+      if(Num & 8) {
+        Bytes_.push_back(0x41);
+      }
+      Bytes_.push_back(0x58 | (Num & 7));
+      break;
+    }
+    case MachineInstruction::Opcode::Ret: {
+      Bytes_.push_back(0xc3);
+      break;
+    }
+    case MachineInstruction::Opcode::Call: {
+      auto *Call = static_cast<const CallMachineInst*>(Inst);
+      for(auto &[Src, Dst] : Call->ArgumentMoves()) {
+        EncodeMov(Src, Dst);
+      }
+      EncodeSymbol({0xe8}, Call->Symbol(), R_X86_64_PLT32);
+      break;
+    }
+    case MachineInstruction::Opcode::TailCall: {
+      auto *Call = static_cast<const TailCallMachineInst*>(Inst);
+      EncodeSymbol({0xe9}, std::string(kFunctionPrefix) + Call->Callee(), R_X86_64_PLT32);
+      break;
+    }
+    case MachineInstruction::Opcode::Lea: {
+      // lea reg, [rip + label]
+      auto *Lea = static_cast<const LeaMachineInst*>(Inst);
+      unsigned Num = RegisterNumber(Inst->GetOperand(0).GetRegister());
+      Bytes_.push_back(0x48 | ((Num & 8) ? 0x4 : 0));
+      EncodeSymbol({0x8d, uint8_t(0x05 | ((Num & 7) << 3))}, Lea->Label(), R_X86_64_PC32);
+      break;
+    }
+    case MachineInstruction::Opcode::ArrayLoad:
+    case MachineInstruction::Opcode::ArrayStore: {
+      EncodeArrayAccess(Inst);
+      break;
+    }
+    case MachineInstruction::Opcode::Jmp:
+    case MachineInstruction::Opcode::Jcc: {
+      assert(false && "Branches are encoded once the block layout is known");
+      break;
+    }
+    default: {
+      assert(false && "Unhandled opcode");
+    }
+  }
+}
+
+size_t X86Encoder::JumpSize(bool Conditional, bool Short) {
+  if(Short) {
+    return 2;
+  }
+  return Conditional ? 6 : 5;
+}
+
+void X86Encoder::EncodeIndirectCall(MachineRegister Reg) {
+  EmitRM(false, {0xff}, 2, MachineOperand::CreateRegister(Reg));
+}
+
+void X86Encoder::EncodeIndirectJump(MachineRegister Reg) {
+  EmitRM(false, {0xff}, 4, MachineOperand::CreateRegister(Reg));
+}
+
+void X86Encoder::EncodeJump(std::optional<Condition> Cond, int64_t Disp, bool Short) {
+  if(Short) {
+    assert(IsInt8(Disp) && "Short jump out of range");
+    Bytes_.push_back(Cond.has_value() ? 0x70 | ConditionCode(*Cond) : 0xeb);
+    EmitImmediate(Disp, 1);
+    return;
+  }
+  assert(IsInt32(Disp) && "Jump out of range");
+  if(Cond.has_value()) {
+    Bytes_.push_back(0x0f);
+    Bytes_.push_back(0x80 | ConditionCode(*Cond));
+  } else {
+    Bytes_.push_back(0xe9);
+  }
+  EmitImmediate(Disp, 4);
+}
+
+} // namespace klang
@@ -1,34 +1,74 @@
 #include <Codegen/InstSched.h>
 #include <Logging.h>
 
+#include <algorithm>
 #include <map>
+#include <optional>
 #include <queue>
+#include <unordered_map>
 
 namespace klang {
 
+using VirtUseMap = std::map<size_t, std::vector<PrecedenceGraphNode*>>;
+using PhysUseMap = std::map<MachineRegister, std::vector<PrecedenceGraphNode*>>;
+
+// frame slots are identified by base register and displacement
+using MemoryLocation = std::pair<MachineRegister, int64_t>;
+using MemDefMap = std::map<MemoryLocation, PrecedenceGraphNode*>;
+using MemUseMap = std::map<MemoryLocation, std::vector<PrecedenceGraphNode*>>;
+
 static void UpdateDefs(
   std::map<size_t, PrecedenceGraphNode*>& VirtDefs, 
   std::map<MachineRegister, PrecedenceGraphNode*>& PhysDefs,
+  VirtUseMap& VirtUses,
+  PhysUseMap& PhysUses,
   PrecedenceGraphNode* &FlagsDef, 
+  std::vector<PrecedenceGraphNode*>& FlagsUses,
   PrecedenceGraphNode* Node) {
   auto *Inst = Node->Instruction();
 
+  // a write must stay behind earlier reads (WAR) and writes (WAW) of the same register
+  auto OrderAfter = [&](PrecedenceGraphNode* Prev, PrecedenceGraphNode* Node) {
+    if(Prev != nullptr && Prev != Node) {
+      Prev->UsedBy(Node);
+    }
+  };
+
   auto UpdateDefByOperand = [&](MachineOperand Op, PrecedenceGraphNode* Node) {
     if(Op.IsVirtualRegister()) {
-      VirtDefs[Op.GetVirtualRegister()] = Node;
+      auto Reg = Op.GetVirtualRegister();
+      OrderAfter(VirtDefs.count(Reg) ? VirtDefs[Reg] : nullptr, Node);
+      for(auto *User : VirtUses[Reg]) {
+        OrderAfter(User, Node);
+      }
+      VirtUses.erase(Reg);
+      VirtDefs[Reg] = Node;
     } else if(Op.IsMachineRegister()) {
-      PhysDefs[Op.GetRegister()] = Node;
+      auto Reg = Op.GetRegister();
+      OrderAfter(PhysDefs.count(Reg) ? PhysDefs[Reg] : nullptr, Node);
+      for(auto *User : PhysUses[Reg]) {
+        OrderAfter(User, Node);
+      }
+      PhysUses.erase(Reg);
+      PhysDefs[Reg] = Node;
     }
   };
 
   auto UpdateFlagsDef = [&](PrecedenceGraphNode* Node) {
+    for(auto *User : FlagsUses) {
+      OrderAfter(User, Node);
+    }
+    FlagsUses.clear();
     FlagsDef = Node;
   };
 
   auto InvalidateAll = [&]() {
     VirtDefs.clear();
     PhysDefs.clear();
+    VirtUses.clear();
+    PhysUses.clear();
     FlagsDef = nullptr;
+    FlagsUses.clear();
   };
 
   switch(Inst->GetOpcode()) {
@@ -63,6 +103,7 @@ static void UpdateDefs(
     }
 
     case MachineInstruction::Opcode::Ret: 
+    case MachineInstruction::Opcode::TailCall:
     case MachineInstruction::Opcode::Jmp: 
     case MachineInstruction::Opcode::Jcc: {
       break;
@@ -94,6 +135,17 @@ static void UpdateDefs(
       break;
     }
 
+    case MachineInstruction::Opcode::ArrayLoad: {
+      UpdateDefByOperand(Inst->GetOperand(2), Node);
+      // fallthru:
+    }
+    case MachineInstruction::Opcode::ArrayStore: {
+      UpdateDefByOperand(MachineOperand::CreateRegister(RAX), Node);
+      UpdateDefByOperand(MachineOperand::CreateRegister(RDX), Node);
+      UpdateFlagsDef(Node);
+      break;
+    }
+
     default: {
       throw std::runtime_error("Unknown opcode");
     }
@@ -103,9 +155,12 @@ static void UpdateDefs(
 
 static void AddDependency(
   PrecedenceGraphNode* Current, 
-  std::map<size_t, PrecedenceGraphNode*> VirtDefs,
-  std::map<MachineRegister, PrecedenceGraphNode*> PhysDefs, 
-  PrecedenceGraphNode* FlagsDef) {
+  const std::map<size_t, PrecedenceGraphNode*>& VirtDefs,
+  const std::map<MachineRegister, PrecedenceGraphNode*>& PhysDefs, 
+  VirtUseMap& VirtUses,
+  PhysUseMap& PhysUses,
+  PrecedenceGraphNode* FlagsDef,
+  std::vector<PrecedenceGraphNode*>& FlagsUses) {
 
   auto AddDependencyByOperand = [&](MachineOperand Op) {
     if(Op.IsVirtualRegister()) {
@@ -113,11 +168,13 @@ static void AddDependency(
       if(Def != VirtDefs.end()) {
         Def->second->UsedBy(Current);
       }
+      VirtUses[Op.GetVirtualRegister()].push_back(Current);
     } else if(Op.IsMachineRegister()) {
       auto Def = PhysDefs.find(Op.GetRegister()); 
       if(Def != PhysDefs.end()) {
         Def->second->UsedBy(Current);
       }
+      PhysUses[Op.GetRegister()].push_back(Current);
     }
   };
 
@@ -125,9 +182,22 @@ static void AddDependency(
     if(FlagsDef) {
       FlagsDef->UsedBy(Current);
     }
+    FlagsUses.push_back(Current);
   };
 
   auto *Inst = Current->Instruction();
+
+  // registers used to form memory addresses
+  for(size_t i = 0; i < Inst->Size(); i++) {
+    auto Op = Inst->GetOperand(i);
+    if(Op.IsMemory()) {
+      AddDependencyByOperand(MachineOperand::CreateRegister(Op.GetMemoryBase()));
+      if(Op.GetMemoryIndex() != None) {
+        AddDependencyByOperand(MachineOperand::CreateRegister(Op.GetMemoryIndex()));
+      }
+    }
+  }
+
   switch(Inst->GetOpcode()) {
     // XXX: New opcodes need to be added here
     // XXX: Effects of instructions need to be modeled properly
@@ -154,8 +224,15 @@ static void AddDependency(
       break;
     }
 
+    case MachineInstruction::Opcode::Call: {
+      for(size_t i = 0; i < Inst->Size(); i++) {
+        AddDependencyByOperand(Inst->GetOperand(i));
+      }
+      break;
+    }
+
     // Barriers
-    case MachineInstruction::Opcode::Call: 
+    case MachineInstruction::Opcode::TailCall:
     case MachineInstruction::Opcode::Ret: 
     case MachineInstruction::Opcode::Jmp:
     case MachineInstruction::Opcode::Jcc: {
@@ -189,6 +266,18 @@ static void AddDependency(
       break;
     }
 
+    case MachineInstruction::Opcode::ArrayLoad: {
+      AddDependencyByOperand(Inst->GetOperand(0));
+      AddDependencyByOperand(Inst->GetOperand(1));
+      break;
+    }
+    case MachineInstruction::Opcode::ArrayStore: {
+      AddDependencyByOperand(Inst->GetOperand(0));
+      AddDependencyByOperand(Inst->GetOperand(1));
+      AddDependencyByOperand(Inst->GetOperand(2));
+      break;
+    }
+
     default: {
       throw std::runtime_error("Unknown opcode");
     }
@@ -197,99 +286,194 @@ static void AddDependency(
   return;
 }
 
-// A very trivial cycle calculation
-// Uses heuristics to determine the cycle count
-static int CalculateCycle(PrecedenceGraphNode* Node) {
-  auto *Inst = Node->Instruction();
+// Memory operands read and written by an instruction
+static void MemoryEffects(MachineInstruction* Inst, std::vector<MachineOperand>& Reads, std::vector<MachineOperand>& Writes) {
+  auto AddIfMemory = [](std::vector<MachineOperand>& Ops, MachineOperand Op) {
+    if(Op.IsMemory()) {
+      Ops.push_back(Op);
+    }
+  };
+
   switch(Inst->GetOpcode()) {
-    case MachineInstruction::Opcode::Mov:
-    case MachineInstruction::Opcode::CMov: {
-      // XXX: regs are not allocated yet
-      // we don't know if it's a move between regs or a move between reg and mem
-      return 4;
+    case MachineInstruction::Opcode::Mov: {
+      AddIfMemory(Reads, Inst->GetOperand(0));
+      AddIfMemory(Writes, Inst->GetOperand(1));
+      break;
     }
+    case MachineInstruction::Opcode::CMov:
+    case MachineInstruction::Opcode::Add:
+    case MachineInstruction::Opcode::Sub:
+    case MachineInstruction::Opcode::IMul:
     case MachineInstruction::Opcode::Or:
+    case MachineInstruction::Opcode::Xor:
     case MachineInstruction::Opcode::And:
-    case MachineInstruction::Opcode::Xor: 
+    case MachineInstruction::Opcode::Shl:
+    case MachineInstruction::Opcode::Shr: {
+      AddIfMemory(Reads, Inst->GetOperand(0));
+      AddIfMemory(Reads, Inst->GetOperand(1));
+      AddIfMemory(Writes, Inst->GetOperand(1));
+      break;
+    }
+    case MachineInstruction::Opcode::Cmp:
     case MachineInstruction::Opcode::Test: {
-      return 2;
+      AddIfMemory(Reads, Inst->GetOperand(0));
+      AddIfMemory(Reads, Inst->GetOperand(1));
+      break;
     }
-    case MachineInstruction::Opcode::Add:
-    case MachineInstruction::Opcode::Sub:
-    case MachineInstruction::Opcode::Cmp: {
-      return 3;
+    case MachineInstruction::Opcode::IDiv:
+    case MachineInstruction::Opcode::Push: {
+      AddIfMemory(Reads, Inst->GetOperand(0));
+      break;
+    }
+    case MachineInstruction::Opcode::Pop: {
+      AddIfMemory(Writes, Inst->GetOperand(0));
+      break;
+    }
+    // only the stack slots of the operands, elements are ordered by barriers
+    case MachineInstruction::Opcode::ArrayLoad: {
+      AddIfMemory(Reads, Inst->GetOperand(0));
+      AddIfMemory(Reads, Inst->GetOperand(1));
+      AddIfMemory(Writes, Inst->GetOperand(2));
+      break;
+    }
+    case MachineInstruction::Opcode::ArrayStore: {
+      AddIfMemory(Reads, Inst->GetOperand(0));
+      AddIfMemory(Reads, Inst->GetOperand(1));
+      AddIfMemory(Reads, Inst->GetOperand(2));
+      break;
     }
+    default: {
+      break;
+    }
+  }
+}
 
-    case MachineInstruction::Opcode::IMul:
-    case MachineInstruction::Opcode::IDiv: {
-      return 5;
-    }    
+static void AddMemoryDependency(PrecedenceGraphNode* Node, MemDefMap& MemDefs, MemUseMap& MemUses) {
+  std::vector<MachineOperand> Reads, Writes;
+  MemoryEffects(Node->Instruction(), Reads, Writes);
+
+  auto Location = [](const MachineOperand& Op) {
+    assert(Op.GetMemoryIndex() == None && "Indexed memory cannot be disambiguated");
+    return std::make_pair(Op.GetMemoryBase(), Op.GetMemoryDisp());
+  };
 
+  // loads follow the last store to the slot (RAW)
+  for(auto &Op : Reads) {
+    auto Def = MemDefs.find(Location(Op));
+    if(Def != MemDefs.end() && Def->second != Node) {
+      Def->second->UsedBy(Node);
+    }
+  }
+  // stores follow earlier loads (WAR) and stores (WAW) of the slot
+  for(auto &Op : Writes) {
+    auto Loc = Location(Op);
+    auto Def = MemDefs.find(Loc);
+    if(Def != MemDefs.end() && Def->second != Node) {
+      Def->second->UsedBy(Node);
+    }
+    for(auto *User : MemUses[Loc]) {
+      if(User != Node) {
+        User->UsedBy(Node);
+      }
+    }
+    MemUses.erase(Loc);
+  }
+
+  for(auto &Op : Reads) {
+    MemUses[Location(Op)].push_back(Node);
+  }
+  for(auto &Op : Writes) {
+    MemDefs[Location(Op)] = Node;
+  }
+}
+
+static bool IsPostRABarrier(MachineInstruction* Inst) {
+  switch(Inst->GetOpcode()) {
     case MachineInstruction::Opcode::Call:
+    case MachineInstruction::Opcode::TailCall:
     case MachineInstruction::Opcode::Ret:
     case MachineInstruction::Opcode::Jmp:
-    case MachineInstruction::Opcode::Jcc: {
-      return 8;
-    }
-
+    case MachineInstruction::Opcode::Jcc:
     case MachineInstruction::Opcode::Push:
     case MachineInstruction::Opcode::Pop:
-    case MachineInstruction::Opcode::Cqo: {
-      return 1;
+    case MachineInstruction::Opcode::ArrayStore: {
+      return true;
     }
-
-    case MachineInstruction::Opcode::Lea: {
-      return 1;
+    default: {
+      break;
     }
+  }
 
-    default: {
-      throw std::runtime_error("Unknown opcode");
+  // frame setup, teardown and argument cleanup ("op src, rsp/rbp")
+  if(Inst->Size() == 2) {
+    auto Dst = Inst->GetOperand(1);
+    if(Dst.IsMachineRegister() && (Dst.GetRegister() == RSP || Dst.GetRegister() == RBP)) {
+      return true;
     }
   }
-  return 0;
+  return false;
 }
 
 void PrecedenceGraph::Build() {
   std::map<size_t, PrecedenceGraphNode*> VirtDefs;
   std::map<MachineRegister, PrecedenceGraphNode*> PhysDefs;
+  VirtUseMap VirtUses;
+  PhysUseMap PhysUses;
   PrecedenceGraphNode* FlagsDef = nullptr;
+  std::vector<PrecedenceGraphNode*> FlagsUses;
+  MemDefMap MemDefs;
+  MemUseMap MemUses;
 
-  std::set<PrecedenceGraphNode*> BarrierNodes;
+  // Barriers are chained: a barrier follows every node since the previous
+  // barrier, and every node follows the latest barrier. Ordering is the same
+  // as connecting barriers to all nodes, with a linear number of edges.
+  PrecedenceGraphNode* LastBarrier = nullptr;
+  std::vector<PrecedenceGraphNode*> SinceBarrier;
 
   for(auto InstIt = Block_->begin(); InstIt != Block_->end(); InstIt++) {
     auto *Inst = *InstIt;
-    auto *Node = new PrecedenceGraphNode(Inst);
+    auto *Node = new PrecedenceGraphNode(Inst, Nodes_.size());
+    Node->SetLatency(Model_->Info(Inst).Latency_);
+
+    if(LastBarrier != nullptr) {
+      LastBarrier->UsedBy(Node);
+    }
 
-    if(Inst->HasSideEffects()) {
-      BarrierNodes.insert(Node);
+    bool IsBarrier = Phase_ == SchedulePhase::PreRA ? Inst->HasSideEffects() : IsPostRABarrier(Inst);
+    if(IsBarrier) {
+      for(auto *Prev : SinceBarrier) {
+        Prev->UsedBy(Node);
+      }
+      SinceBarrier.clear();
+      LastBarrier = Node;
+      MemDefs.clear();
+      MemUses.clear();
     } else {
-      AddDependency(Node, VirtDefs, PhysDefs, FlagsDef); 
+      AddDependency(Node, VirtDefs, PhysDefs, VirtUses, PhysUses, FlagsDef, FlagsUses); 
+      if(Phase_ == SchedulePhase::PostRA) {
+        AddMemoryDependency(Node, MemDefs, MemUses);
+      }
+      SinceBarrier.push_back(Node);
     }
-    UpdateDefs(VirtDefs, PhysDefs, FlagsDef, Node);
+    UpdateDefs(VirtDefs, PhysDefs, VirtUses, PhysUses, FlagsDef, FlagsUses, Node);
     Nodes_.push_back(Node);
   }
 
-  // handle barrier nodes
-  for(auto *BarrierNode : BarrierNodes) {
-    bool BeforeBarrier = true;
-    for(auto *Node : Nodes_) {
-      if(BeforeBarrier) {
-        if(Node == BarrierNode) {
-          BeforeBarrier = false;
-        } else {
-          Node->UsedBy(BarrierNode);
-        }
-      } else {
-        BarrierNode->UsedBy(Node);
-      }
+  // edges always point forward in the block, so heights can be computed backwards
+  for(auto It = Nodes_.rbegin(); It != Nodes_.rend(); ++It) {
+    auto *Node = *It;
+    int Height = 0;
+    for(auto *Succ : Node->Successors()) {
+      Height = std::max(Height, Succ->Height());
     }
+    Node->SetHeight(Node->Latency() + Height);
   }
 }
 
 std::vector<PrecedenceGraphNode*> PrecedenceGraph::Leaves() const {
   std::vector<PrecedenceGraphNode*> Leafs;
   for(auto *Node : Nodes_) {
-    if(Node->Predecessors().empty()) {
+    if(Node->NumPredecessors() == 0) {
       Leafs.push_back(Node);
     }
   }
@@ -297,47 +481,264 @@ std::vector<PrecedenceGraphNode*> PrecedenceGraph::Leaves() const {
 }
 
 void ListScheduler::Schedule() {
+  if(Phase_ == SchedulePhase::PostRA) {
+    for(auto *Block : (*Function_)) {
+      ScheduleBlock(Block, nullptr, nullptr);
+    }
+    return;
+  }
+
+  // register pressure is only tracked for virtual registers
+  auto [In, Out] = MFDataflowAnalysis<MRegLivenessState, false>(Function_);
   for(auto *Block : (*Function_)) {
-    ScheduleBlock(Block);
+    ScheduleBlock(Block, &In[Block], &Out[Block]);
+  }
+}
+
+// Virtual registers read and written by an instruction
+static void VirtualRegisterEffects(MachineInstruction* Inst, std::vector<size_t>& Uses, std::vector<size_t>& Defs) {
+  auto AddIfVirtual = [](std::vector<size_t>& Regs, MachineOperand Op) {
+    if(Op.IsVirtualRegister() && std::find(Regs.begin(), Regs.end(), Op.GetVirtualRegister()) == Regs.end()) {
+      Regs.push_back(Op.GetVirtualRegister());
+    }
+  };
+
+  switch(Inst->GetOpcode()) {
+    case MachineInstruction::Opcode::Mov: {
+      AddIfVirtual(Uses, Inst->GetOperand(0));
+      AddIfVirtual(Defs, Inst->GetOperand(1));
+      break;
+    }
+    case MachineInstruction::Opcode::Xor: {
+      // xor r, r only defines r
+      if(Inst->GetOperand(0).IsVirtualRegister() && Inst->GetOperand(1).IsVirtualRegister() 
+      && Inst->GetOperand(0).GetVirtualRegister() == Inst->GetOperand(1).GetVirtualRegister()) {
+        AddIfVirtual(Defs, Inst->GetOperand(1));
+        break;
+      }
+      // fallthru:
+    }
+    case MachineInstruction::Opcode::CMov:
+    case MachineInstruction::Opcode::Add:
+    case MachineInstruction::Opcode::Sub:
+    case MachineInstruction::Opcode::IMul:
+    case MachineInstruction::Opcode::Or:
+    case MachineInstruction::Opcode::And:
+    case MachineInstruction::Opcode::Shl:
+    case MachineInstruction::Opcode::Shr: {
+      AddIfVirtual(Uses, Inst->GetOperand(0));
+      AddIfVirtual(Uses, Inst->GetOperand(1));
+      AddIfVirtual(Defs, Inst->GetOperand(1));
+      break;
+    }
+    case MachineInstruction::Opcode::Cmp:
+    case MachineInstruction::Opcode::Test: {
+      AddIfVirtual(Uses, Inst->GetOperand(0));
+      AddIfVirtual(Uses, Inst->GetOperand(1));
+      break;
+    }
+    case MachineInstruction::Opcode::Push:
+    case MachineInstruction::Opcode::IDiv: {
+      AddIfVirtual(Uses, Inst->GetOperand(0));
+      break;
+    }
+    case MachineInstruction::Opcode::Pop:
+    case MachineInstruction::Opcode::Lea: {
+      AddIfVirtual(Defs, Inst->GetOperand(0));
+      break;
+    }
+    case MachineInstruction::Opcode::ArrayLoad: {
+      AddIfVirtual(Uses, Inst->GetOperand(0));
+      AddIfVirtual(Uses, Inst->GetOperand(1));
+      AddIfVirtual(Defs, Inst->GetOperand(2));
+      break;
+    }
+    case MachineInstruction::Opcode::ArrayStore: {
+      AddIfVirtual(Uses, Inst->GetOperand(0));
+      AddIfVirtual(Uses, Inst->GetOperand(1));
+      AddIfVirtual(Uses, Inst->GetOperand(2));
+      break;
+    }
+    case MachineInstruction::Opcode::Call: {
+      for(size_t i = 0; i < Inst->Size(); i++) {
+        AddIfVirtual(Uses, Inst->GetOperand(i));
+      }
+      break;
+    }
+    default: {
+      break;
+    }
   }
 }
 
+// Tracks the virtual registers live at the current point of a top-down schedule
+class PressureTracker {
+public:
+  PressureTracker(const PrecedenceGraph& Graph, const MRegLivenessState& LiveIn, const MRegLivenessState& LiveOut) 
+    : LiveOut_(LiveOut), Live_(LiveIn.Live_) {
+    for(auto *Node : Graph.Nodes()) {
+      auto &Effects = Effects_[Node];
+      VirtualRegisterEffects(Node->Instruction(), Effects.first, Effects.second);
+      for(auto Reg : Effects.first) {
+        RemainingUses_[Reg]++;
+      }
+    }
+  }
+
+  size_t Pressure() const { return Live_.size(); }
+
+  // change in the number of live registers if Node were scheduled next
+  int Delta(PrecedenceGraphNode* Node) {
+    auto &[Uses, Defs] = Effects_[Node];
+    int Delta = 0;
+    for(auto Reg : Uses) {
+      if(Dies(Reg) && std::find(Defs.begin(), Defs.end(), Reg) == Defs.end()) {
+        Delta--;
+      }
+    }
+    for(auto Reg : Defs) {
+      if(Live_.count(Reg) == 0 && (RemainingUses_[Reg] > 0 || LiveOut_.Contains(Reg))) {
+        Delta++;
+      }
+    }
+    return Delta;
+  }
+
+  void Schedule(PrecedenceGraphNode* Node) {
+    auto &[Uses, Defs] = Effects_[Node];
+    for(auto Reg : Uses) {
+      if(Dies(Reg)) {
+        Live_.erase(Reg);
+      }
+      RemainingUses_[Reg]--;
+    }
+    for(auto Reg : Defs) {
+      if(RemainingUses_[Reg] > 0 || LiveOut_.Contains(Reg)) {
+        Live_.insert(Reg);
+      }
+    }
+  }
+
+private:
+  // the use by the node about to be scheduled is the last one
+  bool Dies(size_t Reg) {
+    return RemainingUses_[Reg] == 1 && !LiveOut_.Contains(Reg);
+  }
+
+  const MRegLivenessState& LiveOut_;
+  std::set<size_t> Live_;
+  std::unordered_map<size_t, size_t> RemainingUses_;
+  std::unordered_map<PrecedenceGraphNode*, std::pair<std::vector<size_t>, std::vector<size_t>>> Effects_;
+};
+
+// Critical path first, then longest latency, then original order
 class NodeCompare {
 public:
-  bool operator()(PrecedenceGraphNode* A, PrecedenceGraphNode* B) {
-    return CalculateCycle(A) < CalculateCycle(B);
+  bool operator()(PrecedenceGraphNode* A, PrecedenceGraphNode* B) const {
+    if(A->Height() != B->Height()) {
+      return A->Height() < B->Height();
+    }
+    if(A->Latency() != B->Latency()) {
+      return A->Latency() < B->Latency();
+    }
+    return A->Index() > B->Index();
   }
 };
 
-void ListScheduler::ScheduleBlock(MachineBasicBlock* Block) {
-  PrecedenceGraph Graph(Block);
+// Number of ready nodes, in priority order, considered when minimizing pressure
+constexpr size_t kPressureWindow = 16;
+
+void ListScheduler::ScheduleBlock(MachineBasicBlock* Block, const MRegLivenessState* LiveIn, const MRegLivenessState* LiveOut) {
+  PrecedenceGraph Graph(Block, Model_, Phase_);
   Graph.Build();
 
+  std::optional<PressureTracker> Pressure;
+  if(LiveIn != nullptr && LiveOut != nullptr) {
+    Pressure.emplace(Graph, *LiveIn, *LiveOut);
+  }
+
   int Cycle = 1;
   std::vector<PrecedenceGraphNode*> Leaves = Graph.Leaves();
   std::vector<PrecedenceGraphNode*> ActiveNodes;
   std::priority_queue<PrecedenceGraphNode*, std::vector<PrecedenceGraphNode*>, NodeCompare> ReadyNodes(Leaves.begin(), Leaves.end());
-  std::map<PrecedenceGraphNode*, int> Start;
   std::vector<PrecedenceGraphNode*> Scheduled;
+  Scheduled.reserve(Graph.Size());
 
-  while(ReadyNodes.size() > 0 || ActiveNodes.size() > 0) {    
-    if(ReadyNodes.size() > 0) {
+  // cycle at which each execution port can accept a new instruction
+  std::vector<int> PortFree(Model_->NumPorts(), 0);
+  std::vector<PrecedenceGraphNode*> Stalled;
+
+  // Follows the critical path while registers are available; once every
+  // allocatable register is taken, picks the node that frees the most
+  // registers among the best few ready nodes.
+  std::vector<PrecedenceGraphNode*> Window;
+  auto PickNode = [&]() {
+    auto *Best = ReadyNodes.top();
+    ReadyNodes.pop();
+    if(!Pressure.has_value() || Pressure->Pressure() <= kAllocatableRegisters) {
+      return Best;
+    }
+
+    int BestDelta = Pressure->Delta(Best);
+    while(ReadyNodes.size() > 0 && Window.size() + 1 < kPressureWindow && BestDelta > -1) {
       auto *Node = ReadyNodes.top();
       ReadyNodes.pop();
+      int Delta = Pressure->Delta(Node);
+      if(Delta < BestDelta) {
+        Window.push_back(Best);
+        Best = Node;
+        BestDelta = Delta;
+      } else {
+        Window.push_back(Node);
+      }
+    }
+    for(auto *Node : Window) {
+      ReadyNodes.push(Node);
+    }
+    Window.clear();
+    return Best;
+  };
+
+  while(ReadyNodes.size() > 0 || ActiveNodes.size() > 0) {    
+    // issue up to IssueWidth ready nodes that find a free port
+    for(unsigned Issued = 0; Issued < Model_->IssueWidth() && ReadyNodes.size() > 0; ) {
+      auto *Node = PickNode();
+
+      auto &Info = Model_->Info(Node->Instruction());
+      int Port = -1;
+      for(unsigned P = 0; P < Model_->NumPorts(); P++) {
+        if((Info.Ports_ & (1u << P)) && PortFree[P] <= Cycle) {
+          Port = P;
+          break;
+        }
+      }
+      if(Port < 0) {
+        Stalled.push_back(Node);
+        continue;
+      }
+
+      PortFree[Port] = Cycle + Info.Throughput_;
+      if(Pressure.has_value()) {
+        Pressure->Schedule(Node);
+      }
+      Node->SetStart(Cycle);
       ActiveNodes.push_back(Node);
-      Start[Node] = Cycle;
+      Scheduled.push_back(Node);
+      Issued++;
     }
+    for(auto *Node : Stalled) {
+      ReadyNodes.push(Node);
+    }
+    Stalled.clear();
 
+    // ActiveNodes is bounded by issue width times the largest latency
     Cycle++;
     for(auto It = ActiveNodes.begin(); It != ActiveNodes.end(); ) {
       auto *Node = *It;
-      if(Start[Node] + CalculateCycle(Node) <= Cycle) {
-        // op completed
-        Scheduled.push_back(Node);
-
-        // add ready nodes
+      if(Node->Start() + Node->Latency() <= Cycle) {
+        // op completed, add ready nodes
         for(auto *Succ : Node->Successors()) {
-          if(Succ->IsReady(Scheduled)) {
+          if(Succ->PredecessorScheduled()) {
             ReadyNodes.push(Succ);
           }
         }
@@ -347,8 +748,9 @@ void ListScheduler::ScheduleBlock(MachineBasicBlock* Block) {
       }
     }
   }
+  assert(Scheduled.size() == Graph.Size() && "Cycle in precedence graph");
 
-  // change order of instructions
+  // instructions are emitted in issue order
   for(auto *Node : Scheduled) {
     auto *Inst = Node->Instruction();
     Inst->Parent()->Remove(Inst);
@@ -359,4 +761,4 @@ void ListScheduler::ScheduleBlock(MachineBasicBlock* Block) {
   }
 }
 
-} // namespace klang
\ No newline at end of file
+} // namespace klang
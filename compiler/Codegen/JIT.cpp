@@ -0,0 +1,255 @@
+#include <Codegen/JIT.h>
+#include <Logging.h>
+#include <Runtime.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <set>
+
+namespace klang {
+
+struct RuntimeFunction {
+  const char* Name_;
+  void* Address_;
+  size_t NumArgs_;
+};
+
+static const RuntimeFunction kRuntimeFunctions[] = {
+  { "printi", reinterpret_cast<void*>(do_printi), 1 },
+  { "prints", reinterpret_cast<void*>(do_prints), 1 },
+  { "inputi", reinterpret_cast<void*>(do_inputi), 0 },
+  { "inputs", reinterpret_cast<void*>(do_inputs), 0 },
+  { "random", reinterpret_cast<void*>(do_random), 0 },
+  { "array_new", reinterpret_cast<void*>(do_array_new), 1 },
+  { "array_load", reinterpret_cast<void*>(do_array_load), 2 },
+  { "array_store", reinterpret_cast<void*>(do_array_store), 3 },
+  { "region_mark", reinterpret_cast<void*>(do_region_mark), 0 },
+  { "region_reset", reinterpret_cast<void*>(do_region_reset), 1 },
+  { "region_end", reinterpret_cast<void*>(do_region_end), 0 },
+  { "strlen", reinterpret_cast<void*>(do_strlen), 1 },
+  { "strcmp", reinterpret_cast<void*>(do_strcmp), 2 },
+  { "strfind", reinterpret_cast<void*>(do_strfind), 2 },
+  { "substr", reinterpret_cast<void*>(do_substr), 3 },
+  { "concat", reinterpret_cast<void*>(do_concat), 2 },
+  { "charat", reinterpret_cast<void*>(do_charat), 2 },
+};
+
+static size_t RoundUp(size_t Size, size_t Alignment) {
+  return (Size + Alignment - 1) / Alignment * Alignment;
+}
+
+JITModule::~JITModule() {
+  if(Memory_ != nullptr) {
+    munmap(Memory_, Size_);
+  }
+}
+
+// Same shape as the K_ wrappers in runtime/wrapper.S: take the arguments
+// off the klang stack, align it and call into C.
+void JITModule::EmitRuntimeStub(std::vector<uint8_t>& Out, void* Target, size_t NumArgs) const {
+  static const MachineRegister kArgRegisters[] = { RDI, RSI, RDX };
+  assert(NumArgs <= sizeof(kArgRegisters) / sizeof(kArgRegisters[0]) && "Too many runtime arguments");
+
+  std::vector<Relocation> Unused;
+  X86Encoder Encoder(Out, Unused);
+  auto Reg = MachineOperand::CreateRegister;
+
+  PushMachineInst SaveFrame(Reg(RBP));
+  MovMachineInst SetFrame(Reg(RSP), Reg(RBP));
+  AndMachineInst AlignStack(MachineOperand::CreateImmediate(-16), Reg(RSP));
+  Encoder.Encode(&SaveFrame);
+  Encoder.Encode(&SetFrame);
+  Encoder.Encode(&AlignStack);
+  for(size_t i = 0; i < NumArgs; i++) {
+    MovMachineInst LoadArg(MachineOperand::CreateMemory(RBP, (i + 2) * MachineOperand::WordSize()), Reg(kArgRegisters[i]));
+    Encoder.Encode(&LoadArg);
+  }
+  MovMachineInst LoadTarget(MachineOperand::CreateImmediate(reinterpret_cast<int64_t>(Target)), Reg(RAX));
+  Encoder.Encode(&LoadTarget);
+  Encoder.EncodeIndirectCall(RAX);
+
+  MovMachineInst RestoreStack(Reg(RBP), Reg(RSP));
+  PopMachineInst RestoreFrame(Reg(RBP));
+  RetMachineInst Return;
+  Encoder.Encode(&RestoreStack);
+  Encoder.Encode(&RestoreFrame);
+  Encoder.Encode(&Return);
+}
+
+void JITModule::EmitJumpStub(std::vector<uint8_t>& Out, void* Target) const {
+  std::vector<Relocation> Unused;
+  X86Encoder Encoder(Out, Unused);
+  MovMachineInst LoadTarget(MachineOperand::CreateImmediate(reinterpret_cast<int64_t>(Target)), MachineOperand::CreateRegister(RAX));
+  Encoder.Encode(&LoadTarget);
+  Encoder.EncodeIndirectJump(RAX);
+}
+
+// Called from C++ with the argument array in rdi: pushes the arguments the
+// way a klang caller does and calls K_<Name>. klang code only clobbers
+// caller-saved registers, so nothing else has to be preserved.
+void JITModule::EmitEntryStub(std::vector<uint8_t>& Out, std::vector<Relocation>& Relocations, const std::string& Name, size_t NumParams) const {
+  X86Encoder Encoder(Out, Relocations);
+  auto Reg = MachineOperand::CreateRegister;
+
+  PushMachineInst SaveFrame(Reg(RBP));
+  MovMachineInst SetFrame(Reg(RSP), Reg(RBP));
+  Encoder.Encode(&SaveFrame);
+  Encoder.Encode(&SetFrame);
+  for(size_t i = NumParams; i > 0; i--) {
+    PushMachineInst PushArg(MachineOperand::CreateMemory(RDI, (i - 1) * MachineOperand::WordSize()));
+    Encoder.Encode(&PushArg);
+  }
+  CallMachineInst Call(Name.c_str());
+  Encoder.Encode(&Call);
+
+  MovMachineInst RestoreStack(Reg(RBP), Reg(RSP));
+  PopMachineInst RestoreFrame(Reg(RBP));
+  RetMachineInst Return;
+  Encoder.Encode(&RestoreStack);
+  Encoder.Encode(&RestoreFrame);
+  Encoder.Encode(&Return);
+}
+
+bool JITModule::Load(const ObjectBuffer& Object) {
+  assert(Memory_ == nullptr && "Module already loaded");
+
+  std::set<std::string> Defined;
+  for(auto &Sym : Object.Symbols()) {
+    Defined.insert(Sym.Name_);
+  }
+
+  // everything that is not defined by the module has to be external or a
+  // runtime function
+  std::vector<uint8_t> Stubs;
+  std::vector<Relocation> StubRelocations;
+  std::unordered_map<std::string, size_t> StubOffsets;
+  for(auto &Reloc : Object.Relocations()) {
+    if(Defined.count(Reloc.Symbol_) != 0 || StubOffsets.count(Reloc.Symbol_) != 0) {
+      continue;
+    }
+    auto External = Externals_.find(Reloc.Symbol_);
+    if(External != Externals_.end()) {
+      StubOffsets[Reloc.Symbol_] = Stubs.size();
+      EmitJumpStub(Stubs, External->second);
+      continue;
+    }
+    // do_ symbols are called with the C convention already, K_ symbols are
+    // the wrappers of code generated without native calls
+    const RuntimeFunction* Runtime = nullptr;
+    bool Native = false;
+    for(auto &Func : kRuntimeFunctions) {
+      if(Reloc.Symbol_ == std::string(kRuntimePrefix) + Func.Name_) {
+        Runtime = &Func;
+        Native = true;
+      } else if(Reloc.Symbol_ == std::string(kFunctionPrefix) + Func.Name_) {
+        Runtime = &Func;
+      }
+    }
+    if(Runtime == nullptr) {
+      ERROR("Unresolved symbol %s", Reloc.Symbol_.c_str());
+      return false;
+    }
+    StubOffsets[Reloc.Symbol_] = Stubs.size();
+    if(Native) {
+      EmitJumpStub(Stubs, Runtime->Address_);
+    } else {
+      EmitRuntimeStub(Stubs, Runtime->Address_, Runtime->NumArgs_);
+    }
+  }
+
+  std::unordered_map<std::string, size_t> EntryOffsets;
+  for(auto &KV : Entries_) {
+    if(Defined.count(std::string(kFunctionPrefix) + KV.first) == 0) {
+      ERROR("No function %s to enter", KV.first.c_str());
+      return false;
+    }
+    EntryOffsets[KV.first] = Stubs.size();
+    EmitEntryStub(Stubs, StubRelocations, KV.first, KV.second);
+  }
+
+  // code and stubs share the executable pages, data goes on the pages after them
+  size_t PageSize = sysconf(_SC_PAGESIZE);
+  size_t CodeSize = RoundUp(Object.Text().size() + Stubs.size(), PageSize);
+  Size_ = CodeSize + RoundUp(Object.Data().size(), PageSize);
+  void* Memory = mmap(nullptr, Size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(Memory == MAP_FAILED) {
+    ERROR("Failed to map %zu bytes for the JIT", Size_);
+    return false;
+  }
+  Memory_ = static_cast<uint8_t*>(Memory);
+
+  uint8_t* StubBase = Memory_ + Object.Text().size();
+  uint8_t* DataBase = Memory_ + CodeSize;
+  memcpy(Memory_, Object.Text().data(), Object.Text().size());
+  memcpy(StubBase, Stubs.data(), Stubs.size());
+  memcpy(DataBase, Object.Data().data(), Object.Data().size());
+
+  for(auto &Sym : Object.Symbols()) {
+    Symbols_[Sym.Name_] = (Sym.Section_ == ObjectBuffer::Section::Text ? Memory_ : DataBase) + Sym.Value_;
+  }
+  for(auto &KV : StubOffsets) {
+    Symbols_[KV.first] = StubBase + KV.second;
+  }
+  for(auto &KV : EntryOffsets) {
+    EntryPoints_[KV.first] = StubBase + KV.second;
+  }
+
+  // every relocation we emit is a 32-bit pc-relative S + A - P
+  auto Resolve = [this](uint8_t* Place, const Relocation& Reloc) {
+    int64_t Value = reinterpret_cast<int64_t>(Symbols_[Reloc.Symbol_]) + Reloc.Addend_ - reinterpret_cast<int64_t>(Place);
+    if(Value < INT32_MIN || Value > INT32_MAX) {
+      ERROR("Relocation against %s out of range", Reloc.Symbol_.c_str());
+      return false;
+    }
+    int32_t Field = static_cast<int32_t>(Value);
+    memcpy(Place, &Field, sizeof(Field));
+    return true;
+  };
+  for(auto &Reloc : Object.Relocations()) {
+    if(!Resolve(Memory_ + Reloc.Offset_, Reloc)) {
+      return false;
+    }
+  }
+  for(auto &Reloc : StubRelocations) {
+    if(!Resolve(StubBase + Reloc.Offset_, Reloc)) {
+      return false;
+    }
+  }
+
+  if(mprotect(Memory_, CodeSize, PROT_READ | PROT_EXEC) != 0) {
+    ERROR("Failed to make JIT code executable");
+    return false;
+  }
+  return true;
+}
+
+void* JITModule::Lookup(const std::string& Name) const {
+  auto It = Symbols_.find(Name);
+  if(It == Symbols_.end()) {
+    return nullptr;
+  }
+  return It->second;
+}
+
+JITModule::EntryFunction JITModule::Entry(const std::string& Name) const {
+  auto It = EntryPoints_.find(Name);
+  if(It == EntryPoints_.end()) {
+    return nullptr;
+  }
+  return reinterpret_cast<EntryFunction>(It->second);
+}
+
+int JITModule::Run() {
+  auto *Main = Lookup(std::string(kFunctionPrefix) + "main");
+  if(Main == nullptr) {
+    ERROR("No main function");
+    return 1;
+  }
+
+  InitRuntime();
+  return static_cast<int>(reinterpret_cast<int64_t(*)()>(Main)());
+}
+
+} // namespace klang
@@ -0,0 +1,190 @@
+#include <Codegen/MachineModel.h>
+
+namespace klang {
+
+using Opcode = MachineInstruction::Opcode;
+
+// XXX: New opcodes need to be added to every table
+
+#pragma region Skylake
+// Ports 0, 1, 5, 6 are ALUs, 2 and 3 load, 4 stores data, 6 also branches
+enum : unsigned {
+  SKL_P0 = 1 << 0, SKL_P1 = 1 << 1, SKL_P2 = 1 << 2, SKL_P3 = 1 << 3,
+  SKL_P4 = 1 << 4, SKL_P5 = 1 << 5, SKL_P6 = 1 << 6, SKL_P7 = 1 << 7,
+
+  SKL_ALU = SKL_P0 | SKL_P1 | SKL_P5 | SKL_P6,
+  SKL_LOAD = SKL_P2 | SKL_P3,
+};
+
+//                        Reg                        Imm                        Load                        Store
+static const std::vector<SchedRow> kSkylakeRows = {
+  { Opcode::Mov,      { { 1, 1, SKL_ALU },          { 1, 1, SKL_ALU },          { 5, 1, SKL_LOAD },          { 1, 1, SKL_P4 } } },
+  { Opcode::CMov,     { { 1, 1, SKL_P0 | SKL_P6 },  { 1, 1, SKL_P0 | SKL_P6 },  { 6, 1, SKL_P0 | SKL_P6 },  { 1, 1, SKL_P0 | SKL_P6 } } },
+  { Opcode::Add,      { { 1, 1, SKL_ALU },          { 1, 1, SKL_ALU },          { 6, 1, SKL_ALU },           { 6, 1, SKL_P4 } } },
+  { Opcode::Sub,      { { 1, 1, SKL_ALU },          { 1, 1, SKL_ALU },          { 6, 1, SKL_ALU },           { 6, 1, SKL_P4 } } },
+  { Opcode::IMul,     { { 3, 1, SKL_P1 },           { 3, 1, SKL_P1 },           { 8, 1, SKL_P1 },            { 8, 1, SKL_P1 } } },
+  { Opcode::IDiv,     { { 42, 24, SKL_P0 },         { 42, 24, SKL_P0 },         { 47, 24, SKL_P0 },          { 47, 24, SKL_P0 } } },
+  { Opcode::Or,       { { 1, 1, SKL_ALU },          { 1, 1, SKL_ALU },          { 6, 1, SKL_ALU },           { 6, 1, SKL_P4 } } },
+  { Opcode::Xor,      { { 1, 1, SKL_ALU },          { 1, 1, SKL_ALU },          { 6, 1, SKL_ALU },           { 6, 1, SKL_P4 } } },
+  { Opcode::And,      { { 1, 1, SKL_ALU },          { 1, 1, SKL_ALU },          { 6, 1, SKL_ALU },           { 6, 1, SKL_P4 } } },
+  { Opcode::Shl,      { { 1, 1, SKL_P0 | SKL_P6 },  { 1, 1, SKL_P0 | SKL_P6 },  { 6, 1, SKL_P0 | SKL_P6 },  { 6, 1, SKL_P4 } } },
+  { Opcode::Shr,      { { 1, 1, SKL_P0 | SKL_P6 },  { 1, 1, SKL_P0 | SKL_P6 },  { 6, 1, SKL_P0 | SKL_P6 },  { 6, 1, SKL_P4 } } },
+  { Opcode::Test,     { { 1, 1, SKL_ALU },          { 1, 1, SKL_ALU },          { 6, 1, SKL_ALU },           { 6, 1, SKL_ALU } } },
+  { Opcode::Cmp,      { { 1, 1, SKL_ALU },          { 1, 1, SKL_ALU },          { 6, 1, SKL_ALU },           { 6, 1, SKL_ALU } } },
+  { Opcode::Jmp,      { { 1, 1, SKL_P6 },           { 1, 1, SKL_P6 },           { 1, 1, SKL_P6 },            { 1, 1, SKL_P6 } } },
+  { Opcode::Jcc,      { { 1, 1, SKL_P6 },           { 1, 1, SKL_P6 },           { 1, 1, SKL_P6 },            { 1, 1, SKL_P6 } } },
+  { Opcode::Ret,      { { 2, 1, SKL_P6 },           { 2, 1, SKL_P6 },           { 2, 1, SKL_P6 },            { 2, 1, SKL_P6 } } },
+  { Opcode::Push,     { { 1, 1, SKL_P4 },           { 1, 1, SKL_P4 },           { 6, 1, SKL_P4 },            { 1, 1, SKL_P4 } } },
+  { Opcode::Pop,      { { 3, 1, SKL_LOAD },         { 3, 1, SKL_LOAD },         { 3, 1, SKL_LOAD },          { 4, 1, SKL_LOAD } } },
+  { Opcode::Call,     { { 3, 2, SKL_P6 },           { 3, 2, SKL_P6 },           { 3, 2, SKL_P6 },            { 3, 2, SKL_P6 } } },
+  { Opcode::TailCall, { { 1, 1, SKL_P6 },           { 1, 1, SKL_P6 },           { 1, 1, SKL_P6 },            { 1, 1, SKL_P6 } } },
+  { Opcode::Lea,      { { 1, 1, SKL_P1 | SKL_P5 },  { 1, 1, SKL_P1 | SKL_P5 },  { 1, 1, SKL_P1 | SKL_P5 },   { 1, 1, SKL_P1 | SKL_P5 } } },
+  { Opcode::Cqo,      { { 1, 1, SKL_P0 | SKL_P6 },  { 1, 1, SKL_P0 | SKL_P6 },  { 1, 1, SKL_P0 | SKL_P6 },   { 1, 1, SKL_P0 | SKL_P6 } } },
+  // the bounds check is predicted, the element load is the critical path
+  { Opcode::ArrayLoad,  { { 6, 2, SKL_LOAD },       { 6, 2, SKL_LOAD },         { 11, 2, SKL_LOAD },         { 6, 2, SKL_LOAD } } },
+  { Opcode::ArrayStore, { { 1, 2, SKL_P4 },         { 1, 2, SKL_P4 },           { 6, 2, SKL_P4 },            { 1, 2, SKL_P4 } } },
+};
+#pragma endregion
+
+#pragma region Zen
+// Four integer ALUs and two address generation units; ALU0 and ALU3 branch
+enum : unsigned {
+  ZEN_ALU0 = 1 << 0, ZEN_ALU1 = 1 << 1, ZEN_ALU2 = 1 << 2, ZEN_ALU3 = 1 << 3,
+  ZEN_AGU0 = 1 << 4, ZEN_AGU1 = 1 << 5,
+
+  ZEN_ALU = ZEN_ALU0 | ZEN_ALU1 | ZEN_ALU2 | ZEN_ALU3,
+  ZEN_AGU = ZEN_AGU0 | ZEN_AGU1,
+  ZEN_BR = ZEN_ALU0 | ZEN_ALU3,
+};
+
+//                        Reg                        Imm                        Load                        Store
+static const std::vector<SchedRow> kZenRows = {
+  { Opcode::Mov,      { { 1, 1, ZEN_ALU },          { 1, 1, ZEN_ALU },          { 4, 1, ZEN_AGU },           { 1, 1, ZEN_AGU } } },
+  { Opcode::CMov,     { { 1, 1, ZEN_ALU },          { 1, 1, ZEN_ALU },          { 5, 1, ZEN_ALU },           { 1, 1, ZEN_ALU } } },
+  { Opcode::Add,      { { 1, 1, ZEN_ALU },          { 1, 1, ZEN_ALU },          { 5, 1, ZEN_ALU },           { 5, 1, ZEN_AGU } } },
+  { Opcode::Sub,      { { 1, 1, ZEN_ALU },          { 1, 1, ZEN_ALU },          { 5, 1, ZEN_ALU },           { 5, 1, ZEN_AGU } } },
+  { Opcode::IMul,     { { 3, 1, ZEN_ALU1 },         { 3, 1, ZEN_ALU1 },         { 7, 1, ZEN_ALU1 },          { 7, 1, ZEN_ALU1 } } },
+  { Opcode::IDiv,     { { 45, 45, ZEN_ALU2 },       { 45, 45, ZEN_ALU2 },       { 49, 45, ZEN_ALU2 },        { 49, 45, ZEN_ALU2 } } },
+  { Opcode::Or,       { { 1, 1, ZEN_ALU },          { 1, 1, ZEN_ALU },          { 5, 1, ZEN_ALU },           { 5, 1, ZEN_AGU } } },
+  { Opcode::Xor,      { { 1, 1, ZEN_ALU },          { 1, 1, ZEN_ALU },          { 5, 1, ZEN_ALU },           { 5, 1, ZEN_AGU } } },
+  { Opcode::And,      { { 1, 1, ZEN_ALU },          { 1, 1, ZEN_ALU },          { 5, 1, ZEN_ALU },           { 5, 1, ZEN_AGU } } },
+  { Opcode::Shl,      { { 1, 1, ZEN_ALU },          { 1, 1, ZEN_ALU },          { 5, 1, ZEN_ALU },           { 5, 1, ZEN_AGU } } },
+  { Opcode::Shr,      { { 1, 1, ZEN_ALU },          { 1, 1, ZEN_ALU },          { 5, 1, ZEN_ALU },           { 5, 1, ZEN_AGU } } },
+  { Opcode::Test,     { { 1, 1, ZEN_ALU },          { 1, 1, ZEN_ALU },          { 5, 1, ZEN_ALU },           { 5, 1, ZEN_ALU } } },
+  { Opcode::Cmp,      { { 1, 1, ZEN_ALU },          { 1, 1, ZEN_ALU },          { 5, 1, ZEN_ALU },           { 5, 1, ZEN_ALU } } },
+  { Opcode::Jmp,      { { 1, 1, ZEN_BR },           { 1, 1, ZEN_BR },           { 1, 1, ZEN_BR },            { 1, 1, ZEN_BR } } },
+  { Opcode::Jcc,      { { 1, 1, ZEN_BR },           { 1, 1, ZEN_BR },           { 1, 1, ZEN_BR },            { 1, 1, ZEN_BR } } },
+  { Opcode::Ret,      { { 2, 2, ZEN_BR },           { 2, 2, ZEN_BR },           { 2, 2, ZEN_BR },            { 2, 2, ZEN_BR } } },
+  { Opcode::Push,     { { 1, 1, ZEN_AGU },          { 1, 1, ZEN_AGU },          { 5, 1, ZEN_AGU },           { 1, 1, ZEN_AGU } } },
+  { Opcode::Pop,      { { 4, 1, ZEN_AGU },          { 4, 1, ZEN_AGU },          { 4, 1, ZEN_AGU },           { 5, 1, ZEN_AGU } } },
+  { Opcode::Call,     { { 2, 2, ZEN_BR },           { 2, 2, ZEN_BR },           { 2, 2, ZEN_BR },            { 2, 2, ZEN_BR } } },
+  { Opcode::TailCall, { { 1, 1, ZEN_BR },           { 1, 1, ZEN_BR },           { 1, 1, ZEN_BR },            { 1, 1, ZEN_BR } } },
+  { Opcode::Lea,      { { 1, 1, ZEN_ALU },          { 1, 1, ZEN_ALU },          { 1, 1, ZEN_ALU },           { 1, 1, ZEN_ALU } } },
+  { Opcode::Cqo,      { { 1, 1, ZEN_ALU },          { 1, 1, ZEN_ALU },          { 1, 1, ZEN_ALU },           { 1, 1, ZEN_ALU } } },
+  { Opcode::ArrayLoad,  { { 5, 2, ZEN_AGU },        { 5, 2, ZEN_AGU },          { 9, 2, ZEN_AGU },           { 5, 2, ZEN_AGU } } },
+  { Opcode::ArrayStore, { { 1, 2, ZEN_AGU },        { 1, 2, ZEN_AGU },          { 5, 2, ZEN_AGU },           { 1, 2, ZEN_AGU } } },
+};
+#pragma endregion
+
+MachineModel::MachineModel(const char* Name, unsigned IssueWidth, unsigned NumPorts, const std::vector<SchedRow>& Rows) 
+  : Name_(Name), IssueWidth_(IssueWidth), NumPorts_(NumPorts), Table_() {
+  assert(Rows.size() == kNumOpcodes && "Machine model does not cover every opcode");
+  for(auto &Row : Rows) {
+    for(size_t Kind = 0; Kind < kNumOperandKinds; Kind++) {
+      assert(Row.Info_[Kind].Latency_ > 0 && Row.Info_[Kind].Ports_ != 0 && "Invalid scheduling info");
+      Table_[static_cast<size_t>(Row.Opcode_)][Kind] = Row.Info_[Kind];
+    }
+  }
+}
+
+const MachineModel& MachineModel::Get(CPUFamily CPU) {
+  static const MachineModel Skylake("skylake", 4, 8, kSkylakeRows);
+  static const MachineModel Zen("zen", 5, 6, kZenRows);
+
+  switch(CPU) {
+    case CPUFamily::Skylake: return Skylake;
+    case CPUFamily::Zen: return Zen;
+    default: __builtin_unreachable();
+  }
+}
+
+std::optional<CPUFamily> MachineModel::Parse(const std::string& Name) {
+  if(Name == "skylake") {
+    return CPUFamily::Skylake;
+  } else if(Name == "zen") {
+    return CPUFamily::Zen;
+  }
+  return std::nullopt;
+}
+
+OperandKind MachineModel::KindOf(const MachineInstruction* Inst) {
+  switch(Inst->GetOpcode()) {
+    // two-operand forms are "op src, dst"
+    case Opcode::Mov:
+    case Opcode::CMov:
+    case Opcode::Add:
+    case Opcode::Sub:
+    case Opcode::IMul:
+    case Opcode::Or:
+    case Opcode::Xor:
+    case Opcode::And:
+    case Opcode::Shl:
+    case Opcode::Shr: {
+      auto Src = Inst->GetOperand(0);
+      auto Dst = Inst->GetOperand(1);
+      if(Dst.IsMemory()) {
+        return OperandKind::Store;
+      } else if(Src.IsMemory()) {
+        return OperandKind::Load;
+      } else if(Src.IsImmediate()) {
+        return OperandKind::Imm;
+      }
+      return OperandKind::Reg;
+    }
+
+    case Opcode::Test:
+    case Opcode::Cmp: {
+      if(Inst->GetOperand(0).IsMemory() || Inst->GetOperand(1).IsMemory()) {
+        return OperandKind::Load;
+      } else if(Inst->GetOperand(0).IsImmediate() || Inst->GetOperand(1).IsImmediate()) {
+        return OperandKind::Imm;
+      }
+      return OperandKind::Reg;
+    }
+
+    case Opcode::IDiv:
+    case Opcode::Push: {
+      if(Inst->GetOperand(0).IsMemory()) {
+        return OperandKind::Load;
+      } else if(Inst->GetOperand(0).IsImmediate()) {
+        return OperandKind::Imm;
+      }
+      return OperandKind::Reg;
+    }
+
+    case Opcode::Pop: {
+      return Inst->GetOperand(0).IsMemory() ? OperandKind::Store : OperandKind::Reg;
+    }
+
+    // spilled operands are reloaded before the access
+    case Opcode::ArrayLoad:
+    case Opcode::ArrayStore: {
+      for(size_t i = 0; i < Inst->Size(); i++) {
+        if(Inst->GetOperand(i).IsMemory()) {
+          return OperandKind::Load;
+        }
+      }
+      return OperandKind::Reg;
+    }
+
+    default: {
+      return OperandKind::Reg;
+    }
+  }
+}
+
+const SchedInfo& MachineModel::Info(const MachineInstruction* Inst) const {
+  return Table_[static_cast<size_t>(Inst->GetOpcode())][static_cast<size_t>(KindOf(Inst))];
+}
+
+} // namespace klang
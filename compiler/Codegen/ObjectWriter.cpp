@@ -0,0 +1,265 @@
+#include <Codegen/ObjectWriter.h>
+#include <Logging.h>
+
+#include <elf.h>
+
+#include <cstring>
+#include <unordered_map>
+
+namespace klang {
+
+// section header indices of the object
+enum : uint16_t {
+  kTextSection = 1,
+  kDataSection,
+  kNoteSection,
+  kRelaSection,
+  kSymtabSection,
+  kStrtabSection,
+  kShstrtabSection,
+  kNumSections,
+};
+
+void ObjectBuffer::AddFunction(const MachineFunction* Function) {
+  std::vector<MachineBasicBlock*> Blocks(Function->begin(), Function->end());
+  std::unordered_map<const MachineBasicBlock*, size_t> Index;
+  for(size_t i = 0; i < Blocks.size(); i++) {
+    Index[Blocks[i]] = i;
+  }
+
+  // same fall-through rules as MachineBasicBlock::Emit
+  std::vector<Fragment> Fragments(Blocks.size());
+  for(size_t i = 0; i < Blocks.size(); i++) {
+    auto &Frag = Fragments[i];
+    auto *Next = i + 1 < Blocks.size() ? Blocks[i + 1] : nullptr;
+    X86Encoder Encoder(Frag.Bytes_, Frag.Relocations_);
+    for(auto *Inst : *Blocks[i]) {
+      if(Inst->GetOpcode() == MachineInstruction::Opcode::Jmp) {
+        auto *Target = static_cast<JmpMachineInst*>(Inst)->Target();
+        if(Target != Next) {
+          Frag.Jumps_.push_back({std::nullopt, Index[Target], true});
+        }
+      } else if(Inst->GetOpcode() == MachineInstruction::Opcode::Jcc) {
+        auto *Jcc = static_cast<JccMachineInst*>(Inst);
+        if(Jcc->FalseTarget() == Next) {
+          Frag.Jumps_.push_back({Jcc->GetCondition(), Index[Jcc->TrueTarget()], true});
+        } else if(Jcc->TrueTarget() == Next) {
+          Frag.Jumps_.push_back({InvertCondition(Jcc->GetCondition()), Index[Jcc->FalseTarget()], true});
+        } else {
+          Frag.Jumps_.push_back({Jcc->GetCondition(), Index[Jcc->TrueTarget()], true});
+          Frag.Jumps_.push_back({std::nullopt, Index[Jcc->FalseTarget()], true});
+        }
+      } else {
+        assert(Frag.Jumps_.empty() && "Jumps must terminate the block");
+        Encoder.Encode(Inst);
+      }
+    }
+  }
+
+  std::vector<size_t> Offsets;
+  RelaxJumps(Fragments, Offsets);
+
+  size_t Base = Text_.size();
+  X86Encoder Encoder(Text_, Relocations_);
+  for(size_t i = 0; i < Fragments.size(); i++) {
+    auto &Frag = Fragments[i];
+    for(auto Reloc : Frag.Relocations_) {
+      Reloc.Offset_ += Text_.size();
+      Relocations_.push_back(Reloc);
+    }
+    Text_.insert(Text_.end(), Frag.Bytes_.begin(), Frag.Bytes_.end());
+    for(auto &Jump : Frag.Jumps_) {
+      int64_t End = Text_.size() - Base + X86Encoder::JumpSize(Jump.Cond_.has_value(), Jump.Short_);
+      Encoder.EncodeJump(Jump.Cond_, static_cast<int64_t>(Offsets[Jump.Target_]) - End, Jump.Short_);
+    }
+  }
+
+  Symbols_.push_back({std::string(kFunctionPrefix) + Function->Name(), Section::Text, Base, Text_.size() - Base, true});
+}
+
+// Jumps start out short and are widened until every displacement fits,
+// sizes only grow so this terminates
+void ObjectBuffer::RelaxJumps(std::vector<Fragment>& Fragments, std::vector<size_t>& Offsets) {
+  Offsets.assign(Fragments.size(), 0);
+  bool Changed = true;
+  while(Changed) {
+    Changed = false;
+    size_t Pos = 0;
+    for(size_t i = 0; i < Fragments.size(); i++) {
+      Offsets[i] = Pos;
+      Pos += Fragments[i].Bytes_.size();
+      for(auto &Jump : Fragments[i].Jumps_) {
+        Pos += X86Encoder::JumpSize(Jump.Cond_.has_value(), Jump.Short_);
+      }
+    }
+
+    for(size_t i = 0; i < Fragments.size(); i++) {
+      Pos = Offsets[i] + Fragments[i].Bytes_.size();
+      for(auto &Jump : Fragments[i].Jumps_) {
+        Pos += X86Encoder::JumpSize(Jump.Cond_.has_value(), Jump.Short_);
+        int64_t Disp = static_cast<int64_t>(Offsets[Jump.Target_]) - static_cast<int64_t>(Pos);
+        if(Jump.Short_ && (Disp < INT8_MIN || Disp > INT8_MAX)) {
+          Jump.Short_ = false;
+          Changed = true;
+        }
+      }
+    }
+  }
+}
+
+template<typename T>
+static void Append(std::vector<uint8_t>& Out, const T& Value) {
+  auto *Bytes = reinterpret_cast<const uint8_t*>(&Value);
+  Out.insert(Out.end(), Bytes, Bytes + sizeof(T));
+}
+
+static void Align(std::vector<uint8_t>& Out, size_t Alignment) {
+  while(Out.size() % Alignment != 0) {
+    Out.push_back(0);
+  }
+}
+
+void ObjectBuffer::AddStringLiteral(const std::string& Label, const std::string& Value) {
+  Align(Data_, sizeof(int64_t));
+  Symbols_.push_back({Label, Section::Data, Data_.size(), sizeof(int64_t) + Value.size() + 1, false});
+  Append(Data_, static_cast<int64_t>(Value.size()));
+  Data_.insert(Data_.end(), Value.begin(), Value.end());
+  Data_.push_back(0);
+}
+
+static uint32_t AddString(std::vector<uint8_t>& Table, const std::string& Str) {
+  uint32_t Offset = Table.size();
+  Table.insert(Table.end(), Str.begin(), Str.end());
+  Table.push_back(0);
+  return Offset;
+}
+
+bool ELFObjectWriter::Write(const char* FileName) const {
+  // locals have to come before globals, referenced but undefined symbols go last
+  std::vector<Symbol> Table;
+  for(auto &Sym : Symbols()) {
+    if(!Sym.Global_) {
+      Table.push_back(Sym);
+    }
+  }
+  size_t NumLocals = Table.size() + 1;
+  for(auto &Sym : Symbols()) {
+    if(Sym.Global_) {
+      Table.push_back(Sym);
+    }
+  }
+  std::unordered_map<std::string, size_t> SymbolIndex;
+  for(size_t i = 0; i < Table.size(); i++) {
+    SymbolIndex[Table[i].Name_] = i + 1;
+  }
+  for(auto &Reloc : Relocations()) {
+    if(SymbolIndex.count(Reloc.Symbol_) == 0) {
+      Table.push_back({Reloc.Symbol_, Section::Undefined, 0, 0, true});
+      SymbolIndex[Reloc.Symbol_] = Table.size();
+    }
+  }
+
+  std::vector<uint8_t> Strtab(1, 0), Symtab;
+  Append(Symtab, Elf64_Sym{});
+  for(auto &Sym : Table) {
+    Elf64_Sym Entry{};
+    Entry.st_name = AddString(Strtab, Sym.Name_);
+    Entry.st_other = STV_DEFAULT;
+    switch(Sym.Section_) {
+      case Section::Text: {
+        Entry.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+        Entry.st_shndx = kTextSection;
+        break;
+      }
+      case Section::Data: {
+        Entry.st_info = ELF64_ST_INFO(Sym.Global_ ? STB_GLOBAL : STB_LOCAL, STT_OBJECT);
+        Entry.st_shndx = kDataSection;
+        break;
+      }
+      case Section::Undefined: {
+        Entry.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+        Entry.st_shndx = SHN_UNDEF;
+        break;
+      }
+    }
+    Entry.st_value = Sym.Value_;
+    Entry.st_size = Sym.Size_;
+    Append(Symtab, Entry);
+  }
+
+  std::vector<uint8_t> Rela;
+  for(auto &Reloc : Relocations()) {
+    Elf64_Rela Entry{};
+    Entry.r_offset = Reloc.Offset_;
+    Entry.r_info = ELF64_R_INFO(SymbolIndex[Reloc.Symbol_], Reloc.Type_);
+    Entry.r_addend = Reloc.Addend_;
+    Append(Rela, Entry);
+  }
+
+  std::vector<uint8_t> Shstrtab(1, 0);
+  std::vector<Elf64_Shdr> Headers(kNumSections, Elf64_Shdr{});
+  std::vector<uint8_t> File(sizeof(Elf64_Ehdr), 0);
+  auto AddSection = [&](uint16_t Idx, const char* Name, uint32_t Type, uint64_t Flags, const std::vector<uint8_t>& Contents, uint64_t Alignment) {
+    Align(File, Alignment);
+    auto &Header = Headers[Idx];
+    Header.sh_name = AddString(Shstrtab, Name);
+    Header.sh_type = Type;
+    Header.sh_flags = Flags;
+    Header.sh_offset = File.size();
+    Header.sh_size = Contents.size();
+    Header.sh_addralign = Alignment;
+    File.insert(File.end(), Contents.begin(), Contents.end());
+  };
+
+  AddSection(kTextSection, ".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, Text(), 16);
+  AddSection(kDataSection, ".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, Data(), 8);
+  AddSection(kNoteSection, ".note.GNU-stack", SHT_PROGBITS, 0, {}, 1);
+  AddSection(kRelaSection, ".rela.text", SHT_RELA, SHF_INFO_LINK, Rela, 8);
+  Headers[kRelaSection].sh_link = kSymtabSection;
+  Headers[kRelaSection].sh_info = kTextSection;
+  Headers[kRelaSection].sh_entsize = sizeof(Elf64_Rela);
+  AddSection(kSymtabSection, ".symtab", SHT_SYMTAB, 0, Symtab, 8);
+  Headers[kSymtabSection].sh_link = kStrtabSection;
+  Headers[kSymtabSection].sh_info = NumLocals;
+  Headers[kSymtabSection].sh_entsize = sizeof(Elf64_Sym);
+  AddSection(kStrtabSection, ".strtab", SHT_STRTAB, 0, Strtab, 1);
+  // the name of .shstrtab has to be in the table before it is copied out
+  uint32_t ShstrtabName = AddString(Shstrtab, ".shstrtab");
+  AddSection(kShstrtabSection, "", SHT_STRTAB, 0, Shstrtab, 1);
+  Headers[kShstrtabSection].sh_name = ShstrtabName;
+
+  Align(File, 8);
+  Elf64_Ehdr Ehdr{};
+  memcpy(Ehdr.e_ident, ELFMAG, SELFMAG);
+  Ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+  Ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  Ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  Ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  Ehdr.e_type = ET_REL;
+  Ehdr.e_machine = EM_X86_64;
+  Ehdr.e_version = EV_CURRENT;
+  Ehdr.e_shoff = File.size();
+  Ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+  Ehdr.e_shentsize = sizeof(Elf64_Shdr);
+  Ehdr.e_shnum = kNumSections;
+  Ehdr.e_shstrndx = kShstrtabSection;
+  memcpy(File.data(), &Ehdr, sizeof(Ehdr));
+  for(auto &Header : Headers) {
+    Append(File, Header);
+  }
+
+  FILE* F = fopen(FileName, "wb");
+  if(F == nullptr) {
+    ERROR("Failed to open file %s", FileName);
+    return false;
+  }
+  if(fwrite(File.data(), 1, File.size(), F) != File.size()) {
+    ERROR("Failed to write to file %s", FileName);
+    fclose(F);
+    return false;
+  }
+  fclose(F);
+  return true;
+}
+
+} // namespace klang
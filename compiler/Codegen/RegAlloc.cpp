@@ -2,6 +2,8 @@
 #include <IR/Analysis.h>
 #include <Logging.h>
 
+#include <functional>
+
 namespace klang {
 
 void MRegLivenessState::Meet(const MRegLivenessState& Other) {
@@ -58,11 +60,21 @@ void MRegLivenessState::Transfer(const MachineInstruction* Inst) {
     case MachineInstruction::Opcode::Jmp:
     case MachineInstruction::Opcode::Jcc:
     case MachineInstruction::Opcode::Ret:
-    case MachineInstruction::Opcode::Call: 
+    case MachineInstruction::Opcode::TailCall:
     case MachineInstruction::Opcode::Cqo: {
       break;
     }
 
+    // the arguments of a native call
+    case MachineInstruction::Opcode::Call: {
+      for(size_t i = 0; i < Inst->Size(); i++) {
+        if(Inst->GetOperand(i).IsVirtualRegister()) {
+          Live_.insert(Inst->GetOperand(i).GetVirtualRegister());
+        }
+      }
+      break;
+    }
+
     case MachineInstruction::Opcode::Push:
     case MachineInstruction::Opcode::IDiv: {
       auto Src = Inst->GetOperand(0);
@@ -80,6 +92,20 @@ void MRegLivenessState::Transfer(const MachineInstruction* Inst) {
       break;
     }
 
+    case MachineInstruction::Opcode::ArrayLoad:
+    case MachineInstruction::Opcode::ArrayStore: {
+      if(Op == MachineInstruction::Opcode::ArrayLoad && Inst->GetOperand(2).IsVirtualRegister()) {
+        Live_.erase(Inst->GetOperand(2).GetVirtualRegister());
+      }
+      size_t NumUses = Op == MachineInstruction::Opcode::ArrayLoad ? 2 : 3;
+      for(size_t i = 0; i < NumUses; i++) {
+        if(Inst->GetOperand(i).IsVirtualRegister()) {
+          Live_.insert(Inst->GetOperand(i).GetVirtualRegister());
+        }
+      }
+      break;
+    }
+
     default: assert(false && "Unhandled instruction");
   }
 }
@@ -236,7 +262,7 @@ static void ReplaceVirtualRegister(MachineInstruction* Inst, size_t VirtRegId, M
 void LinearScanRegAlloc::FixupCallInst(MachineInstruction* Inst, std::vector<Interval*>& Intervals) {
   int Order = InstToOrder_[Inst];
 
-  std::set<Interval*> ActiveAtCall;
+  std::vector<Interval*> ActiveAtCall;
   for(auto *I : Intervals) {
     int Start = I->Start();
     int RealEnd = I->End();
@@ -245,7 +271,7 @@ void LinearScanRegAlloc::FixupCallInst(MachineInstruction* Inst, std::vector<Int
     }
 
     if(Order >= Start && Order <= RealEnd) {
-      ActiveAtCall.insert(I);
+      ActiveAtCall.push_back(I);
     }
   }
 
@@ -291,9 +317,7 @@ bool LinearScanRegAlloc::Allocate() {
   std::unordered_map<Interval*, MachineRegister> ActiveToRegister;
   std::set<MachineRegister> FreeRegisters;
 
-  constexpr MachineRegister Allocatables[] = { RCX, R8, R9, R10, R11, RSI, RDI };
-  constexpr size_t kAllocatableRegisters = sizeof(Allocatables) / sizeof(Allocatables[0]);
-  for(auto Reg : Allocatables) {
+  for(auto Reg : kAllocatables) {
     FreeRegisters.insert(Reg);
   }
 
@@ -345,7 +369,17 @@ bool LinearScanRegAlloc::Allocate() {
     if(Active.size() == kAllocatableRegisters) {
       auto [Spilled, _] = SpillAtInterval(I);
       auto Slot = AllocateSpillSlot(Spilled);
-      Spilled->SpillAt(I->Start(), Slot);
+      // Splitting an interval is only sound inside a single block. Across
+      // blocks the store at the split doesn't reach uses on other paths, and
+      // a loop re-enters the part that still expects the register.
+      auto *First = OrderToInst_[Spilled->Start()];
+      auto *Last = OrderToInst_[Spilled->End()];
+      if(Spilled != I && First->Parent() != Last->Parent()) {
+        Spilled->SetReg(None);
+        Spilled->SpillAt(Spilled->Start(), Slot);
+      } else {
+        Spilled->SpillAt(I->Start(), Slot);
+      }
     } else {
       AllocateFreeRegister(I);
       I->SetReg(ActiveToRegister[I]);
@@ -379,8 +413,9 @@ bool LinearScanRegAlloc::Allocate() {
 
   FixupInstruction(Func_);
 
-  for(auto KV : InstToOrder_) {
-    auto *Inst = KV.first;
+  // in program order, so spill slots are numbered the same way on every run
+  for(int i = 0; i < static_cast<int>(OrderToInst_.size()); i++) {
+    auto *Inst = OrderToInst_[i];
     if(Inst->GetOpcode() == MachineInstruction::Opcode::Call) {
       FixupCallInst(Inst, Intervals);
     }
@@ -397,13 +432,19 @@ void LinearScanRegAlloc::EmitPrologue() {
   Entry->InsertBefore(new PushMachineInst(MachineOperand::CreateRegister(RBP)), First);
   Entry->InsertBefore(new MovMachineInst(MachineOperand::CreateRegister(RSP), MachineOperand::CreateRegister(RBP)), First);
 
-  if(SpilledIntervals_.empty()) {
-    return;
+  if(!SpilledIntervals_.empty()) {
+    Entry->InsertBefore(new SubMachineInst(
+      MachineOperand::CreateImmediate(MachineOperand::WordSize() * SpilledIntervals_.size()), 
+      MachineOperand::CreateRegister(RSP)
+    ), First);
+  }
+
+  // klang callers push any number of arguments, so the C functions get an
+  // aligned stack from below the spill slots. Nothing is pushed between the
+  // prologue and a runtime call.
+  if(Func_->CallsRuntime()) {
+    Entry->InsertBefore(new AndMachineInst(MachineOperand::CreateImmediate(-16), MachineOperand::CreateRegister(RSP)), First);
   }
-  Entry->InsertBefore(new SubMachineInst(
-    MachineOperand::CreateImmediate(MachineOperand::WordSize() * SpilledIntervals_.size()), 
-    MachineOperand::CreateRegister(RSP)
-  ), First);
 }
 
 void LinearScanRegAlloc::EmitEpilogue() {
@@ -456,6 +497,15 @@ bool FixupInstruction(MachineFunction* F) {
           }
           break;
         }
+        case MachineInstruction::Opcode::Push: {
+          auto Src = Inst->GetOperand(0);
+          if(Src.IsImmediate() && Is64BitImmediate(Src.GetImmediate())) {
+            // push only sign-extends a 32-bit immediate
+            Inst->Parent()->InsertBefore(new MovMachineInst(Src, MachineOperand::CreateRegister(RAX)), Inst);
+            Inst->ReplaceOperand(0, MachineOperand::CreateRegister(RAX));
+          }
+          break;
+        }
         case MachineInstruction::Opcode::CMov: {
           auto Src = Inst->GetOperand(0);
           auto Dst = Inst->GetOperand(1);
@@ -0,0 +1,111 @@
+#include <Codegen/Tiered.h>
+#include <Codegen/ObjectWriter.h>
+#include <IR/Optimize.h>
+#include <Logging.h>
+
+#include <set>
+
+namespace klang {
+
+TieredCompiler::TieredCompiler(Module* Module, ModuleGenCtx* IRGenCtx, const MachineModel* Model)
+  : IRGenCtx_(IRGenCtx), Model_(Model) {
+  for(auto *F : (*Module)) {
+    Functions_[F->Name()] = F;
+  }
+}
+
+void TieredCompiler::Attach(Interpreter& Interp, size_t Threshold) {
+  Interp.SetTierUp(Threshold, [this, &Interp](Function* F) {
+    Promote(Interp, F);
+  });
+}
+
+static const char* CalleeOf(const Instruction& Inst) {
+  switch(Inst.Type()) {
+    case Instruction::Call:
+      return static_cast<const CallInst&>(Inst).Callee();
+    case Instruction::CallVoid:
+      return static_cast<const CallVoidInst&>(Inst).Callee();
+    case Instruction::TailCall:
+      return static_cast<const TailCallInst&>(Inst).Callee();
+    default:
+      return nullptr;
+  }
+}
+
+// F and everything reachable from it through calls, minus the runtime and
+// functions that already are native
+std::vector<Function*> TieredCompiler::CollectCallees(Function* F) const {
+  std::vector<Function*> Result;
+  std::set<Function*> Visited;
+  std::vector<Function*> Worklist = { F };
+  while(!Worklist.empty()) {
+    auto *Current = Worklist.back();
+    Worklist.pop_back();
+    if(!Visited.insert(Current).second) {
+      continue;
+    }
+    Result.push_back(Current);
+
+    for(auto *BB : (*Current)) {
+      for(auto &Inst : *BB) {
+        auto *Callee = CalleeOf(Inst);
+        if(Callee == nullptr || Natives_.count(std::string(kFunctionPrefix) + Callee) != 0) {
+          continue;
+        }
+        auto It = Functions_.find(Callee);
+        if(It != Functions_.end()) {
+          Worklist.push_back(It->second);
+        }
+      }
+    }
+  }
+  return Result;
+}
+
+void TieredCompiler::Promote(Interpreter& Interp, Function* F) {
+  if(Natives_.count(std::string(kFunctionPrefix) + F->Name()) != 0) {
+    return;
+  }
+
+  // active interpreted frames keep running their bytecode, so the IR can be
+  // optimized in place
+  auto Functions = CollectCallees(F);
+  ObjectBuffer Object;
+  for(auto *Func : Functions) {
+    OptimizeIR(Func);
+    MachineFuncBuilder Builder(Func, Model_);
+    Builder.Generate();
+    auto *MF = Builder.GetFunction();
+    Object.AddFunction(MF);
+    delete MF;
+  }
+  for(auto &KV : IRGenCtx_->StringLiterals) {
+    Object.AddStringLiteral(KV.second, KV.first);
+  }
+
+  auto JIT = std::make_unique<JITModule>();
+  for(auto &KV : Natives_) {
+    JIT->AddExternal(KV.first, KV.second);
+  }
+  for(auto *Func : Functions) {
+    JIT->AddEntry(Func->Name(), Func->NumParams());
+  }
+  if(!JIT->Load(Object)) {
+    ERROR("Failed to compile %s, it stays interpreted", F->Name().c_str());
+    return;
+  }
+
+  // patch the interpreter's function table
+  for(auto *Func : Functions) {
+    auto Name = Func->Name();
+    Natives_[kFunctionPrefix + Name] = JIT->Lookup(kFunctionPrefix + Name);
+    auto Entry = JIT->Entry(Name);
+    Interp.AddNativeFunction(Name.c_str(), [Entry](std::vector<int64_t>& Args) {
+      return Entry(Args.data());
+    });
+  }
+  Modules_.push_back(std::move(JIT));
+}
+
+} // namespace klang
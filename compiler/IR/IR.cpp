@@ -86,7 +86,15 @@ void Function::AddBasicBlock(BasicBlock* BB) {
   assert(BB->Parent() == nullptr && "Basic block already belongs to a function");
   BasicBlocks_.push_back(BB);
   BB->SetParent(this);
-  BB->SetIndex(BasicBlocks_.size());
+  BB->SetIndex(++NumBlocks_);
+}
+
+void Function::InsertBasicBlock(BasicBlock* BB, size_t Pos) {
+  assert(BB->Parent() == nullptr && "Basic block already belongs to a function");
+  assert(Pos <= BasicBlocks_.size() && "Invalid block position");
+  BasicBlocks_.insert(BasicBlocks_.begin() + Pos, BB);
+  BB->SetParent(this);
+  BB->SetIndex(++NumBlocks_);
 }
 
 BasicBlock* Function::Remove(BasicBlock* BB) {
@@ -218,7 +226,7 @@ std::vector<BasicBlock*> Function::PostOrder() const {
   return PostOrder;
 }
 
-void Function::PostOrderImpl(BasicBlock* Current, std::set<BasicBlock*> Visited, std::vector<BasicBlock*>& PostOrder) const {
+void Function::PostOrderImpl(BasicBlock* Current, std::set<BasicBlock*>& Visited, std::vector<BasicBlock*>& PostOrder) const {
   if(Visited.count(Current)) {
     return;
   }
@@ -253,7 +261,7 @@ std::vector<BasicBlock*> BasicBlock::Predecessors() const {
 
 bool BasicBlock::IsExit() const {
   assert(Tail_ && "Basic block has no terminator");
-  return Tail_->Type() == Instruction::Ret || Tail_->Type() == Instruction::RetVoid; 
+  return Tail_->Type() == Instruction::Ret || Tail_->Type() == Instruction::RetVoid || Tail_->Type() == Instruction::TailCall; 
 }
 
 void Operand::Print() const {
@@ -341,6 +349,14 @@ void CallVoidInst::Print() const {
   }
 }
 
+void TailCallInst::Print() const {
+  std::cout << "tailcall " << Callee_;
+  for(size_t i = 0; i < Ins(); i++) {
+    std::cout << " ";
+    GetIn(i).Print();
+  }
+}
+
 void ArrayNewInst::Print() const {
   GetOut(0).Print();
   std::cout << " = array_new ";
@@ -372,16 +388,17 @@ void LoadLabelInst::Print() const {
 int64_t BinaryInst::Evaluate(Operation Op, int64_t Op1, int64_t Op2) {
   int64_t Result = 0;
   switch(Op) {
-    case Add: Result = Op1 + Op2; break;
-    case Sub: Result = Op1 - Op2; break;
-    case Mul: Result = Op1 * Op2; break;
+    // wraps around and masks shift counts like the generated code
+    case Add: Result = static_cast<int64_t>(static_cast<uint64_t>(Op1) + static_cast<uint64_t>(Op2)); break;
+    case Sub: Result = static_cast<int64_t>(static_cast<uint64_t>(Op1) - static_cast<uint64_t>(Op2)); break;
+    case Mul: Result = static_cast<int64_t>(static_cast<uint64_t>(Op1) * static_cast<uint64_t>(Op2)); break;
     case Div: Result = Op1 / Op2; break;
     case Mod: Result = Op1 % Op2; break;
     case And: Result = Op1 & Op2; break;
     case Or: Result = Op1 | Op2; break;
     case Xor: Result = Op1 ^ Op2; break;
-    case Shl: Result = Op1 << Op2; break;
-    case Shr: Result = Op1 >> Op2; break;
+    case Shl: Result = static_cast<int64_t>(static_cast<uint64_t>(Op1) << (Op2 & 63)); break;
+    case Shr: Result = Op1 >> (Op2 & 63); break;
     case Lt: {
       Result = Op1 < Op2 ? 1 : 0;
       break;
@@ -1,144 +1,195 @@
 #include <IR/Interpreter.h>
 
+#include <algorithm>
 #include <exception>
+#include <tuple>
 
 namespace klang {
 
+// frame stack limit in slots (512MB), deeper recursion is a stack overflow
+static constexpr size_t kMaxStackSlots = size_t(1) << 26;
+
 Interpreter::~Interpreter() {
 }
 
-int64_t Interpreter::LoadOperand(Operand Op, std::vector<int64_t>& Args) {
-  if(Op.IsImmediate()) {
-    return Op.Imm();
-  } else if(Op.IsRegister()) {
-    auto It = Regs_.find(Op.RegId());
-    if(It == Regs_.end()) {
-      throw std::runtime_error("Unknown register");
-    }
+uint32_t Interpreter::FunctionIndex(const std::string& Name) {
+  auto It = FunctionIndices_.find(Name);
+  if(It != FunctionIndices_.end()) {
     return It->second;
-  } else if(Op.IsParameter()) {
-    return Args[Op.Param()];
   }
-  throw std::runtime_error("Unknown operand type");
+  Functions_.push_back({Name, nullptr, nullptr, nullptr, 0});
+  return FunctionIndices_[Name] = Functions_.size() - 1;
+}
+
+// compiled on the first call, so string literals may be added afterwards
+BytecodeFunction* Interpreter::Resolve(uint32_t Index) {
+  if(Functions_[Index].Code_ == nullptr) {
+    if(Functions_[Index].IR_ == nullptr) {
+      throw std::runtime_error("Unknown function " + Functions_[Index].Name_);
+    }
+    // Compile may grow the function table
+    auto *Code = Compile(Functions_[Index].IR_);
+    Code->Index_ = Index;
+    Functions_[Index].Code_.reset(Code);
+  }
+  return Functions_[Index].Code_.get();
 }
 
-void Interpreter::StoreOperand(size_t Reg, Operand Op) {
-  if(Op.IsImmediate()) {
-    Regs_[Reg] = Op.Imm();
-  } else if(Op.IsRegister()) {
-    auto It = Regs_.find(Op.RegId());
-    if(It == Regs_.end()) {
-      throw std::runtime_error("Unknown register");
-    }
-    Regs_[Reg] = It->second;
-  } else {
-    throw std::runtime_error("Unknown operand type");
+int64_t Interpreter::RunFunction(const char* Name, std::vector<int64_t>& Args) {
+  auto It = FunctionIndices_.find(Name);
+  if(It == FunctionIndices_.end()) {
+    throw std::runtime_error(std::string("Unknown function ") + Name);
   }
+  return Execute(It->second, Args);
 }
 
-int64_t Interpreter::Execute(Function* F, std::vector<int64_t>& Args) {
-  auto* Current = F->Entry();
-  while(true) {
-L:
-    auto* Inst = Current->Head();
-    while(Inst != nullptr) {
-      // XXX: Add instructions
-      auto Type = Inst->Type();
-      switch(Type) {
+BytecodeFunction* Interpreter::Compile(Function* F) {
+  auto *BF = new BytecodeFunction();
+  BF->Name_ = F->Name();
+  BF->NumParams_ = F->NumParams();
+  BF->ConstantBase_ = F->NumParams() + F->NumRegs();
+  BF->Threaded_ = false;
+
+  std::unordered_map<int64_t, uint32_t> ConstantSlots;
+  auto Constant = [&](int64_t Value) -> uint32_t {
+    auto It = ConstantSlots.find(Value);
+    if(It != ConstantSlots.end()) {
+      return It->second;
+    }
+    BF->Constants_.push_back(Value);
+    return ConstantSlots[Value] = BF->ConstantBase_ + BF->Constants_.size() - 1;
+  };
+  auto Slot = [&](const Operand& Op) -> uint32_t {
+    if(Op.IsParameter()) {
+      return Op.Param();
+    } else if(Op.IsRegister()) {
+      return BF->NumParams_ + Op.RegId();
+    }
+    return Constant(Op.Imm());
+  };
+
+  auto Emit = [&](BytecodeOp Op, uint32_t A = 0, uint32_t B = 0, uint32_t C = 0) {
+    BF->Code_.push_back({nullptr, Op, A, B, C});
+  };
+  auto EmitCall = [&](BytecodeOp Op, uint32_t Dst, const std::string& Callee, const std::vector<Operand>& Args) {
+    uint32_t ArgList = BF->ArgPool_.size();
+    BF->ArgPool_.push_back(Args.size());
+    for(auto &Arg : Args) {
+      BF->ArgPool_.push_back(Slot(Arg));
+    }
+    Emit(Op, Dst, FunctionIndex(Callee), ArgList);
+  };
+  auto Inputs = [](Instruction& Inst) {
+    std::vector<Operand> Ins;
+    for(size_t i = 0; i < Inst.Ins(); i++) {
+      Ins.push_back(Inst.GetIn(i));
+    }
+    return Ins;
+  };
+
+  // jump targets are patched once every block has a pc
+  std::vector<BasicBlock*> Blocks(F->begin(), F->end());
+  std::unordered_map<BasicBlock*, uint32_t> BlockPC;
+  std::vector<std::tuple<size_t, BasicBlock*, BasicBlock*>> Targets;
+
+  // with tiering, the targets of backward edges count loop iterations
+  std::set<BasicBlock*> LoopHeaders;
+  if(TierUp_) {
+    std::unordered_map<BasicBlock*, size_t> Position;
+    for(size_t i = 0; i < Blocks.size(); i++) {
+      Position[Blocks[i]] = i;
+      for(auto *Succ : Blocks[i]->Successors()) {
+        if(Position.count(Succ) != 0) {
+          LoopHeaders.insert(Succ);
+        }
+      }
+    }
+  }
+
+  for(size_t i = 0; i < Blocks.size(); i++) {
+    auto *BB = Blocks[i];
+    auto *Next = i + 1 < Blocks.size() ? Blocks[i + 1] : nullptr;
+    BlockPC[BB] = BF->Code_.size();
+    if(LoopHeaders.count(BB) != 0) {
+      Emit(BytecodeOp::Loop);
+    }
+
+    for(auto &Inst : *BB) {
+      switch(Inst.Type()) {
         case Instruction::Nop: {
           break;
         }
         case Instruction::Assign: {
-          auto In = LoadOperand(Inst->GetIn(0), Args);
-          StoreOperand(Inst->GetOut(0).RegId(), Operand::CreateImmediate(In));
+          Emit(BytecodeOp::Mov, Slot(Inst.GetOut(0)), Slot(Inst.GetIn(0)));
           break;
         }
         case Instruction::Binary: {
-          auto *B = static_cast<BinaryInst*>(Inst);
-          auto RHS1 = LoadOperand(Inst->GetIn(0), Args);
-          auto RHS2 = LoadOperand(Inst->GetIn(1), Args);
-          auto Result = BinaryInst::Evaluate(B->GetOperation(), RHS1, RHS2);
-          StoreOperand(Inst->GetOut(0).RegId(), Operand::CreateImmediate(Result));
+          auto &B = static_cast<BinaryInst&>(Inst);
+          auto Op = static_cast<BytecodeOp>(static_cast<size_t>(BytecodeOp::Add) + B.GetOperation());
+          Emit(Op, Slot(B.GetOut(0)), Slot(B.GetIn(0)), Slot(B.GetIn(1)));
           break;
         }
 
         // CF related instructions
-        case Instruction::Ret: {
-          return LoadOperand(Inst->GetIn(0), Args);
-        }
-        case Instruction::RetVoid: {
-          return 0;   // Not used
-        }
         case Instruction::Jmp: {
-          auto *J = static_cast<JmpInst*>(Inst);
-          Current = J->Successor(0);
-          goto L;
+          if(Inst.Successor(0) != Next) {
+            Emit(BytecodeOp::Jmp);
+            Targets.emplace_back(BF->Code_.size() - 1, Inst.Successor(0), nullptr);
+          }
+          break;
         }
         case Instruction::Jnz: {
-          auto *J = static_cast<JnzInst*>(Inst);
-          auto Cond = LoadOperand(J->GetIn(0), Args);
-          if(Cond != 0) {
-            Current = J->Successor(0);
-            goto L;
-          } else {
-            Current = J->Successor(1);
-            goto L;
-          }
+          Emit(BytecodeOp::Jnz, Slot(Inst.GetIn(0)));
+          Targets.emplace_back(BF->Code_.size() - 1, Inst.Successor(0), Inst.Successor(1));
+          break;
+        }
+        case Instruction::Ret: {
+          Emit(BytecodeOp::Ret, Slot(Inst.GetIn(0)));
+          break;
         }
-        
+        case Instruction::RetVoid: {
+          Emit(BytecodeOp::RetVoid);
+          break;
+        }
+
         // calls
         case Instruction::Call: {
-          auto *C = static_cast<CallInst*>(Inst);
-          std::vector<int64_t> CallArgs;
-          for(size_t i = 0; i < C->Ins(); ++i) {
-            CallArgs.push_back(LoadOperand(C->GetIn(i), Args));
-          }
-          auto Result = RunFunction(C->Callee(), CallArgs);
-          StoreOperand(C->GetOut(0).RegId(), Operand::CreateImmediate(Result));
+          auto &C = static_cast<CallInst&>(Inst);
+          EmitCall(BytecodeOp::Call, Slot(C.GetOut(0)), C.Callee(), Inputs(C));
           break;
         }
         case Instruction::CallVoid: {
-          auto *C = static_cast<CallVoidInst*>(Inst);
-          std::vector<int64_t> CallArgs;
-          for(size_t i = 0; i < C->Ins(); ++i) {
-            CallArgs.push_back(LoadOperand(C->GetIn(i), Args));
-          }
-          RunFunction(C->Callee(), CallArgs);
+          auto &C = static_cast<CallVoidInst&>(Inst);
+          EmitCall(BytecodeOp::CallVoid, 0, C.Callee(), Inputs(C));
+          break;
+        }
+        case Instruction::TailCall: {
+          auto &C = static_cast<TailCallInst&>(Inst);
+          EmitCall(BytecodeOp::TailCall, 0, C.Callee(), Inputs(C));
           break;
         }
 
-        // Arrays
+        // arrays live in the runtime, same as in compiled code
         case Instruction::ArrayNew: {
-          auto Length = LoadOperand(Inst->GetIn(0), Args);
-          auto NewIndex = static_cast<int64_t>(Arrays_.size());
-          Arrays_.push_back(std::vector<int64_t>(Length, 0));
-          StoreOperand(Inst->GetOut(0).RegId(), Operand::CreateImmediate(NewIndex));
+          EmitCall(BytecodeOp::Call, Slot(Inst.GetOut(0)), "array_new", Inputs(Inst));
           break;
         }
         case Instruction::ArrayLoad: {
-          auto Index = LoadOperand(Inst->GetIn(1), Args);
-          auto Array = LoadOperand(Inst->GetIn(0), Args);
-          if(Arrays_.size() <= Array) {
-            throw std::runtime_error("No such array");
-          }
-          if(Index >= Arrays_[Array].size()) {
-            throw std::runtime_error("Index out of bounds");
-          }
-          auto Value = Arrays_[Array][Index];
-          StoreOperand(Inst->GetOut(0).RegId(), Operand::CreateImmediate(Value));
+          EmitCall(BytecodeOp::Call, Slot(Inst.GetOut(0)), "array_load", Inputs(Inst));
           break;
         }
         case Instruction::ArrayStore: {
-          auto Index = LoadOperand(Inst->GetIn(1), Args);
-          auto Array = LoadOperand(Inst->GetIn(0), Args);
-          if(Arrays_.size() <= Array) {
-            throw std::runtime_error("No such array");
-          }
-          if(Index >= Arrays_[Array].size()) {
-            throw std::runtime_error("Index out of bounds");
+          EmitCall(BytecodeOp::CallVoid, 0, "array_store", Inputs(Inst));
+          break;
+        }
+
+        case Instruction::LoadLabel: {
+          auto &L = static_cast<LoadLabelInst&>(Inst);
+          auto It = StringLiterals_.find(L.Label());
+          if(It == StringLiterals_.end()) {
+            throw std::runtime_error("Unknown string literal");
           }
-          auto Value = LoadOperand(Inst->GetIn(2), Args);
-          Arrays_[Array][Index] = Value;
+          Emit(BytecodeOp::Mov, Slot(L.GetOut(0)), Constant(reinterpret_cast<int64_t>(It->second.data())));
           break;
         }
 
@@ -148,6 +199,224 @@ L:
       }
     }
   }
+
+  for(auto [Index, True, False] : Targets) {
+    auto &Code = BF->Code_[Index];
+    if(Code.Op_ == BytecodeOp::Jmp) {
+      Code.A_ = BlockPC[True];
+    } else {
+      Code.B_ = BlockPC[True];
+      Code.C_ = BlockPC[False];
+    }
+  }
+
+  BF->FrameSize_ = BF->ConstantBase_ + BF->Constants_.size();
+  return BF;
+}
+
+int64_t Interpreter::Execute(uint32_t Index, std::vector<int64_t>& Args) {
+  // must follow the order of BytecodeOp
+  static const void* const kDispatch[] = {
+    &&Mov,
+    &&Add, &&Sub, &&Mul, &&Div, &&Mod, &&And, &&Or, &&Xor, &&Shl, &&Shr,
+    &&Lt, &&Le, &&Gt, &&Ge, &&Eq, &&Ne,
+    &&Jmp, &&Jnz, &&Loop, &&Ret, &&RetVoid,
+    &&Call, &&CallVoid, &&TailCall,
+  };
+
+  if(Functions_[Index].Native_) {
+    return Functions_[Index].Native_(Args);
+  }
+
+  // Activations are register windows laid out back to back in Stack. The
+  // running function's window starts at Base, the callers are in Frames.
+  // Stack is a member so that MarkRoots can see it; a native function may
+  // run interpreted code again, which starts above the caller's window.
+  auto &Stack = Stack_;
+  std::vector<int64_t> Scratch;
+  std::vector<CallFrame> Frames;
+  size_t Bottom = StackTop_;
+  size_t Base = Bottom;
+  int64_t* R = nullptr;
+  BytecodeFunction* F = nullptr;
+  const BytecodeInst* Code = nullptr;
+  const BytecodeInst* PC = nullptr;
+  int64_t Value = 0;
+
+  auto Enter = [&](uint32_t Index) {
+    auto *Callee = Resolve(Index);
+    if(!Callee->Threaded_) {
+      for(auto &Inst : Callee->Code_) {
+        Inst.Handler_ = kDispatch[static_cast<size_t>(Inst.Op_)];
+      }
+      Callee->Threaded_ = true;
+    }
+    return Callee;
+  };
+  // growing the stack moves it, so R is recomputed every time
+  auto Reserve = [&](size_t Size) {
+    if(Stack.size() < Size) {
+      if(Size > kMaxStackSlots) {
+        throw std::runtime_error("Stack overflow");
+      }
+      Stack.resize(std::max(Size, Stack.size() * 2));
+    }
+    R = Stack.data() + Base;
+  };
+  // the arguments are already in place at the start of the window
+  auto Setup = [&](BytecodeFunction* Callee) {
+    std::fill(R + Callee->NumParams_, R + Callee->ConstantBase_, 0);
+    std::copy(Callee->Constants_.begin(), Callee->Constants_.end(), R + Callee->ConstantBase_);
+    F = Callee;
+    Code = PC = Callee->Code_.data();
+  };
+  auto CountHotness = [&](uint32_t Index) {
+    auto &Entry = Functions_[Index];
+    if(TierUp_ && Entry.IR_ != nullptr && !Entry.Native_ && ++Entry.Hotness_ == TierUpThreshold_) {
+      TierUp_(Entry.IR_);
+    }
+  };
+  // the nested Execute may grow the stack, so R is recomputed afterwards
+  auto CallNative = [&](uint32_t Index) {
+    StackTop_ = Base + F->FrameSize_;
+    auto Result = Functions_[Index].Native_(Scratch);
+    StackTop_ = Bottom;
+    R = Stack.data() + Base;
+    return Result;
+  };
+  auto GatherArgs = [&](uint32_t ArgList) {
+    auto *List = &F->ArgPool_[ArgList];
+    Scratch.resize(List[0]);
+    for(uint32_t i = 0; i < List[0]; i++) {
+      Scratch[i] = R[List[i + 1]];
+    }
+  };
+
+  auto *Main = Enter(Index);
+  Reserve(Base + Main->FrameSize_);
+  std::copy(Args.begin(), Args.end(), R);
+  Setup(Main);
+
+#define DISPATCH() goto *PC->Handler_
+#define NEXT() do { ++PC; DISPATCH(); } while(0)
+#define BINARY(Label, Expr) \
+  Label: { \
+    int64_t L = R[PC->B_], Rhs = R[PC->C_]; \
+    R[PC->A_] = (Expr); \
+    NEXT(); \
+  }
+
+  DISPATCH();
+
+Mov:
+  R[PC->A_] = R[PC->B_];
+  NEXT();
+
+  // wraps around and masks shift counts like the generated code
+  BINARY(Add, static_cast<int64_t>(static_cast<uint64_t>(L) + static_cast<uint64_t>(Rhs)))
+  BINARY(Sub, static_cast<int64_t>(static_cast<uint64_t>(L) - static_cast<uint64_t>(Rhs)))
+  BINARY(Mul, static_cast<int64_t>(static_cast<uint64_t>(L) * static_cast<uint64_t>(Rhs)))
+Div:
+  if(R[PC->C_] == 0) {
+    throw std::runtime_error("Division by zero");
+  }
+  R[PC->A_] = R[PC->B_] / R[PC->C_];
+  NEXT();
+Mod:
+  if(R[PC->C_] == 0) {
+    throw std::runtime_error("Division by zero");
+  }
+  R[PC->A_] = R[PC->B_] % R[PC->C_];
+  NEXT();
+  BINARY(And, L & Rhs)
+  BINARY(Or, L | Rhs)
+  BINARY(Xor, L ^ Rhs)
+  BINARY(Shl, static_cast<int64_t>(static_cast<uint64_t>(L) << (Rhs & 63)))
+  BINARY(Shr, L >> (Rhs & 63))
+  BINARY(Lt, L < Rhs ? 1 : 0)
+  BINARY(Le, L <= Rhs ? 1 : 0)
+  BINARY(Gt, L > Rhs ? 1 : 0)
+  BINARY(Ge, L >= Rhs ? 1 : 0)
+  BINARY(Eq, L == Rhs ? 1 : 0)
+  BINARY(Ne, L != Rhs ? 1 : 0)
+
+Jmp:
+  PC = Code + PC->A_;
+  DISPATCH();
+Jnz:
+  PC = Code + (R[PC->A_] != 0 ? PC->B_ : PC->C_);
+  DISPATCH();
+Loop:
+  // the running activation stays interpreted even if F goes native
+  CountHotness(F->Index_);
+  NEXT();
+
+Ret:
+  Value = R[PC->A_];
+  goto Return;
+RetVoid:
+  Value = 0;
+  goto Return;
+Return: {
+    if(Frames.empty()) {
+      return Value;
+    }
+    auto &Caller = Frames.back();
+    F = Caller.Function_;
+    Code = F->Code_.data();
+    PC = Caller.CallPC_;
+    Base = Caller.Base_;
+    R = Stack.data() + Base;
+    Frames.pop_back();
+    if(PC->Op_ == BytecodeOp::Call) {
+      R[PC->A_] = Value;
+    }
+    NEXT();
+  }
+
+Call:
+CallVoid: {
+    CountHotness(PC->B_);
+    if(Functions_[PC->B_].Native_) {
+      GatherArgs(PC->C_);
+      Value = CallNative(PC->B_);
+      if(PC->Op_ == BytecodeOp::Call) {
+        R[PC->A_] = Value;
+      }
+      NEXT();
+    }
+    // the callee's window starts right after the caller's
+    auto *Callee = Enter(PC->B_);
+    auto *List = &F->ArgPool_[PC->C_];
+    size_t CalleeBase = Base + F->FrameSize_;
+    Reserve(CalleeBase + Callee->FrameSize_);
+    for(uint32_t i = 0; i < List[0]; i++) {
+      Stack[CalleeBase + i] = R[List[i + 1]];
+    }
+    Frames.push_back({F, PC, Base});
+    Base = CalleeBase;
+    R = Stack.data() + Base;
+    Setup(Callee);
+    DISPATCH();
+  }
+TailCall: {
+    CountHotness(PC->B_);
+    GatherArgs(PC->C_);
+    if(Functions_[PC->B_].Native_) {
+      Value = CallNative(PC->B_);
+      goto Return;
+    }
+    // the callee takes over the current window
+    auto *Callee = Enter(PC->B_);
+    Reserve(Base + Callee->FrameSize_);
+    std::copy(Scratch.begin(), Scratch.end(), R);
+    Setup(Callee);
+    DISPATCH();
+  }
+
+#undef BINARY
+#undef NEXT
+#undef DISPATCH
 }
 
-} // namespace klang
\ No newline at end of file
+} // namespace klang
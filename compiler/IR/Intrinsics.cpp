@@ -0,0 +1,40 @@
+#include <IR/Intrinsics.h>
+
+namespace klang {
+
+static const Intrinsic kIntrinsics[] = {
+  { "printi", 1, false, kIntrinsicWritesStdout },
+  { "prints", 1, false, kIntrinsicWritesStdout },
+  { "inputi", 0, true, kIntrinsicReadsStdin },
+  { "inputs", 0, true, kIntrinsicReadsStdin | kIntrinsicAllocates },
+  // the generator is seeded by the kernel, so skipping a number is not
+  // observable; two calls still differ
+  { "random", 0, true, 0 },
+  { "array_new", 1, true, kIntrinsicAllocates | kIntrinsicMayTrap },
+  // only called by the slow paths of ArrayLoad and ArrayStore
+  { "array_load", 2, true, kIntrinsicPure | kIntrinsicMayTrap },
+  { "array_store", 3, false, kIntrinsicClobbersMemory | kIntrinsicMayTrap },
+  // strings allocated after a mark are freed by the reset back to it
+  { "region_mark", 0, true, kIntrinsicClobbersMemory },
+  { "region_reset", 1, false, kIntrinsicClobbersMemory },
+  { "region_end", 0, false, kIntrinsicClobbersMemory },
+  // strings are never modified; all of these fail on a null string, so a
+  // repeated call can reuse the first result but an unused one stays
+  { "strlen", 1, true, kIntrinsicPure | kIntrinsicMayTrap },
+  { "strcmp", 2, true, kIntrinsicPure | kIntrinsicMayTrap },
+  { "strfind", 2, true, kIntrinsicPure | kIntrinsicMayTrap },
+  { "substr", 3, true, kIntrinsicAllocates | kIntrinsicMayTrap },
+  { "concat", 2, true, kIntrinsicAllocates | kIntrinsicMayTrap },
+  { "charat", 2, true, kIntrinsicPure | kIntrinsicMayTrap },
+};
+
+const Intrinsic* FindIntrinsic(const std::string& Name) {
+  for(auto &I : kIntrinsics) {
+    if(Name == I.Name_) {
+      return &I;
+    }
+  }
+  return nullptr;
+}
+
+} // namespace klang
@@ -3,6 +3,8 @@
 
 #include <Logging.h>
 
+#include <functional>
+
 namespace klang {
 
 #pragma region ConstPropagate
@@ -69,7 +71,8 @@ void ConstPropState::Transfer(const Instruction& Inst) {
     case Instruction::ArrayStore:
     case Instruction::Jmp:
     case Instruction::Jnz: 
-    case Instruction::CallVoid: {
+    case Instruction::CallVoid:
+    case Instruction::TailCall: {
       break;
     }
 
@@ -159,173 +162,481 @@ bool CopyPropagate(Function* F) {
 }
 #pragma endregion
 
-#pragma region CommonSubexpressionElimination
-std::optional<CSEValue> CSEValue::FromInstruction(const Instruction& Inst) {
-  if(Inst.Type() == Instruction::Binary) {
-    auto &BinInst = dynamic_cast<const BinaryInst&>(Inst);
-    auto Op1 = BinInst.GetIn(0);
-    auto Op2 = BinInst.GetIn(1);
-
-    // RHS should be immutable
-    if((Op1.IsImmediate() || Op1.IsParameter()) && (Op2.IsImmediate() || Op2.IsParameter())) {
-      return std::make_optional(CSEValue(BinInst.GetOperation(), Op1, Op2));
-    }
+#pragma region GlobalValueNumbering
+size_t GVNExpressionHash::operator()(const GVNExpression& Expr) const {
+  size_t Hash = std::hash<std::string>()(Expr.Label_);
+  auto Combine = [&](size_t Value) {
+    Hash ^= Value + 0x9e3779b97f4a7c15ULL + (Hash << 6) + (Hash >> 2);
+  };
+  Combine(Expr.Type_);
+  Combine(Expr.Operation_);
+  for(auto Arg : Expr.Args_) {
+    Combine(Arg);
   }
-  return std::nullopt;
-} 
+  return Hash;
+}
 
-bool GCSEState::Contains(const CSEValue& Value) const {
-  if(!Init_) {
-    return false;
+static bool IsCommutative(BinaryInst::Operation Op) {
+  switch(Op) {
+    case BinaryInst::Add:
+    case BinaryInst::Mul:
+    case BinaryInst::And:
+    case BinaryInst::Or:
+    case BinaryInst::Xor:
+    case BinaryInst::Eq:
+    case BinaryInst::Ne:
+      return true;
+    default:
+      return false;
   }
-  return Values_.count(Value) != 0;
 }
 
-void GCSEState::Intersect(const GCSEState& Other) {
-  if(!Other.Init_) {
-    return;
+// Value numbers visible at some point of the dominator tree walk. There is
+// one scope for the whole walk: every change is logged, and leaving a subtree
+// rolls the log back to where it was on entry.
+struct GVNScope {
+  using ExprValue = std::pair<size_t, Operand>;
+
+  std::unordered_map<size_t, size_t> Regs_;
+  std::unordered_map<GVNExpression, ExprValue, GVNExpressionHash> Exprs_;
+  size_t Memory_;
+  std::vector<std::pair<size_t, std::optional<size_t>>> RegLog_;
+  std::vector<std::pair<GVNExpression, std::optional<ExprValue>>> ExprLog_;
+
+  struct Mark {
+    size_t Regs_;
+    size_t Exprs_;
+    size_t Memory_;
+  };
+
+  Mark Save() const { return { RegLog_.size(), ExprLog_.size(), Memory_ }; }
+
+  void SetReg(size_t Reg, size_t Value) {
+    auto It = Regs_.find(Reg);
+    RegLog_.emplace_back(Reg, It == Regs_.end() ? std::nullopt : std::optional<size_t>(It->second));
+    Regs_[Reg] = Value;
   }
 
-  if(!Init_) {
-    Values_ = std::set(Other.Values_.begin(), Other.Values_.end());
-    Init_ = true;
-    return;
+  void EraseReg(size_t Reg) {
+    auto It = Regs_.find(Reg);
+    if(It != Regs_.end()) {
+      RegLog_.emplace_back(Reg, It->second);
+      Regs_.erase(It);
+    }
   }
 
-  std::set<CSEValue> NewValues;
-  for(auto &Value : Values_) {
-    if(Other.Contains(Value)) {
-      NewValues.insert(Value);
+  void SetExpr(const GVNExpression& Expr, ExprValue Value) {
+    auto It = Exprs_.find(Expr);
+    if(It == Exprs_.end()) {
+      ExprLog_.emplace_back(Expr, std::nullopt);
+      Exprs_.emplace(Expr, Value);
+    } else {
+      ExprLog_.emplace_back(Expr, It->second);
+      It->second = Value;
     }
   }
-  Values_ = NewValues;
-  return ;
-}
 
-void GCSEState::Meet(const GCSEState& Other) {
-  Intersect(Other);
-}
+  void Restore(const Mark& M) {
+    while(RegLog_.size() > M.Regs_) {
+      auto &[Reg, Old] = RegLog_.back();
+      if(Old.has_value()) {
+        Regs_[Reg] = Old.value();
+      } else {
+        Regs_.erase(Reg);
+      }
+      RegLog_.pop_back();
+    }
+    while(ExprLog_.size() > M.Exprs_) {
+      auto &[Expr, Old] = ExprLog_.back();
+      if(Old.has_value()) {
+        Exprs_.insert_or_assign(Expr, Old.value());
+      } else {
+        Exprs_.erase(Expr);
+      }
+      ExprLog_.pop_back();
+    }
+    Memory_ = M.Memory_;
+  }
+};
+
+class GVNContext {
+public:
+  GVNContext(Function* F) : F_(F), Tree_(F), NextValue_(0) {
+    for(auto *BB : (*F)) {
+      for(auto InstIt = BB->begin(); InstIt != BB->end(); InstIt++) {
+        for(size_t i = 0; i < InstIt->Outs(); i++) {
+          if(InstIt->GetOut(i).IsRegister()) {
+            NumDefs_[InstIt->GetOut(i).RegId()]++;
+          }
+        }
+      }
+    }
+    for(auto [Reg, Defs] : NumDefs_) {
+      if(Defs > 1) {
+        MultiDefs_.push_back(Reg);
+      }
+    }
+  }
 
-void GCSEState::Transfer(const Instruction& Inst) {
-  auto Value = CSEValue::FromInstruction(Inst);
-  if(Value.has_value()) {
-    Values_.insert(Value.value());
-    Init_ = true;
+  bool Run() {
+    GVNScope Scope;
+    Scope.Memory_ = NewValue();
+    return Visit(F_->Entry(), Scope);
   }
-}
 
-static bool LocalCSEBlock(BasicBlock* BB) {
-  bool Changed = false;
-  int i = 0;
+private:
+  size_t NewValue() { return NextValue_++; }
 
-  std::map<CSEValue, int> Mapping;
-  std::map<CSEValue, Instruction*> Defs;
-  std::map<int, std::set<int>> State;
-  std::map<CSEValue, std::vector<Instruction*>> Reusable;
+  size_t ValueOf(const Operand& Op, GVNScope& Scope) {
+    if(Op.IsImmediate()) {
+      auto It = Constants_.find(Op.Imm());
+      if(It == Constants_.end()) {
+        It = Constants_.emplace(Op.Imm(), NewValue()).first;
+      }
+      return It->second;
+    }
+    if(Op.IsParameter()) {
+      auto It = Params_.find(Op.Param());
+      if(It == Params_.end()) {
+        It = Params_.emplace(Op.Param(), NewValue()).first;
+      }
+      return It->second;
+    }
+    auto It = Scope.Regs_.find(Op.RegId());
+    if(It == Scope.Regs_.end()) {
+      auto Value = NewValue();
+      Scope.SetReg(Op.RegId(), Value);
+      return Value;
+    }
+    return It->second;
+  }
 
-  // find all reusable expressions
-  State[0] = std::set<int>();
-  for(auto InstIt = BB->begin(); InstIt != BB->end(); InstIt++) {
-    auto &Inst = *InstIt;
-    auto Value = CSEValue::FromInstruction(Inst);
-    if(Value.has_value()) {
-      auto Expr = Value.value();
-      if(Mapping.count(Expr) == 0) {
-        Mapping[Expr] = i;
-        Defs[Expr] = &Inst;
-      } else {
-        auto Id = Mapping[Expr];
-        if(State[i].count(Id) != 0) {
-          Reusable[Expr].push_back(&Inst);
-        } 
+  std::optional<GVNExpression> ExpressionOf(const Instruction& Inst, GVNScope& Scope) {
+    GVNExpression Expr;
+    Expr.Type_ = Inst.Type();
+    switch(Inst.Type()) {
+      case Instruction::Binary: {
+        auto Op = static_cast<const BinaryInst&>(Inst).GetOperation();
+        Expr.Operation_ = Op;
+        Expr.Args_[0] = ValueOf(Inst.GetIn(0), Scope);
+        Expr.Args_[1] = ValueOf(Inst.GetIn(1), Scope);
+        if(IsCommutative(Op) && Expr.Args_[0] > Expr.Args_[1]) {
+          std::swap(Expr.Args_[0], Expr.Args_[1]);
+        }
+        return Expr;
+      }
+      case Instruction::ArrayLoad: {
+        // loads are only equal while no store or call happened in between
+        Expr.Args_[0] = ValueOf(Inst.GetIn(0), Scope);
+        Expr.Args_[1] = ValueOf(Inst.GetIn(1), Scope);
+        Expr.Args_[2] = Scope.Memory_;
+        return Expr;
+      }
+      case Instruction::LoadLabel: {
+        Expr.Label_ = static_cast<const LoadLabelInst&>(Inst).Label();
+        return Expr;
+      }
+      case Instruction::Call: {
+        // pure intrinsics may read what their arguments point to, so they
+        // are versioned by memory like loads
+        auto &Call = static_cast<const CallInst&>(Inst);
+        auto *Intrinsic = Call.GetIntrinsic();
+        if(Intrinsic == nullptr || !Intrinsic->Is(kIntrinsicPure)) {
+          return std::nullopt;
+        }
+        assert(Call.Ins() <= 3 && "Too many arguments to number");
+        Expr.Label_ = Call.Callee();
+        Expr.Operation_ = Scope.Memory_;
+        for(size_t i = 0; i < Call.Ins(); i++) {
+          Expr.Args_[i] = ValueOf(Call.GetIn(i), Scope);
+        }
+        return Expr;
+      }
+      default: {
+        return std::nullopt;
       }
-      State[i].insert(Mapping[Expr]);
     }
-    State[i + 1] = State[i];
-    i++;
   }
 
-  for(auto &KV : Reusable) {
-    if(KV.second.size() != 0) {
-      auto *Def = Defs[KV.first];
-      auto NewReg = Operand::CreateRegister(BB->Parent()->NewReg());
-      auto OldReg = Def->GetOut(0);
-      Def->ReplaceOut(0, NewReg);
-      Def->Parent()->InsertAfter(new AssignInst(OldReg, NewReg), Def);
+  static bool MayWriteMemory(const Instruction& Inst) {
+    const Intrinsic* Intrinsic = nullptr;
+    if(Inst.Type() == Instruction::Call) {
+      Intrinsic = static_cast<const CallInst&>(Inst).GetIntrinsic();
+    } else if(Inst.Type() == Instruction::CallVoid) {
+      Intrinsic = static_cast<const CallVoidInst&>(Inst).GetIntrinsic();
+    } else {
+      return Inst.Type() == Instruction::ArrayStore;
+    }
+    return Intrinsic == nullptr || Intrinsic->Is(kIntrinsicClobbersMemory);
+  }
+
+  bool Visit(BasicBlock* BB, GVNScope& Scope) {
+    bool Changed = false;
+    auto Mark = Scope.Save();
 
-      for(auto *User : KV.second) {
-        auto Dst = User->GetOut(0);
-        User->Parent()->Replace(new AssignInst(Dst, NewReg), User);
-        delete User;
+    // unless the block is only entered from its immediate dominator, other
+    // paths may have reassigned registers or stored to memory in between
+    auto Preds = BB->Predecessors();
+    if(BB != F_->Entry() && !(Preds.size() == 1 && Preds[0] == Tree_.IDom(BB))) {
+      for(auto Reg : MultiDefs_) {
+        Scope.EraseReg(Reg);
       }
-      Changed = true;
+      Scope.Memory_ = NewValue();
+    }
+
+    for(auto InstIt = BB->begin(); InstIt != BB->end(); InstIt++) {
+      auto *Inst = &*InstIt;
+      auto Expr = ExpressionOf(*Inst, Scope);
+      if(Expr.has_value()) {
+        auto Dst = Inst->GetOut(0);
+        auto It = Scope.Exprs_.find(Expr.value());
+        if(It != Scope.Exprs_.end()) {
+          auto [Value, Holder] = It->second;
+          if(ValueOf(Holder, Scope) == Value) {
+            BB->Replace(new AssignInst(Dst, Holder), Inst);
+            delete Inst;
+            Scope.SetReg(Dst.RegId(), Value);
+            Changed = true;
+            continue;
+          }
+        }
+
+        auto Value = NewValue();
+        Scope.SetExpr(Expr.value(), std::make_pair(Value, Dst));
+        Scope.SetReg(Dst.RegId(), Value);
+        continue;
+      }
+
+      switch(Inst->Type()) {
+        case Instruction::Assign: {
+          Scope.SetReg(Inst->GetOut(0).RegId(), ValueOf(Inst->GetIn(0), Scope));
+          break;
+        }
+        default: {
+          if(MayWriteMemory(*Inst)) {
+            Scope.Memory_ = NewValue();
+          }
+          for(size_t i = 0; i < Inst->Outs(); i++) {
+            Scope.SetReg(Inst->GetOut(i).RegId(), NewValue());
+          }
+          break;
+        }
+      }
+    }
+
+    for(auto *Child : Tree_.Children(BB)) {
+      Changed |= Visit(Child, Scope);
     }
+    Scope.Restore(Mark);
+    return Changed;
   }
-  return Changed;
+
+  Function* F_;
+  DominatorTree Tree_;
+  size_t NextValue_;
+  std::unordered_map<size_t, size_t> NumDefs_;
+  std::vector<size_t> MultiDefs_;
+  std::unordered_map<int64_t, size_t> Constants_;
+  std::unordered_map<size_t, size_t> Params_;
+};
+
+bool GlobalValueNumbering(Function* F) {
+  GVNContext Context(F);
+  return Context.Run();
 }
+#pragma endregion
 
-bool LocalCSE(Function* F) {
-  bool Changed = false;
-  for(auto *BB : (*F)) {
-    Changed |= LocalCSEBlock(BB);
+#pragma region InstCombine
+static const CombineRule kCombineRules[] = {
+  { BinaryInst::Add, CombinePattern::RightImm, 0, CombineResult::Left, 0 },
+  { BinaryInst::Sub, CombinePattern::RightImm, 0, CombineResult::Left, 0 },
+  { BinaryInst::Mul, CombinePattern::RightImm, 1, CombineResult::Left, 0 },
+  { BinaryInst::Mul, CombinePattern::RightImm, 0, CombineResult::Constant, 0 },
+  { BinaryInst::Div, CombinePattern::RightImm, 1, CombineResult::Left, 0 },
+  { BinaryInst::Mod, CombinePattern::RightImm, 1, CombineResult::Constant, 0 },
+  { BinaryInst::And, CombinePattern::RightImm, 0, CombineResult::Constant, 0 },
+  { BinaryInst::And, CombinePattern::RightImm, -1, CombineResult::Left, 0 },
+  { BinaryInst::Or, CombinePattern::RightImm, 0, CombineResult::Left, 0 },
+  { BinaryInst::Or, CombinePattern::RightImm, -1, CombineResult::Constant, -1 },
+  { BinaryInst::Xor, CombinePattern::RightImm, 0, CombineResult::Left, 0 },
+  { BinaryInst::Shl, CombinePattern::RightImm, 0, CombineResult::Left, 0 },
+  { BinaryInst::Shr, CombinePattern::RightImm, 0, CombineResult::Left, 0 },
+
+  { BinaryInst::Sub, CombinePattern::SameOperands, 0, CombineResult::Constant, 0 },
+  { BinaryInst::Xor, CombinePattern::SameOperands, 0, CombineResult::Constant, 0 },
+  { BinaryInst::And, CombinePattern::SameOperands, 0, CombineResult::Left, 0 },
+  { BinaryInst::Or, CombinePattern::SameOperands, 0, CombineResult::Left, 0 },
+  { BinaryInst::Eq, CombinePattern::SameOperands, 0, CombineResult::Constant, 1 },
+  { BinaryInst::Le, CombinePattern::SameOperands, 0, CombineResult::Constant, 1 },
+  { BinaryInst::Ge, CombinePattern::SameOperands, 0, CombineResult::Constant, 1 },
+  { BinaryInst::Ne, CombinePattern::SameOperands, 0, CombineResult::Constant, 0 },
+  { BinaryInst::Lt, CombinePattern::SameOperands, 0, CombineResult::Constant, 0 },
+  { BinaryInst::Gt, CombinePattern::SameOperands, 0, CombineResult::Constant, 0 },
+};
+
+static bool IsAssociative(BinaryInst::Operation Op) {
+  switch(Op) {
+    case BinaryInst::Add:
+    case BinaryInst::Mul:
+    case BinaryInst::And:
+    case BinaryInst::Or:
+    case BinaryInst::Xor:
+      return true;
+    default:
+      return false;
   }
-  return Changed;
 }
 
-static void ReplaceLHS(BasicBlock* Start, BasicBlock* Current, const CSEValue& Value, Operand NewReg, std::set<BasicBlock*>& Visited) {
-  if(Visited.count(Current)) {
-    return;
+// Operation to use when the operands of a comparison are swapped
+static std::optional<BinaryInst::Operation> MirrorOperation(BinaryInst::Operation Op) {
+  switch(Op) {
+    case BinaryInst::Lt: return BinaryInst::Gt;
+    case BinaryInst::Le: return BinaryInst::Ge;
+    case BinaryInst::Gt: return BinaryInst::Lt;
+    case BinaryInst::Ge: return BinaryInst::Le;
+    case BinaryInst::Add:
+    case BinaryInst::Mul:
+    case BinaryInst::And:
+    case BinaryInst::Or:
+    case BinaryInst::Xor:
+    case BinaryInst::Eq:
+    case BinaryInst::Ne:
+      return Op;
+    default:
+      return std::nullopt;
   }
-  Visited.insert(Current);
+}
 
-  if(Start != Current) {
-    for(auto InstIt = Current->begin(); InstIt != Current->end(); InstIt++) {
-      auto &Inst = *InstIt;
-      auto Value = CSEValue::FromInstruction(Inst);
-      if(Value.has_value() && Value.value() == Value) {
-        auto OldReg = Inst.GetOut(0);
-        Inst.ReplaceOut(0, NewReg);
-        Inst.Parent()->InsertAfter(new AssignInst(OldReg, NewReg), &Inst);
+static std::optional<Operand> MatchRule(const BinaryInst& Inst) {
+  auto LHS = Inst.GetIn(0);
+  auto RHS = Inst.GetIn(1);
+  for(auto &Rule : kCombineRules) {
+    if(Rule.Operation_ != Inst.GetOperation()) {
+      continue;
+    }
+
+    bool Matched = false;
+    switch(Rule.Pattern_) {
+      case CombinePattern::RightImm: {
+        Matched = RHS.IsImmediate() && RHS.Imm() == Rule.Imm_;
+        break;
+      }
+      case CombinePattern::SameOperands: {
+        Matched = !LHS.IsImmediate() && LHS == RHS;
+        break;
       }
     }
-  }
+    if(!Matched) {
+      continue;
+    }
 
-  for(auto *Pred : Current->Predecessors()) {
-    ReplaceLHS(Start, Pred, Value, NewReg, Visited);
+    if(Rule.Result_ == CombineResult::Left) {
+      return LHS;
+    }
+    return Operand::CreateImmediate(Rule.Value_);
   }
-  return; 
+  return std::nullopt;
 }
 
-static bool GlobalCSEBlock(BasicBlock* BB, const GCSEState& State) {
+static bool InstCombineBlock(BasicBlock* BB) {
   bool Changed = false;
 
+  // registers defined in this block as "x op C", while x is unchanged
+  std::map<size_t, BinaryInst*> ConstDefs;
+
+  auto Invalidate = [&](size_t Reg) {
+    ConstDefs.erase(Reg);
+    for(auto It = ConstDefs.begin(); It != ConstDefs.end(); ) {
+      auto LHS = It->second->GetIn(0);
+      if(LHS.IsRegister() && LHS.RegId() == Reg) {
+        It = ConstDefs.erase(It);
+      } else {
+        It++;
+      }
+    }
+  };
+
   for(auto InstIt = BB->begin(); InstIt != BB->end(); InstIt++) {
-    auto &Inst = *InstIt;
-    auto *InstPtr = &Inst;
-    auto Value = CSEValue::FromInstruction(Inst);
-    if(Value.has_value() && State.Contains(Value.value())) {
-      auto NewReg = Operand::CreateRegister(BB->Parent()->NewReg());
-      std::set<BasicBlock*> Visited;
-      
-      // Replace exisiting expressions
-      ReplaceLHS(BB, BB, Value.value(), NewReg, Visited);
+    Instruction* Inst = &*InstIt;
+    if(Inst->Type() != Instruction::Binary) {
+      for(size_t i = 0; i < Inst->Outs(); i++) {
+        Invalidate(Inst->GetOut(i).RegId());
+      }
+      continue;
+    }
 
-      auto Dst = Inst.GetOut(0);
-      InstPtr->Parent()->Replace(new AssignInst(Dst, NewReg), InstPtr);
-      delete InstPtr;
+    auto *Bin = static_cast<BinaryInst*>(Inst);
+    auto Op = Bin->GetOperation();
+    auto Dst = Bin->GetOut(0);
+    auto LHS = Bin->GetIn(0);
+    auto RHS = Bin->GetIn(1);
+
+    if(LHS.IsImmediate() && RHS.IsImmediate()) {
+      Invalidate(Dst.RegId());
+      continue;
+    }
 
+    // canonicalize: the immediate goes to the right, and "x - C" becomes "x + -C"
+    if(LHS.IsImmediate() && MirrorOperation(Op).has_value()) {
+      Op = MirrorOperation(Op).value();
+      std::swap(LHS, RHS);
+    }
+    if(Op == BinaryInst::Sub && RHS.IsImmediate() && RHS.Imm() != 0) {
+      Op = BinaryInst::Add;
+      RHS = Operand::CreateImmediate(static_cast<int64_t>(0ULL - static_cast<uint64_t>(RHS.Imm())));
+    }
+
+    // reassociate "(x op C1) op C2" into "x op (C1 op C2)"
+    if(IsAssociative(Op) && LHS.IsRegister() && RHS.IsImmediate() && ConstDefs.count(LHS.RegId())) {
+      auto *Def = ConstDefs[LHS.RegId()];
+      if(Def->GetOperation() == Op) {
+        int64_t Imm;
+        if(Op == BinaryInst::Add) {
+          Imm = static_cast<int64_t>(static_cast<uint64_t>(Def->GetIn(1).Imm()) + static_cast<uint64_t>(RHS.Imm()));
+        } else if(Op == BinaryInst::Mul) {
+          Imm = static_cast<int64_t>(static_cast<uint64_t>(Def->GetIn(1).Imm()) * static_cast<uint64_t>(RHS.Imm()));
+        } else {
+          Imm = BinaryInst::Evaluate(Op, Def->GetIn(1).Imm(), RHS.Imm());
+        }
+        LHS = Def->GetIn(0);
+        RHS = Operand::CreateImmediate(Imm);
+      }
+    }
+
+    Instruction* New = nullptr;
+    if(Op != Bin->GetOperation() || LHS != Bin->GetIn(0) || RHS != Bin->GetIn(1)) {
+      New = new BinaryInst(Op, Dst, LHS, RHS);
+    }
+
+    auto Simplified = MatchRule(New ? *static_cast<BinaryInst*>(New) : *Bin);
+    if(Simplified.has_value()) {
+      delete New;
+      New = new AssignInst(Dst, Simplified.value());
+    }
+
+    Invalidate(Dst.RegId());
+    if(New != nullptr) {
+      BB->Replace(New, Bin);
+      delete Bin;
       Changed = true;
     }
+
+    if(New != nullptr && New->Type() != Instruction::Binary) {
+      continue;
+    }
+    auto *Result = static_cast<BinaryInst*>(New ? New : Bin);
+    auto ResultLHS = Result->GetIn(0);
+    if(IsAssociative(Op) && Result->GetIn(1).IsImmediate() && !(ResultLHS.IsRegister() && ResultLHS.RegId() == Dst.RegId())) {
+      ConstDefs[Dst.RegId()] = Result;
+    }
   }
   return Changed;
 }
 
-bool GlobalCSE(Function* F) {
+bool InstCombine(Function* F) {
   bool Changed = false;
-  auto [In, Out] = DataflowAnalysis<GCSEState>(F);
-
   for(auto *BB : (*F)) {
-    Changed |= GlobalCSEBlock(BB, In[BB]);
+    Changed |= InstCombineBlock(BB);
   }
   return Changed;
 }
@@ -380,9 +691,12 @@ static bool RemoveDeadBlocks(Function* F) {
     Changed |= RewriteConstantJump(BB);
   }
   
+  // unreachable blocks, including dead cycles
+  auto Reachable = F->PostOrder();
+  std::set<BasicBlock*> ReachableSet(Reachable.begin(), Reachable.end());
   std::vector<BasicBlock*> DeadBlocks;
   for(auto *BB : (*F)) {
-    if(BB->Predecessors().size() == 0 && F->Entry() != BB) {
+    if(ReachableSet.count(BB) == 0) {
       DeadBlocks.push_back(BB);
     }
   }
@@ -444,11 +758,22 @@ void LivenessState::Transfer(const Instruction& Inst) {
   }
 }
 
+void ReachingDefsState::Meet(const ReachingDefsState& Other) {
+  for(auto &[Reg, Defs] : Other.Defs_) {
+    Defs_[Reg].insert(Defs.begin(), Defs.end());
+  }
+}
+
+void ReachingDefsState::Transfer(const Instruction& Inst) {
+  for(size_t i = 0; i < Inst.Outs(); i++) {
+    Defs_[Inst.GetOut(i).RegId()] = { &Inst };
+  }
+}
+
 static bool DeadVariableEliminationBlock(BasicBlock* BB, const LivenessState& StateIn, const LivenessState& StateOut) {
   bool Changed = false;
 
   std::map<size_t, Instruction*> LastDefs;
-  std::map<Instruction*, std::vector<Instruction*>> DefsToUses;
   std::map<Instruction*, std::vector<Instruction*>> UsesToDefs;
 
   for(auto InstIt = BB->begin(); InstIt != BB->end(); InstIt++) {
@@ -459,7 +784,6 @@ static bool DeadVariableEliminationBlock(BasicBlock* BB, const LivenessState& St
         auto Op = Inst.GetIn(i);
         if(Op.IsRegister()) {
           if(LastDefs.count(Op.RegId()) != 0) {
-            DefsToUses[LastDefs[Op.RegId()]].push_back(&Inst);
             UsesToDefs[&Inst].push_back(LastDefs[Op.RegId()]);
           } else {
             assert(StateIn.Contains(Op.RegId()) && "Use of undefined dead register");
@@ -480,11 +804,21 @@ static bool DeadVariableEliminationBlock(BasicBlock* BB, const LivenessState& St
   // collect needed instructions
   std::set<Instruction*> Needed;
 
-  // recursive function to add all needed defs and their uses
-  std::function<void(Instruction*)> AddAllToNeeded = [&](Instruction* Inst) {
-    Needed.insert(Inst);
-    for(auto *NeededDefs : UsesToDefs[Inst]) {
-      AddAllToNeeded(NeededDefs);
+  // add a def and, transitively, the defs it uses
+  std::vector<Instruction*> WorkList;
+  auto AddAllToNeeded = [&](Instruction* Inst) {
+    if(Inst == nullptr || !Needed.insert(Inst).second) {
+      return;
+    }
+    WorkList.push_back(Inst);
+    while(!WorkList.empty()) {
+      auto *Current = WorkList.back();
+      WorkList.pop_back();
+      for(auto *NeededDef : UsesToDefs[Current]) {
+        if(Needed.insert(NeededDef).second) {
+          WorkList.push_back(NeededDef);
+        }
+      }
     }
   };
 
@@ -514,9 +848,10 @@ static bool DeadVariableEliminationBlock(BasicBlock* BB, const LivenessState& St
   // Add other needed operands
   for(auto InstIt = BB->begin(); InstIt != BB->end(); InstIt++) {
     auto &Inst = *InstIt;
-    if(Inst.Type() == Instruction::Call 
+    if((Inst.Type() == Instruction::Call 
     || Inst.Type() == Instruction::CallVoid 
-    || Inst.Type() == Instruction::ArrayStore) {
+    || Inst.Type() == Instruction::TailCall
+    || Inst.Type() == Instruction::ArrayStore) && Inst.HasSideEffects()) {
       for(size_t i = 0; i < Inst.Ins(); i++) {
         auto Op = Inst.GetIn(i);
         if(Op.IsRegister()) {
@@ -549,24 +884,338 @@ static bool DeadVariableElimination(Function* F) {
   return Changed;
 }
 
+// Aggressive DCE: everything is dead unless it is reachable, through data or
+// control dependences, from an instruction with side effects. Branches that
+// nothing live depends on are redirected to their immediate post-dominator,
+// which disconnects whole dead regions (e.g. loops with unused results).
+static bool AggressiveDeadCodeElimination(Function* F) {
+  PostDominatorTree PDT(F);
+  auto Reachable = F->PostOrder();
+  auto [In, Out] = DataflowAnalysis<ReachingDefsState>(F);
+
+  // definitions reaching the register operands of each instruction
+  std::unordered_map<const Instruction*, std::vector<const Instruction*>> UseDefs;
+  std::unordered_map<BasicBlock*, std::vector<BasicBlock*>> ControlDeps;
+
+  std::set<Instruction*> Live;
+  std::vector<Instruction*> WorkList;
+  auto MarkLive = [&](Instruction* Inst) {
+    if(Live.insert(Inst).second) {
+      WorkList.push_back(Inst);
+    }
+  };
+
+  for(auto *BB : Reachable) {
+    auto State = In[BB];
+    for(auto InstIt = BB->begin(); InstIt != BB->end(); InstIt++) {
+      auto &Inst = *InstIt;
+      for(size_t i = 0; i < Inst.Ins(); i++) {
+        auto Op = Inst.GetIn(i);
+        if(Op.IsRegister()) {
+          auto &Defs = State.Defs_[Op.RegId()];
+          UseDefs[&Inst].insert(UseDefs[&Inst].end(), Defs.begin(), Defs.end());
+        }
+      }
+      State.Transfer(Inst);
+      if(Inst.HasSideEffects() && Inst.Type() != Instruction::Jmp && Inst.Type() != Instruction::Jnz) {
+        MarkLive(&Inst);
+      }
+    }
+
+    // blocks on the post-dominator tree path from a successor up to (but
+    // excluding) our immediate post-dominator are control dependent on BB
+    auto *Term = BB->Tail();
+    bool Analyzable = PDT.Contains(BB) && PDT.IDom(BB) != nullptr;
+    for(auto *Succ : BB->Successors()) {
+      Analyzable &= PDT.Contains(Succ);
+    }
+    if(!Analyzable) {
+      // branches into regions that never exit, or towards different exits
+      if(Term->Type() == Instruction::Jnz) {
+        MarkLive(Term);
+      }
+      continue;
+    }
+    for(auto *Succ : BB->Successors()) {
+      for(auto *Runner = Succ; Runner != nullptr && Runner != PDT.IDom(BB); Runner = PDT.IDom(Runner)) {
+        ControlDeps[Runner].push_back(BB);
+      }
+    }
+  }
+
+  std::set<BasicBlock*> LiveBlocks;
+  while(!WorkList.empty()) {
+    auto *Inst = WorkList.back();
+    WorkList.pop_back();
+
+    for(auto *Def : UseDefs[Inst]) {
+      MarkLive(const_cast<Instruction*>(Def));
+    }
+
+    auto *BB = Inst->Parent();
+    if(LiveBlocks.insert(BB).second) {
+      for(auto *Dep : ControlDeps[BB]) {
+        if(Dep->Tail()->Type() == Instruction::Jnz) {
+          MarkLive(Dep->Tail());
+        }
+      }
+    }
+  }
+
+  bool Changed = false;
+  for(auto *BB : Reachable) {
+    for(auto InstIt = BB->begin(); InstIt != BB->end(); InstIt++) {
+      auto *Inst = &*InstIt;
+      if(Live.count(Inst) != 0 || Inst->Type() == Instruction::Jmp) {
+        continue;
+      }
+
+      if(Inst->Type() == Instruction::Jnz) {
+        BB->Replace(new JmpInst(PDT.IDom(BB)), Inst);
+      } else {
+        assert(!Inst->IsTerminator() && "Live terminator was not marked");
+        BB->Remove(Inst);
+      }
+      delete Inst;
+      Changed = true;
+    }
+  }
+  return Changed;
+}
+#pragma endregion
+
+#pragma region SimplifyCFG
+static bool IsJumpOnly(BasicBlock* BB) {
+  return BB->Size() == 1 && BB->Head()->Type() == Instruction::Jmp;
+}
+
+// follow a chain of jump-only blocks, stopping at empty infinite loops
+static BasicBlock* ThreadTarget(BasicBlock* BB) {
+  std::set<BasicBlock*> Visited;
+  while(IsJumpOnly(BB) && Visited.insert(BB).second) {
+    BB = BB->Head()->Successor(0);
+  }
+  return BB;
+}
+
+static bool ThreadJumps(Function* F) {
+  bool Changed = false;
+  for(auto *BB : (*F)) {
+    auto *Term = BB->Tail();
+    if(Term->Type() == Instruction::Jmp) {
+      auto *Target = ThreadTarget(Term->Successor(0));
+      if(Target != Term->Successor(0)) {
+        BB->Replace(new JmpInst(Target), Term);
+        delete Term;
+        Changed = true;
+      }
+    } else if(Term->Type() == Instruction::Jnz) {
+      auto *True = ThreadTarget(Term->Successor(0));
+      auto *False = ThreadTarget(Term->Successor(1));
+      if(True == False) {
+        BB->Replace(new JmpInst(True), Term);
+      } else if(True != Term->Successor(0) || False != Term->Successor(1)) {
+        BB->Replace(new JnzInst(Term->GetIn(0), True, False), Term);
+      } else {
+        continue;
+      }
+      delete Term;
+      Changed = true;
+    }
+  }
+  return Changed;
+}
+
+// merge "A: ...; jmp B" with B when A is B's only predecessor
+static bool MergeBlocks(Function* F) {
+  bool Changed = false;
+
+  std::unordered_map<BasicBlock*, size_t> NumPreds;
+  for(auto *BB : (*F)) {
+    for(auto *Succ : BB->Successors()) {
+      NumPreds[Succ]++;
+    }
+  }
+
+  std::set<BasicBlock*> Merged;
+  for(auto *BB : (*F)) {
+    if(Merged.count(BB) != 0) {
+      continue;
+    }
+    while(BB->Tail()->Type() == Instruction::Jmp) {
+      auto *Succ = BB->Tail()->Successor(0);
+      if(Succ == BB || Succ == F->Entry() || NumPreds[Succ] != 1) {
+        break;
+      }
+
+      auto *Jmp = BB->Remove(BB->Tail());
+      delete Jmp;
+      while(Succ->Head() != nullptr) {
+        BB->AddInstruction(Succ->Remove(Succ->Head()));
+      }
+      Merged.insert(Succ);
+      Changed = true;
+    }
+  }
+
+  for(auto *BB : Merged) {
+    F->Remove(BB);
+    delete BB;
+  }
+  return Changed;
+}
+
+bool SimplifyCFG(Function* F) {
+  bool Changed = false;
+  Changed |= ThreadJumps(F);
+  Changed |= RemoveDeadBlocks(F);
+  Changed |= MergeBlocks(F);
+  return Changed;
+}
+#pragma endregion
+
+#pragma region DeadCodeElimination
 bool DeadCodeElimination(Function* F) {
   bool Changed = false;
   
   Changed |= DeadVariableElimination(F);
+  Changed |= AggressiveDeadCodeElimination(F);
   Changed |= RemoveDummyInstruction(F);
   Changed |= RemoveDeadBlocks(F);
+  Changed |= SimplifyCFG(F);
   return Changed; 
 }
 #pragma endregion
 
+#pragma region TailCallElimination
+// Returns the call in tail position of BB, i.e. a call immediately followed
+// by a return of its result (or a void call followed by a void return)
+static Instruction* FindTailCall(BasicBlock* BB) {
+  auto It = BB->rbegin();
+  auto &Term = *It;
+  if(++It == BB->rend()) {
+    return nullptr;
+  }
+  auto &Inst = *It;
+
+  if(Term.Type() == Instruction::Ret && Inst.Type() == Instruction::Call) {
+    auto RetVal = Term.GetIn(0);
+    if(RetVal.IsRegister() && RetVal == Inst.GetOut(0)) {
+      return &Inst;
+    }
+  } else if(Term.Type() == Instruction::RetVoid && Inst.Type() == Instruction::CallVoid) {
+    return &Inst;
+  }
+  return nullptr;
+}
+
+static const char* CalleeOf(const Instruction* Inst) {
+  if(Inst->Type() == Instruction::Call) {
+    return static_cast<const CallInst*>(Inst)->Callee();
+  }
+  return static_cast<const CallVoidInst*>(Inst)->Callee();
+}
+
+// Moves the parameters into registers and prepends a new entry block that
+// initializes them, so the old entry can be used as a loop header
+static BasicBlock* CreateLoopHeader(Function* F, std::vector<Operand>& ParamRegs) {
+  auto *Header = F->Entry();
+  for(size_t i = 0; i < F->NumParams(); i++) {
+    ParamRegs.push_back(Operand::CreateRegister(F->NewReg()));
+  }
+
+  for(auto *BB : (*F)) {
+    for(auto InstIt = BB->begin(); InstIt != BB->end(); InstIt++) {
+      for(size_t i = 0; i < InstIt->Ins(); i++) {
+        auto Op = InstIt->GetIn(i);
+        if(Op.IsParameter()) {
+          InstIt->ReplaceIn(i, ParamRegs[Op.Param()]);
+        }
+      }
+    }
+  }
+
+  auto *Entry = new BasicBlock();
+  for(size_t i = 0; i < F->NumParams(); i++) {
+    Entry->AddInstruction(new AssignInst(ParamRegs[i], Operand::CreateParameter(i)));
+  }
+  Entry->AddInstruction(new JmpInst(Header));
+  F->InsertBasicBlock(Entry, 0);
+  return Header;
+}
+
+bool TailCallElimination(Function* F) {
+  bool Changed = false;
+  std::vector<Instruction*> SelfCalls;
+
+  for(auto *BB : (*F)) {
+    auto *Call = FindTailCall(BB);
+    if(Call == nullptr) {
+      continue;
+    }
+
+    if(F->Name() == CalleeOf(Call)) {
+      SelfCalls.push_back(Call);
+      continue;
+    }
+
+    // the callee's arguments are written over our own, so they have to fit
+    if(Call->Ins() > F->NumParams()) {
+      continue;
+    }
+
+    std::vector<Operand> Args;
+    for(size_t i = 0; i < Call->Ins(); i++) {
+      Args.push_back(Call->GetIn(i));
+    }
+    auto *Ret = BB->Tail();
+    BB->Remove(Ret);
+    delete Ret;
+    BB->Replace(new TailCallInst(CalleeOf(Call), Args), Call);
+    delete Call;
+    Changed = true;
+  }
+
+  if(SelfCalls.empty()) {
+    return Changed;
+  }
+
+  // self-recursion: assign the new arguments and jump back to the entry
+  std::vector<Operand> ParamRegs;
+  auto *Header = CreateLoopHeader(F, ParamRegs);
+  for(auto *Call : SelfCalls) {
+    auto *BB = Call->Parent();
+
+    // arguments may refer to the parameters being assigned
+    std::vector<Operand> Temps;
+    for(size_t i = 0; i < Call->Ins(); i++) {
+      auto Temp = Operand::CreateRegister(F->NewReg());
+      BB->InsertBefore(new AssignInst(Temp, Call->GetIn(i)), Call);
+      Temps.push_back(Temp);
+    }
+    for(size_t i = 0; i < Temps.size(); i++) {
+      BB->InsertBefore(new AssignInst(ParamRegs[i], Temps[i]), Call);
+    }
+
+    auto *Ret = BB->Tail();
+    BB->Remove(Ret);
+    delete Ret;
+    BB->Replace(new JmpInst(Header), Call);
+    delete Call;
+  }
+  return true;
+}
+#pragma endregion
+
 void OptimizeIR(Function* F) {
   bool Changed;
   do {
     Changed = false;
+    Changed |= TailCallElimination(F);
     Changed |= ConstantPropagate(F);
     Changed |= CopyPropagate(F);
-    Changed |= LocalCSE(F);
-    Changed |= GlobalCSE(F);
+    Changed |= GlobalValueNumbering(F);
+    Changed |= InstCombine(F);
     Changed |= DeadCodeElimination(F);
   } while(Changed);
   return;
@@ -1,12 +1,17 @@
 #include <IR/IR.h>
 #include <IR/Optimize.h>
+#include <IR/Interpreter.h>
 
 #include <Codegen/Codegen.h>
+#include <Codegen/MachineModel.h>
+#include <Codegen/Tiered.h>
 
 #include <Semantic/Scanner.h>
 #include "Parser.h"
 #include <Semantic/IRGen.h>
 
+#include <Runtime.h>
+
 #include <iostream>
 #include <fstream>
 
@@ -30,7 +35,106 @@ ASTModule* ParseSource(const char* FileName) {
   return GetModule();
 }
 
-int Compile(const char* FileName, const char* OutputName = "out.S") {
+enum class ExecutionMode {
+  Save,         // write the program to the output file
+  JIT,          // compile the program and run it in-process
+  Interpret,    // interpret the unoptimized IR
+  Tiered,       // interpret, compiling hot functions
+};
+
+// runs the unoptimized IR, as a reference for the optimizer and the backend;
+// with Tiers set hot functions are compiled on the fly instead
+int Interpret(Module* M, ModuleGenCtx& MCtx, TieredCompiler* Tiers) {
+  Interpreter Interp;
+  if(Tiers != nullptr) {
+    Tiers->Attach(Interp);
+  }
+  for(auto *F : (*M)) {
+    Interp.AddFunction(F);
+  }
+  for(auto &KV : MCtx.StringLiterals) {
+    Interp.AddStringLiteral(KV.second, KV.first);
+  }
+
+  auto Pointer = [](int64_t Value) { return reinterpret_cast<void*>(Value); };
+  Interp.AddNativeFunction("printi", [](std::vector<int64_t>& Args) {
+    do_printi(Args[0]);
+    return 0;
+  });
+  Interp.AddNativeFunction("prints", [Pointer](std::vector<int64_t>& Args) {
+    do_prints(Pointer(Args[0]));
+    return 0;
+  });
+  Interp.AddNativeFunction("inputi", [](std::vector<int64_t>&) {
+    return do_inputi();
+  });
+  Interp.AddNativeFunction("inputs", [](std::vector<int64_t>&) {
+    return reinterpret_cast<int64_t>(do_inputs());
+  });
+  Interp.AddNativeFunction("random", [](std::vector<int64_t>&) {
+    return do_random();
+  });
+  Interp.AddNativeFunction("array_new", [](std::vector<int64_t>& Args) {
+    return reinterpret_cast<int64_t>(do_array_new(Args[0]));
+  });
+  Interp.AddNativeFunction("array_load", [Pointer](std::vector<int64_t>& Args) {
+    return do_array_load(Pointer(Args[0]), Args[1]);
+  });
+  Interp.AddNativeFunction("array_store", [Pointer](std::vector<int64_t>& Args) {
+    do_array_store(Pointer(Args[0]), Args[1], Args[2]);
+    return 0;
+  });
+  Interp.AddNativeFunction("region_mark", [](std::vector<int64_t>&) {
+    return do_region_mark();
+  });
+  Interp.AddNativeFunction("region_reset", [](std::vector<int64_t>& Args) {
+    do_region_reset(Args[0]);
+    return 0;
+  });
+  Interp.AddNativeFunction("region_end", [](std::vector<int64_t>&) {
+    do_region_end();
+    return 0;
+  });
+  Interp.AddNativeFunction("strlen", [Pointer](std::vector<int64_t>& Args) {
+    return do_strlen(Pointer(Args[0]));
+  });
+  Interp.AddNativeFunction("strcmp", [Pointer](std::vector<int64_t>& Args) {
+    return do_strcmp(Pointer(Args[0]), Pointer(Args[1]));
+  });
+  Interp.AddNativeFunction("strfind", [Pointer](std::vector<int64_t>& Args) {
+    return do_strfind(Pointer(Args[0]), Pointer(Args[1]));
+  });
+  Interp.AddNativeFunction("substr", [Pointer](std::vector<int64_t>& Args) {
+    return reinterpret_cast<int64_t>(do_substr(Pointer(Args[0]), Args[1], Args[2]));
+  });
+  Interp.AddNativeFunction("concat", [Pointer](std::vector<int64_t>& Args) {
+    return reinterpret_cast<int64_t>(do_concat(Pointer(Args[0]), Pointer(Args[1])));
+  });
+  Interp.AddNativeFunction("charat", [Pointer](std::vector<int64_t>& Args) {
+    return do_charat(Pointer(Args[0]), Args[1]);
+  });
+
+  // the interpreter's frames are off the machine stack the collector scans
+  do_gc_set_roots([](void* Context) {
+    static_cast<Interpreter*>(Context)->MarkRoots(do_gc_mark_range);
+  }, &Interp);
+
+  InitRuntime();
+  int Result;
+  try {
+    std::vector<int64_t> Args;
+    Result = static_cast<int>(Interp.RunFunction("main", Args));
+  } catch(const std::runtime_error& E) {
+    do_flush();
+    std::cerr << "Error: " << E.what() << std::endl;
+    Result = 1;
+  }
+  do_gc_set_roots(nullptr, nullptr);
+  return Result;
+}
+
+// OutputName is only used by ExecutionMode::Save, the other modes run the program
+int Compile(const char* FileName, const char* OutputName, CPUFamily CPU, OutputFormat Format, ExecutionMode Mode, bool StringRegions, bool NativeCalls) {
   auto *Module = ParseSource(FileName);
   if(!Module) {
     return 1;
@@ -43,20 +147,32 @@ int Compile(const char* FileName, const char* OutputName = "out.S") {
   Module->AddExternalFunction("inputs", std::make_pair(TY_STRING, std::vector<ASTType>{}));
   Module->AddExternalFunction("random", std::make_pair(TY_INTEGER, std::vector<ASTType>{}));
   Module->AddExternalFunction("array_new", std::make_pair(TY_ARRAY, std::vector<ASTType>{TY_INTEGER}));
+  Module->AddExternalFunction("strlen", std::make_pair(TY_INTEGER, std::vector<ASTType>{TY_STRING}));
+  Module->AddExternalFunction("strcmp", std::make_pair(TY_INTEGER, std::vector<ASTType>{TY_STRING, TY_STRING}));
+  Module->AddExternalFunction("strfind", std::make_pair(TY_INTEGER, std::vector<ASTType>{TY_STRING, TY_STRING}));
+  Module->AddExternalFunction("substr", std::make_pair(TY_STRING, std::vector<ASTType>{TY_STRING, TY_INTEGER, TY_INTEGER}));
+  Module->AddExternalFunction("concat", std::make_pair(TY_STRING, std::vector<ASTType>{TY_STRING, TY_STRING}));
+  Module->AddExternalFunction("charat", std::make_pair(TY_INTEGER, std::vector<ASTType>{TY_STRING, TY_INTEGER}));
 
-  IRGen Gen(Module);
+  IRGen Gen(Module, StringRegions);
   if(!Gen.Verify()) {
     return 1;
   }
 
   auto [MCtx, M] = Gen.Generate();
+  if(Mode == ExecutionMode::Interpret) {
+    return Interpret(M, MCtx, nullptr);
+  } else if(Mode == ExecutionMode::Tiered) {
+    TieredCompiler Tiers(M, &MCtx, &MachineModel::Get(CPU));
+    return Interpret(M, MCtx, &Tiers);
+  }
   for(auto *F : (*M)) {
     OptimizeIR(F);
   }
 
-  ModuleCodegen Codegen(M, &MCtx);
-  if(!Codegen.Generate()) {
-    return 1;
+  ModuleCodegen Codegen(M, &MCtx, &MachineModel::Get(CPU), Format, NativeCalls);
+  if(Mode == ExecutionMode::JIT) {
+    return Codegen.Execute();
   }
   if(!Codegen.Save(OutputName)) {
     return 1;
@@ -67,13 +183,50 @@ int Compile(const char* FileName, const char* OutputName = "out.S") {
 } // namespace klang
 
 int main(int argc, const char **argv) {
-  if(argc < 2) {
-    std::cerr << "Usage: " << argv[0] << " <source file> [output file]" << std::endl;
-    return 1;
+  std::vector<const char*> Files;
+  CPUFamily CPU = CPUFamily::Skylake;
+  OutputFormat Format = OutputFormat::Assembly;
+  ExecutionMode Mode = ExecutionMode::Save;
+  bool StringRegions = false;
+  bool NativeCalls = true;
+  for(int i = 1; i < argc; i++) {
+    std::string Arg = argv[i];
+    if(Arg.rfind("--mcpu=", 0) == 0) {
+      auto Parsed = MachineModel::Parse(Arg.substr(7));
+      if(!Parsed.has_value()) {
+        std::cerr << "Error: unknown cpu " << Arg.substr(7) << " (expected skylake or zen)" << std::endl;
+        return 1;
+      }
+      CPU = Parsed.value();
+    } else if(Arg == "--emit=asm") {
+      Format = OutputFormat::Assembly;
+    } else if(Arg == "--emit=obj") {
+      Format = OutputFormat::Object;
+    } else if(Arg == "--jit") {
+      Mode = ExecutionMode::JIT;
+    } else if(Arg == "--interp") {
+      Mode = ExecutionMode::Interpret;
+    } else if(Arg == "--tiered") {
+      Mode = ExecutionMode::Tiered;
+    } else if(Arg == "--string-regions") {
+      StringRegions = true;
+    } else if(Arg == "--runtime-wrappers") {
+      NativeCalls = false;
+    } else {
+      Files.push_back(argv[i]);
+    }
   }
 
-  if(argc == 2) {
-    return klang::Compile(argv[1]);
+  if(Files.size() < 1 || Files.size() > (Mode == ExecutionMode::Save ? 2 : 1)) {
+    std::cerr << "Usage: " << argv[0] << " [--mcpu=skylake|zen] [--emit=asm|obj] <source file> [output file]" << std::endl;
+    std::cerr << "       " << argv[0] << " [--mcpu=skylake|zen] --jit <source file>" << std::endl;
+    std::cerr << "       " << argv[0] << " --interp <source file>" << std::endl;
+    std::cerr << "       " << argv[0] << " [--mcpu=skylake|zen] --tiered <source file>" << std::endl;
+    std::cerr << "Options: --string-regions    strings read in a loop iteration are freed when the next one starts" << std::endl;
+    std::cerr << "         --runtime-wrappers  call the runtime through the K_ wrappers of runtime/wrapper.S" << std::endl;
+    return 1;
   }
-  return klang::Compile(argv[1], argv[2]);
-}
\ No newline at end of file
+
+  const char* DefaultOutput = Format == OutputFormat::Object ? "out.o" : "out.S";
+  return klang::Compile(Files[0], Files.size() == 2 ? Files[1] : DefaultOutput, CPU, Format, Mode, StringRegions, NativeCalls);
+}
@@ -1,6 +1,8 @@
 #include <Semantic/IRGen.h>
 #include <Logging.h>
 
+#include <functional>
+
 namespace klang {
 
 static std::optional<ASTType> VerifyExpression(ASTExpression* E);
@@ -304,6 +306,12 @@ bool IRGen::Verify() {
       HasEntry = true;
     }
 
+    // calls to these would go to the runtime
+    if(FindIntrinsic(F->GetName()) != nullptr) {
+      ERROR("Function name %s is reserved by the runtime\n", F->GetName());
+      return false;
+    }
+
     if(FunctionNames.count(F->GetName()) == 0) {
       FunctionNames.insert(F->GetName());
     } else {
@@ -348,6 +356,13 @@ BasicBlock* IRGen::GenerateBlock(FuncGenCtx& Ctx, const std::vector<ASTStatement
   return B;
 }
 
+// klang functions may return a string from inputs; array_new is generated
+// as ArrayNew and does not get here
+static bool MayReturnNewString(const std::string& Callee) {
+  auto *Intrinsic = FindIntrinsic(Callee);
+  return Intrinsic == nullptr || Intrinsic->Is(kIntrinsicAllocates);
+}
+
 static bool BlockEndsWithReturn(const std::vector<ASTStatement*>& Statements) {
   if(Statements.size() == 0) {
     return false;
@@ -391,6 +406,13 @@ Operand IRGen::GenerateExpression(FuncGenCtx& Ctx, ASTExpression* E, bool CallVo
         Args.push_back(GenerateExpression(Ctx, Arg));
       }
 
+      if(FCE->GetName() == "array_new") {
+        __ ArrayNew(RetVal, Args[0]);
+        return RetVal;
+      }
+      if(MayReturnNewString(FCE->GetName())) {
+        Ctx.StringCalls++;
+      }
       if(CallVoid) {
         __ CallVoid(FCE->GetName().c_str(), Args);
       } else {
@@ -530,6 +552,9 @@ void IRGen::GenerateStatement(FuncGenCtx& Ctx, ASTStatement* S) {
       } else {
         __ RetVoid();
       }
+      if(Ctx.InLoop) {
+        Ctx.LoopReturns.push_back(__ Current()->Tail());
+      }
       break;
     }
     case ASTStatement::ST_WHILE: {
@@ -537,14 +562,43 @@ void IRGen::GenerateStatement(FuncGenCtx& Ctx, ASTStatement* S) {
       auto *Current = __ Current();
       auto *NextB = __ CreateBlock();
 
+      size_t StringCalls = Ctx.StringCalls;
+      Ctx.InLoop = true;
+      Ctx.LoopReturns.clear();
       auto *LoopB = GenerateBlock(Ctx, WS->GetStatements());
       auto Cond = GenerateExpression(Ctx, WS->GetCondition());
-      __ Jnz(Cond, LoopB, NextB);
+      Ctx.InLoop = false;
 
-      __ SetInsertionPoint(Current);
-      __ Jmp(LoopB);
+      bool Bracketed = StringRegions_ && Ctx.StringCalls != StringCalls;
+      if(!Bracketed) {
+        __ Jnz(Cond, LoopB, NextB);
+
+        __ SetInsertionPoint(Current);
+        __ Jmp(LoopB);
+      } else {
+        // every iteration starts by dropping the strings of the previous one
+        auto *HeadB = __ CreateBlock();
+        auto Mark = __ NewReg();
+        __ Jnz(Cond, HeadB, NextB);
+
+        __ SetInsertionPoint(HeadB);
+        __ CallVoid("region_reset", { Mark });
+        __ Jmp(LoopB);
+
+        __ SetInsertionPoint(Current);
+        __ Call("region_mark", Mark, {});
+        __ Jmp(HeadB);
+
+        // returning from inside the loop leaves it as well
+        for(auto *Ret : Ctx.LoopReturns) {
+          Ret->Parent()->InsertBefore(new CallVoidInst("region_end", {}), Ret);
+        }
+      }
 
       __ SetInsertionPoint(NextB);
+      if(Bracketed) {
+        __ CallVoid("region_end", {});
+      }
       break;
     }
     case ASTStatement::ST_CALL: {
@@ -44,14 +44,14 @@ def compile(code):
     f.write(code.encode())
   os.close(fd)
 
-  assembly = os.path.join(WORKDIR, randstr(12) + ".S")
-  proc = subprocess.Popen([KLANG, klang_src, assembly])
+  obj = os.path.join(WORKDIR, randstr(12) + ".o")
+  proc = subprocess.Popen([KLANG, "--emit=obj", klang_src, obj])
   retcode = proc.wait()
   if retcode != 0:
     return None 
   
   exe = os.path.join(WORKDIR, randstr(12) + ".exe")
-  gcc_args = ["gcc", "-no-pie", "-o", exe, assembly] + RUNTIME_SRC
+  gcc_args = ["gcc", "-O2", "-no-pie", "-o", exe, obj] + RUNTIME_SRC
   proc = subprocess.Popen(gcc_args)
   retcode = proc.wait()
   if retcode != 0:
@@ -0,0 +1,58 @@
+#ifndef _ASMWRITER_H
+#define _ASMWRITER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+namespace klang {
+
+// Buffered text output for the assembly emitter. Everything goes through one
+// fixed buffer that is handed to the file whenever it fills up, integers are
+// formatted by hand instead of through iostream/locale machinery.
+class AsmWriter {
+public:
+  static constexpr size_t kBufferSize = 1 << 16;
+
+  AsmWriter(FILE* File) : File_(File), Size_(0), Failed_(false) {}
+  ~AsmWriter() { Flush(); }
+
+  AsmWriter(const AsmWriter&) = delete;
+  AsmWriter& operator=(const AsmWriter&) = delete;
+
+  AsmWriter& operator<<(const char* Str) { Write(Str, strlen(Str)); return *this; }
+  AsmWriter& operator<<(const std::string& Str) { Write(Str.data(), Str.size()); return *this; }
+  AsmWriter& operator<<(char C) { Write(&C, 1); return *this; }
+
+  template<typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+  AsmWriter& operator<<(T Value) {
+    if constexpr(std::is_signed_v<T>) {
+      WriteDecimal(static_cast<int64_t>(Value));
+    } else {
+      WriteUnsigned(static_cast<uint64_t>(Value));
+    }
+    return *this;
+  }
+
+  // 0x-prefixed, negative values are printed as their two's complement
+  AsmWriter& Hex(uint64_t Value);
+
+  void Write(const char* Data, size_t Len);
+  // returns false if any write to the file failed
+  bool Flush();
+
+private:
+  void WriteDecimal(int64_t Value);
+  void WriteUnsigned(uint64_t Value);
+
+  FILE* File_;
+  size_t Size_;
+  bool Failed_;
+  char Buffer_[kBufferSize];
+};
+
+} // namespace klang
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef _BLOCKLAYOUT_H
+#define _BLOCKLAYOUT_H
+
+#include <Codegen/Codegen.h>
+
+#include <unordered_map>
+#include <vector>
+
+namespace klang {
+
+// Pettis-Hansen style block placement: blocks are greedily chained along
+// the heaviest edges (estimated from loop depth), so that the hot path
+// falls through instead of taking a jump.
+class BlockPlacement {
+public:
+  BlockPlacement(MachineFunction* Function) : Function_(Function) {}
+
+  void Place();
+
+private:
+  struct Edge {
+    MachineBasicBlock* From_;
+    MachineBasicBlock* To_;
+    double Weight_;
+  };
+
+  void ComputeLoopDepth();
+  std::vector<Edge> ComputeEdges() const;
+  double Frequency(MachineBasicBlock* Block) const;
+
+  MachineFunction* Function_;
+  std::unordered_map<MachineBasicBlock*, size_t> LoopDepth_;
+};
+
+} // namespace klang
+
+#endif
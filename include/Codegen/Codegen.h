@@ -3,25 +3,31 @@
 
 #include <IR/IR.h>
 #include <Semantic/IRGen.h>
+#include <Codegen/AsmWriter.h>
 
-#include <sstream>
+extern const char* kFunctionPrefix;
+// the C functions of runtime/api.c behind the builtins
+extern const char* kRuntimePrefix;
 
 namespace klang {
 
 class MachineFunction;
 class MachineBasicBlock;
+class MachineModel;
 class MachineInstruction;
 class MachineOperand;
+class ObjectBuffer;
 
 class MachineFunction {
 public:
   MachineFunction(const std::string& Name, size_t NumParams)
-    : Name_(Name), NumParams_(NumParams), Size_(0) {}
+    : Name_(Name), NumParams_(NumParams), Size_(0), CallsRuntime_(false) {}
   ~MachineFunction();
 
   void AddBasicBlock(MachineBasicBlock* BB);
+  void Reorder(const std::vector<MachineBasicBlock*>& Order);
 
-  void Emit(std::stringstream& SS) const;
+  void Emit(AsmWriter& SS) const;
 
   MachineBasicBlock* Entry() const { return BasicBlocks_.front(); }
   const char* Name() const { return Name_.c_str(); }
@@ -38,9 +44,14 @@ public:
 
   std::vector<MachineBasicBlock*> PostOrder() const;
 
+  // The function calls into C, so its frame realigns the stack to 16 bytes
+  void SetCallsRuntime() { CallsRuntime_ = true; }
+  bool CallsRuntime() const { return CallsRuntime_; }
+
 private:
   std::string Name_;
   size_t Size_, NumParams_;
+  bool CallsRuntime_;
   std::vector<MachineBasicBlock*> BasicBlocks_;
 };
 
@@ -56,7 +67,8 @@ public:
 
   void AddInstruction(MachineInstruction* Inst);
 
-  void Emit(std::stringstream& Out) const;
+  // Next is the block laid out right after this one, jumps to it are elided
+  void Emit(AsmWriter& Out, const MachineBasicBlock* Next) const;
 
   bool IsExit() const;
 
@@ -128,8 +140,12 @@ public:
     Pop, 
 
     Call, 
+    TailCall,
     Lea,
     Cqo, 
+
+    ArrayLoad,
+    ArrayStore,
   };
 
   MachineInstruction(Opcode Opcode) : Opcode_(Opcode), Next_(nullptr), Prev_(nullptr), Operands_(), Parent_(nullptr) {}
@@ -143,7 +159,7 @@ public:
   virtual bool Verify() const = 0;
   virtual bool HasSideEffects() const = 0;
   virtual bool IsTerminator() const = 0;
-  virtual void Emit(std::stringstream& Out) const = 0;
+  virtual void Emit(AsmWriter& Out) const = 0;
 
   virtual size_t NumSuccessors() const = 0;
   virtual MachineBasicBlock* GetSuccessor(size_t Idx) const = 0;
@@ -262,13 +278,16 @@ public:
   size_t GetVirtualRegister() const { assert(IsVirtualRegister() && "Invalid operand kind"); return U_.RegId_; }
   MachineRegister GetRegister() const { assert(IsRegister() && "Invalid operand kind"); return U_.Reg_; }
   int64_t GetImmediate() const { assert(IsImmediate() && "Invalid operand kind"); return U_.Imm_; }
+  MachineRegister GetMemoryBase() const { assert(IsMemory() && "Invalid operand kind"); return U_.Memory.Base_; }
+  MachineRegister GetMemoryIndex() const { assert(IsMemory() && "Invalid operand kind"); return U_.Memory.Index_; }
+  int64_t GetMemoryDisp() const { assert(IsMemory() && "Invalid operand kind"); return U_.Memory.Disp_; }
 
-  void Emit(std::stringstream& Out) const;
+  void Emit(AsmWriter& Out) const;
 
 private:
-  void EmitRegister(std::stringstream& Out, MachineRegister Reg) const;
-  void EmitImmediate(std::stringstream& Out, int64_t Imm) const;
-  void EmitMemory(std::stringstream& Out, MachineRegister Base, MachineRegister Index, int64_t Disp_) const;
+  void EmitRegister(AsmWriter& Out, MachineRegister Reg) const;
+  void EmitImmediate(AsmWriter& Out, int64_t Imm) const;
+  void EmitMemory(AsmWriter& Out, MachineRegister Base, MachineRegister Index, int64_t Disp_) const;
 
   Kind Kind_;
   union {
@@ -293,6 +312,8 @@ enum class Condition : int {
   E, NE, L, LE, G, GE
 };
 
+Condition InvertCondition(Condition Cond);
+
 class MovMachineInst : public MachineInstruction {
 public:
   MovMachineInst(const MachineOperand& Src, const MachineOperand& Dst) : MachineInstruction(Opcode::Mov) {
@@ -301,8 +322,9 @@ public:
   }
 
   virtual bool Verify() const override;
-  virtual bool HasSideEffects() const override { return false; }
-  virtual void Emit(std::stringstream& Out) const override;
+  // stores are ordered against every other instruction
+  virtual bool HasSideEffects() const override { return GetOperand(1).IsMemory(); }
+  virtual void Emit(AsmWriter& Out) const override;
 
   NO_SUCCESSORS();
   
@@ -317,7 +339,7 @@ public:
 
   virtual bool Verify() const override;
   virtual bool HasSideEffects() const override { return false; }
-  virtual void Emit(std::stringstream& Out) const override;
+  virtual void Emit(AsmWriter& Out) const override;
 
   Condition GetCondition() const { return Cond_; }
 
@@ -336,7 +358,7 @@ public:
 
   virtual bool Verify() const override;
   virtual bool HasSideEffects() const override { return false; }
-  virtual void Emit(std::stringstream& Out) const override;
+  virtual void Emit(AsmWriter& Out) const override;
 
   NO_SUCCESSORS();
 };
@@ -350,7 +372,7 @@ public:
 
   virtual bool Verify() const override;
   virtual bool HasSideEffects() const override { return false; }
-  virtual void Emit(std::stringstream& Out) const override;
+  virtual void Emit(AsmWriter& Out) const override;
 
   NO_SUCCESSORS();
 };
@@ -364,7 +386,7 @@ public:
 
   virtual bool Verify() const override;
   virtual bool HasSideEffects() const override { return true; }
-  virtual void Emit(std::stringstream& Out) const override;
+  virtual void Emit(AsmWriter& Out) const override;
 
   NO_SUCCESSORS();
 };
@@ -377,7 +399,7 @@ public:
 
   virtual bool Verify() const override;
   virtual bool HasSideEffects() const override { return true; }
-  virtual void Emit(std::stringstream& Out) const override;
+  virtual void Emit(AsmWriter& Out) const override;
 
   NO_SUCCESSORS();
 };
@@ -391,7 +413,7 @@ public:
 
   virtual bool Verify() const override;
   virtual bool HasSideEffects() const override { return false; }
-  virtual void Emit(std::stringstream& Out) const override;
+  virtual void Emit(AsmWriter& Out) const override;
 
   NO_SUCCESSORS();
 };
@@ -405,7 +427,7 @@ public:
 
   virtual bool Verify() const override;
   virtual bool HasSideEffects() const override { return false; }
-  virtual void Emit(std::stringstream& Out) const override;
+  virtual void Emit(AsmWriter& Out) const override;
 
   NO_SUCCESSORS();
 };
@@ -419,7 +441,7 @@ public:
 
   virtual bool Verify() const override;
   virtual bool HasSideEffects() const override { return false; }
-  virtual void Emit(std::stringstream& Out) const override;
+  virtual void Emit(AsmWriter& Out) const override;
 
   NO_SUCCESSORS();
 };
@@ -433,7 +455,7 @@ public:
 
   virtual bool Verify() const override;
   virtual bool HasSideEffects() const override { return false; }
-  virtual void Emit(std::stringstream& Out) const override;
+  virtual void Emit(AsmWriter& Out) const override;
 
   NO_SUCCESSORS();
 };
@@ -447,7 +469,7 @@ public:
 
   virtual bool Verify() const override { return true; }
   virtual bool HasSideEffects() const override { return false; }
-  virtual void Emit(std::stringstream& Out) const override;
+  virtual void Emit(AsmWriter& Out) const override;
 
   NO_SUCCESSORS();
 };
@@ -458,7 +480,8 @@ public:
 
   virtual bool Verify() const override { return true; }
   virtual bool HasSideEffects() const override { return true; }
-  virtual void Emit(std::stringstream& Out) const override;
+  virtual void Emit(AsmWriter& Out) const override;
+  void Emit(AsmWriter& Out, const MachineBasicBlock* Next) const;
 
   virtual bool IsTerminator() const override { return true; }
   virtual size_t NumSuccessors() const override { return 1; }
@@ -467,6 +490,8 @@ public:
     return Target_; 
   }
 
+  MachineBasicBlock* Target() const { return Target_; }
+
 private:
   MachineBasicBlock* Target_;
 };
@@ -478,7 +503,8 @@ public:
   virtual bool IsTerminator() const override { return true; }
   virtual bool Verify() const override { return true; }
   virtual bool HasSideEffects() const override { return true; }
-  virtual void Emit(std::stringstream& Out) const override;
+  virtual void Emit(AsmWriter& Out) const override;
+  void Emit(AsmWriter& Out, const MachineBasicBlock* Next) const;
 
   virtual size_t NumSuccessors() const override { return 2; }
   virtual MachineBasicBlock* GetSuccessor(size_t Idx) const override { 
@@ -486,6 +512,10 @@ public:
     return Idx == 1 ? True_ : False_;
   }
 
+  Condition GetCondition() const { return Cond_; }
+  MachineBasicBlock* TrueTarget() const { return True_; }
+  MachineBasicBlock* FalseTarget() const { return False_; }
+
 private:
   Condition Cond_;
   MachineBasicBlock* True_, *False_;
@@ -497,7 +527,7 @@ public:
 
   virtual bool Verify() const override { return true; }
   virtual bool HasSideEffects() const override { return true; }
-  virtual void Emit(std::stringstream& Out) const override;
+  virtual void Emit(AsmWriter& Out) const override;
 
   virtual bool IsTerminator() const override { return true; }
   virtual size_t NumSuccessors() const override { return 0; }
@@ -517,7 +547,7 @@ public:
     return GetOperand(0).IsMachineRegister() || GetOperand(0).IsImmediate();
   }
   virtual bool HasSideEffects() const override { return false; }
-  virtual void Emit(std::stringstream& Out) const override;
+  virtual void Emit(AsmWriter& Out) const override;
 
   NO_SUCCESSORS();
 };
@@ -532,22 +562,63 @@ public:
     return GetOperand(0).IsMachineRegister();
   }
   virtual bool HasSideEffects() const override { return false; }
-  virtual void Emit(std::stringstream& Out) const override;
+  virtual void Emit(AsmWriter& Out) const override;
 
   NO_SUCCESSORS();
 };
 
+// A klang call takes its arguments from the stack. A native call goes to the
+// runtime function kRuntimePrefix + Callee with the System V convention: the
+// operands are its arguments, moved to rdi, rsi and rdx right before the call.
 class CallMachineInst : public MachineInstruction {
 public:
-  CallMachineInst(const char* Callee) : MachineInstruction(Opcode::Call), Callee_(Callee) {}
+  CallMachineInst(const char* Callee) : MachineInstruction(Opcode::Call), Callee_(Callee), Native_(false) {}
+  CallMachineInst(const char* Callee, const std::vector<MachineOperand>& Args) 
+    : MachineInstruction(Opcode::Call), Callee_(Callee), Native_(true) {
+    for(auto &Arg : Args) {
+      AddOperand(Arg);
+    }
+  }
 
-  virtual bool Verify() const override { return true; }
+  virtual bool Verify() const override { return Native_ ? Size() <= 3 : Size() == 0; }
   virtual bool HasSideEffects() const override { return true; }
 
-  virtual void Emit(std::stringstream& Out) const override;
+  virtual void Emit(AsmWriter& Out) const override;
+
+  const char* Callee() const { return Callee_.c_str(); }
+  bool IsNative() const { return Native_; }
+  // kFunctionPrefix or kRuntimePrefix followed by the callee
+  std::string Symbol() const;
+
+  // (source, destination) pairs that load the arguments of a native call in
+  // order. rax is free and rdx is never allocated, so only rdi and rsi can
+  // overlap with the sources.
+  std::vector<std::pair<MachineOperand, MachineOperand>> ArgumentMoves() const;
 
   NO_SUCCESSORS();
 
+private:
+  std::string Callee_;
+  bool Native_;
+};
+
+class TailCallMachineInst : public MachineInstruction {
+public:
+  TailCallMachineInst(const char* Callee) : MachineInstruction(Opcode::TailCall), Callee_(Callee) {}
+
+  virtual bool Verify() const override { return true; }
+  virtual bool HasSideEffects() const override { return true; }
+  virtual void Emit(AsmWriter& Out) const override;
+
+  virtual bool IsTerminator() const override { return true; }
+  virtual size_t NumSuccessors() const override { return 0; }
+  virtual MachineBasicBlock* GetSuccessor(size_t Idx) const override { 
+    assert(false && "Invalid successor index");
+    return nullptr; 
+  }
+
+  const char* Callee() const { return Callee_.c_str(); }
+
 private:
   std::string Callee_;
 };
@@ -560,7 +631,7 @@ public:
 
   virtual bool Verify() const override { return true; }
   virtual bool HasSideEffects() const override { return false; }
-  virtual void Emit(std::stringstream& Out) const override;
+  virtual void Emit(AsmWriter& Out) const override;
 
   const char* Label() const { return Label_.c_str(); }
 
@@ -576,7 +647,44 @@ public:
 
   virtual bool Verify() const override { return true; }
   virtual bool HasSideEffects() const override { return false; }
-  virtual void Emit(std::stringstream& Out) const override;
+  virtual void Emit(AsmWriter& Out) const override;
+
+  NO_SUCCESSORS();
+};
+
+// Arrays are a size header followed by the elements, see runtime/api.c
+constexpr int64_t kArrayDataOffset = 16;
+
+// Bounds-checked element access, expanded inline when emitted. The array
+// goes to rax and the index to rdx, which are clobbered. A null array or an
+// index out of range calls do_array_load/do_array_store directly instead,
+// which reports the error and exits.
+class ArrayLoadMachineInst : public MachineInstruction {
+public:
+  ArrayLoadMachineInst(const MachineOperand& Array, const MachineOperand& Index, const MachineOperand& Dst) : MachineInstruction(Opcode::ArrayLoad) {
+    AddOperand(Array);
+    AddOperand(Index);
+    AddOperand(Dst);
+  }
+
+  virtual bool Verify() const override { return Size() == 3; }
+  virtual bool HasSideEffects() const override { return false; }
+  virtual void Emit(AsmWriter& Out) const override;
+
+  NO_SUCCESSORS();
+};
+
+class ArrayStoreMachineInst : public MachineInstruction {
+public:
+  ArrayStoreMachineInst(const MachineOperand& Array, const MachineOperand& Index, const MachineOperand& Value) : MachineInstruction(Opcode::ArrayStore) {
+    AddOperand(Array);
+    AddOperand(Index);
+    AddOperand(Value);
+  }
+
+  virtual bool Verify() const override { return Size() == 3; }
+  virtual bool HasSideEffects() const override { return true; }
+  virtual void Emit(AsmWriter& Out) const override;
 
   NO_SUCCESSORS();
 };
@@ -585,7 +693,10 @@ public:
 
 class MachineFuncBuilder {
 public:
-  MachineFuncBuilder(Function* Function) : Function_(Function), MFunction_(nullptr), CurrentBlock_(nullptr), NumRegs_(0) {
+  // NativeCalls calls the runtime directly instead of through the K_ wrappers
+  // of runtime/wrapper.S
+  MachineFuncBuilder(Function* Function, const MachineModel* Model, bool NativeCalls = true) 
+    : Function_(Function), Model_(Model), MFunction_(nullptr), CurrentBlock_(nullptr), NumRegs_(0), NativeCalls_(NativeCalls) {
     MFunction_ = new MachineFunction(Function->Name(), Function->NumParams());
     CurrentBlock_ = nullptr;
   }
@@ -606,6 +717,7 @@ private:
   void HandleLogicalBinaryInst(BinaryInst& Inst);
 
   MachineOperand ConvertOperand(const Operand& Op);
+  std::vector<MachineOperand> ConvertArguments(Instruction& Call);
   MachineOperand NewReg() {
     return MachineOperand::CreateVirtualRegister(NumRegs_++);
   }
@@ -663,9 +775,24 @@ private:
   void Ret() {
     Emit(new RetMachineInst());
   }
+  void ArrayLoad(const MachineOperand& Array, const MachineOperand& Index, const MachineOperand& Dst) {
+    MFunction_->SetCallsRuntime();
+    Emit(new ArrayLoadMachineInst(Array, Index, Dst));
+  }
+  void ArrayStore(const MachineOperand& Array, const MachineOperand& Index, const MachineOperand& Value) {
+    MFunction_->SetCallsRuntime();
+    Emit(new ArrayStoreMachineInst(Array, Index, Value));
+  }
   void Call(const char* Callee) {
     Emit(new CallMachineInst(Callee));
   }
+  void NativeCall(const char* Callee, const std::vector<MachineOperand>& Args) {
+    MFunction_->SetCallsRuntime();
+    Emit(new CallMachineInst(Callee, Args));
+  }
+  void TailCall(const char* Callee) {
+    Emit(new TailCallMachineInst(Callee));
+  }
   void Lea(const char* Label, const MachineOperand& Dst) {
     Emit(new LeaMachineInst(Label, Dst));
   }
@@ -674,27 +801,40 @@ private:
   }
 
   Function* Function_;
+  const MachineModel* Model_;
   MachineFunction* MFunction_;
   MachineBasicBlock* CurrentBlock_;
   std::unordered_map<BasicBlock*, MachineBasicBlock*> BBMap_;
   size_t NumRegs_;
   std::unordered_map<size_t, size_t> VirtRegMap_;
+  bool NativeCalls_;
+};
+
+enum class OutputFormat : int {
+  Assembly,   // Intel syntax text, assembled by gcc
+  Object,     // ELF64 relocatable object, only needs to be linked
 };
 
 class ModuleCodegen {
 public:
-  ModuleCodegen(Module* Module, ModuleGenCtx* IRGenCtx) : Module_(Module), IRGenCtx_(IRGenCtx) {}
-
-  bool Generate();
+  ModuleCodegen(Module* Module, ModuleGenCtx* IRGenCtx, const MachineModel* Model, OutputFormat Format = OutputFormat::Assembly, bool NativeCalls = true) 
+    : Module_(Module), IRGenCtx_(IRGenCtx), Model_(Model), Format_(Format), NativeCalls_(NativeCalls) {}
 
   bool Save(const char* OutputName);
+  // loads the module into memory and runs K_main, returns its exit code
+  int Execute();
 
 private:
-  void GenerateStringLiterals();
+  MachineFunction* GenerateFunction(Function* F) const;
+  void GenerateStringLiterals(AsmWriter& Out);
+  void Encode(ObjectBuffer& Object) const;
+  bool SaveObject(const char* OutputName);
 
   Module* Module_; 
   ModuleGenCtx* IRGenCtx_;
-  std::stringstream ModuleSS_;
+  const MachineModel* Model_;
+  OutputFormat Format_;
+  bool NativeCalls_;
 };
 
 } // namespace klang
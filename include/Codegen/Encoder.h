@@ -0,0 +1,58 @@
+#ifndef _ENCODER_H
+#define _ENCODER_H
+
+#include <Codegen/Codegen.h>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace klang {
+
+// A reference from the code to a symbol, patched by the linker
+struct Relocation {
+  size_t Offset_;         // position of the field in the section
+  std::string Symbol_;
+  uint32_t Type_;         // R_X86_64_*
+  int64_t Addend_;
+};
+
+// x86-64 machine code encoder for allocated MachineInstructions. Branches
+// between blocks are left to the caller, which knows the final layout.
+class X86Encoder {
+public:
+  X86Encoder(std::vector<uint8_t>& Bytes, std::vector<Relocation>& Relocations)
+    : Bytes_(Bytes), Relocations_(Relocations) {}
+
+  void Encode(const MachineInstruction* Inst);
+
+  // jmp (no condition) or jcc with a displacement relative to the end of the jump
+  void EncodeJump(std::optional<Condition> Cond, int64_t Disp, bool Short);
+  static size_t JumpSize(bool Conditional, bool Short);
+
+  // call or jump through a register, for absolute addresses
+  void EncodeIndirectCall(MachineRegister Reg);
+  void EncodeIndirectJump(MachineRegister Reg);
+
+private:
+  void EncodeArith(uint8_t OpcodeMR, uint8_t OpcodeRM, uint8_t Ext, const MachineOperand& Src, const MachineOperand& Dst);
+  void EncodeMov(const MachineOperand& Src, const MachineOperand& Dst);
+  void EncodeTest(const MachineOperand& Op1, const MachineOperand& Op2);
+  void EncodeIMul(const MachineOperand& Src, const MachineOperand& Dst);
+  void EncodeSymbol(std::vector<uint8_t> Opcode, const std::string& Symbol, uint32_t Type);
+  void EncodeArrayAccess(const MachineInstruction* Inst);
+
+  // REX prefix, opcode and ModRM (plus SIB/displacement) for a reg, r/m pair
+  void EmitRM(bool Wide, std::vector<uint8_t> Opcode, unsigned Reg, const MachineOperand& RM);
+  void EmitImmediate(int64_t Imm, size_t Size);
+  // Opcode with Reg and the element operand [rax + rdx*8 + kArrayDataOffset]
+  void EmitArrayElement(uint8_t Opcode, unsigned Reg);
+
+  std::vector<uint8_t>& Bytes_;
+  std::vector<Relocation>& Relocations_;
+};
+
+} // namespace klang
+
+#endif
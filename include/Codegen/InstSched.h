@@ -2,45 +2,69 @@
 #define _INSTSCHED_H
 
 #include <Codegen/Codegen.h>
+#include <Codegen/MachineModel.h>
+#include <Codegen/RegAlloc.h>
 
 namespace klang {
 
+// Before register allocation, instructions with side effects are barriers.
+// After it, every operand is a physical register or a frame slot, so memory
+// dependences on [rbp + n] are modeled precisely and only control flow, calls
+// and stack pointer updates remain barriers.
+enum class SchedulePhase : int {
+  PreRA,
+  PostRA,
+};
+
 class PrecedenceGraphNode {
 public:
-  PrecedenceGraphNode(MachineInstruction* Inst) : Inst_(Inst), Succs_(), Preds_() {}
+  PrecedenceGraphNode(MachineInstruction* Inst, size_t Index) 
+    : Inst_(Inst), Index_(Index), Latency_(0), Height_(0), Start_(0), NumPreds_(0), NumUnscheduledPreds_(0), Succs_() {}
 
   MachineInstruction* Instruction() const { return Inst_; }
 
-  const std::set<PrecedenceGraphNode*>& Successors() const { return Succs_; }
-  const std::set<PrecedenceGraphNode*>& Predecessors() const { return Preds_; }
+  // position of the instruction in the original block
+  size_t Index() const { return Index_; }
 
-  bool IsReady(const std::vector<PrecedenceGraphNode*>& Scheduled) const {
-    for(auto *Pred : Preds_) {
-      if(std::find(Scheduled.begin(), Scheduled.end(), Pred) == Scheduled.end()) {
-        return false;
-      }
-    }
-    return true;
+  int Latency() const { return Latency_; }
+  void SetLatency(int Latency) { Latency_ = Latency; }
+
+  // length of the longest latency path from this node to the end of the block
+  int Height() const { return Height_; }
+  void SetHeight(int Height) { Height_ = Height; }
+
+  int Start() const { return Start_; }
+  void SetStart(int Start) { Start_ = Start; }
+
+  const std::vector<PrecedenceGraphNode*>& Successors() const { return Succs_; }
+  size_t NumPredecessors() const { return NumPreds_; }
+
+  bool IsReady() const { return NumUnscheduledPreds_ == 0; }
+
+  // Called when a predecessor completes, returns true once the node becomes ready
+  bool PredecessorScheduled() {
+    assert(NumUnscheduledPreds_ > 0 && "Predecessor scheduled twice");
+    return --NumUnscheduledPreds_ == 0;
   }
 
   void UsedBy(PrecedenceGraphNode* Node) { 
-    AddSuccessor(Node); 
-    Node->AddPredecessor(this);
+    Succs_.push_back(Node);
+    Node->NumPreds_++;
+    Node->NumUnscheduledPreds_++;
   }
 
-protected:
-  void AddSuccessor(PrecedenceGraphNode* Node) { Succs_.insert(Node); }
-  void AddPredecessor(PrecedenceGraphNode* Node) { Preds_.insert(Node); }
-
 private:
   MachineInstruction* Inst_;
-  std::set<PrecedenceGraphNode*> Succs_;
-  std::set<PrecedenceGraphNode*> Preds_;
+  size_t Index_;
+  int Latency_, Height_, Start_;
+  size_t NumPreds_, NumUnscheduledPreds_;
+  std::vector<PrecedenceGraphNode*> Succs_;
 };
 
 class PrecedenceGraph {
 public:
-  PrecedenceGraph(MachineBasicBlock* Block) : Block_(Block) {}
+  PrecedenceGraph(MachineBasicBlock* Block, const MachineModel* Model, SchedulePhase Phase) 
+    : Block_(Block), Model_(Model), Phase_(Phase) {}
   ~PrecedenceGraph() {
     for(auto *Node : Nodes_) {
       delete Node;
@@ -57,19 +81,24 @@ public:
 private:
 
   MachineBasicBlock* Block_;
+  const MachineModel* Model_;
+  SchedulePhase Phase_;
   std::vector<PrecedenceGraphNode*> Nodes_;
 };
 
 class ListScheduler {
 public:
-  ListScheduler(MachineFunction* Function) : Function_(Function) {}
+  ListScheduler(MachineFunction* Function, const MachineModel* Model, SchedulePhase Phase = SchedulePhase::PreRA) 
+    : Function_(Function), Model_(Model), Phase_(Phase) {}
 
   void Schedule(); 
 
 private:
-  void ScheduleBlock(MachineBasicBlock* Block);
+  void ScheduleBlock(MachineBasicBlock* Block, const MRegLivenessState* LiveIn, const MRegLivenessState* LiveOut);
 
   MachineFunction* Function_;
+  const MachineModel* Model_;
+  SchedulePhase Phase_;
 };
 
 } // namespace klang
@@ -0,0 +1,55 @@
+#ifndef _JIT_H
+#define _JIT_H
+
+#include <Codegen/ObjectWriter.h>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace klang {
+
+// Loads an ObjectBuffer into executable memory of the compiler process.
+// Calls to the runtime are bound to the C functions of runtime/api.c linked
+// into the compiler: do_printi, do_array_new, ... through a jump, the K_
+// wrappers through stubs that do what runtime/wrapper.S does.
+class JITModule {
+public:
+  // calls a klang function with its arguments in an array
+  using EntryFunction = int64_t (*)(const int64_t* Args);
+
+  JITModule() : Memory_(nullptr), Size_(0) {}
+  ~JITModule();
+
+  JITModule(const JITModule&) = delete;
+  JITModule& operator=(const JITModule&) = delete;
+
+  // a symbol of an already loaded module, reached through an absolute jump
+  void AddExternal(const std::string& Name, void* Address) { Externals_[Name] = Address; }
+  // asks Load for an EntryFunction of the klang function Name
+  void AddEntry(const std::string& Name, size_t NumParams) { Entries_[Name] = NumParams; }
+
+  bool Load(const ObjectBuffer& Object);
+  void* Lookup(const std::string& Name) const;
+  EntryFunction Entry(const std::string& Name) const;
+
+  // runs K_main the way runtime/main.c would and returns its exit code
+  int Run();
+
+private:
+  void EmitRuntimeStub(std::vector<uint8_t>& Out, void* Target, size_t NumArgs) const;
+  void EmitJumpStub(std::vector<uint8_t>& Out, void* Target) const;
+  void EmitEntryStub(std::vector<uint8_t>& Out, std::vector<Relocation>& Relocations, const std::string& Name, size_t NumParams) const;
+
+  uint8_t* Memory_;
+  size_t Size_;
+  std::unordered_map<std::string, uint8_t*> Symbols_;
+  std::unordered_map<std::string, void*> Externals_;
+  std::unordered_map<std::string, size_t> Entries_;
+  std::unordered_map<std::string, uint8_t*> EntryPoints_;
+};
+
+} // namespace klang
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef _MACHINEMODEL_H
+#define _MACHINEMODEL_H
+
+#include <Codegen/Codegen.h>
+
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace klang {
+
+enum class CPUFamily : int {
+  Skylake,
+  Zen,
+};
+
+// Shape of the operands an instruction is issued with
+enum class OperandKind : int {
+  Reg,      // register operands only
+  Imm,      // immediate source
+  Load,     // memory source
+  Store,    // memory destination
+};
+
+constexpr size_t kNumOperandKinds = static_cast<size_t>(OperandKind::Store) + 1;
+constexpr size_t kNumOpcodes = static_cast<size_t>(MachineInstruction::Opcode::ArrayStore) + 1;
+
+struct SchedInfo {
+  int Latency_;       // cycles until the result is available
+  int Throughput_;    // reciprocal throughput, cycles the port stays busy
+  unsigned Ports_;    // mask of execution ports that can issue it
+};
+
+// One row of a CPU description: the costs of an opcode for every operand kind
+struct SchedRow {
+  MachineInstruction::Opcode Opcode_;
+  SchedInfo Info_[kNumOperandKinds];
+};
+
+class MachineModel {
+public:
+  static const MachineModel& Get(CPUFamily CPU);
+  static std::optional<CPUFamily> Parse(const std::string& Name);
+
+  const char* Name() const { return Name_; }
+  unsigned IssueWidth() const { return IssueWidth_; }
+  unsigned NumPorts() const { return NumPorts_; }
+
+  const SchedInfo& Info(const MachineInstruction* Inst) const;
+
+  static OperandKind KindOf(const MachineInstruction* Inst);
+
+private:
+  MachineModel(const char* Name, unsigned IssueWidth, unsigned NumPorts, const std::vector<SchedRow>& Rows);
+
+  const char* Name_;
+  unsigned IssueWidth_, NumPorts_;
+  SchedInfo Table_[kNumOpcodes][kNumOperandKinds];
+};
+
+} // namespace klang
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef _OBJECTWRITER_H
+#define _OBJECTWRITER_H
+
+#include <Codegen/Codegen.h>
+#include <Codegen/Encoder.h>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace klang {
+
+// Encoded code and data of a module as they would appear in an object file:
+// K_ functions in text, string literals in data, and the relocations for
+// calls and label addresses that still have to be resolved.
+class ObjectBuffer {
+public:
+  enum class Section : int {
+    Undefined,
+    Text,
+    Data,
+  };
+
+  struct Symbol {
+    std::string Name_;
+    Section Section_;
+    uint64_t Value_, Size_;   // offset into the section
+    bool Global_;
+  };
+
+  void AddFunction(const MachineFunction* Function);
+  // a string literal in the runtime's layout: 8-byte aligned length, the
+  // characters and a NUL
+  void AddStringLiteral(const std::string& Label, const std::string& Value);
+
+  const std::vector<uint8_t>& Text() const { return Text_; }
+  const std::vector<uint8_t>& Data() const { return Data_; }
+  const std::vector<Relocation>& Relocations() const { return Relocations_; }
+  const std::vector<Symbol>& Symbols() const { return Symbols_; }
+
+private:
+  // straight-line code of a block followed by its (still unsized) jumps
+  struct Fragment {
+    struct Jump {
+      std::optional<Condition> Cond_;
+      size_t Target_;
+      bool Short_;
+    };
+
+    std::vector<uint8_t> Bytes_;
+    std::vector<Relocation> Relocations_;
+    std::vector<Jump> Jumps_;
+  };
+
+  static void RelaxJumps(std::vector<Fragment>& Fragments, std::vector<size_t>& Offsets);
+
+  std::vector<uint8_t> Text_, Data_;
+  std::vector<Relocation> Relocations_;
+  std::vector<Symbol> Symbols_;
+};
+
+// Writes an ObjectBuffer as an ELF64 relocatable object
+class ELFObjectWriter : public ObjectBuffer {
+public:
+  bool Write(const char* FileName) const;
+};
+
+} // namespace klang
+
+#endif
@@ -62,6 +62,9 @@ private:
   int Start_, End_;
 };
 
+constexpr MachineRegister kAllocatables[] = { RCX, R8, R9, R10, R11, RSI, RDI };
+constexpr size_t kAllocatableRegisters = sizeof(kAllocatables) / sizeof(kAllocatables[0]);
+
 class LinearScanRegAlloc {
 public:
   LinearScanRegAlloc(MachineFunction* Func) : Func_(Func) {}
@@ -89,11 +92,11 @@ private:
   }
 
   void DumpOrderedInstructions() {
-    std::stringstream SS;
+    AsmWriter Out(stderr);
     for(size_t i = 0; i < OrderToInst_.size(); i++) {
-      SS.str("");
-      OrderToInst_[i]->Emit(SS);
-      std::cerr << i << ": " << SS.str() << std::endl;
+      Out << i << ": ";
+      OrderToInst_[i]->Emit(Out);
+      Out << '\n';
     }
   }
 
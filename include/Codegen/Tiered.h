@@ -0,0 +1,43 @@
+#ifndef _TIERED_H
+#define _TIERED_H
+
+#include <Codegen/Codegen.h>
+#include <Codegen/JIT.h>
+#include <IR/Interpreter.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace klang {
+
+// calls plus loop iterations before a function is compiled
+constexpr size_t kTierUpThreshold = 1000;
+
+// Tiered execution: functions start out in the Interpreter and are compiled
+// to native code once they get hot. A hot function is compiled together with
+// every function it may call that is not native yet, so native code never
+// has to call back into the interpreter.
+class TieredCompiler {
+public:
+  TieredCompiler(Module* Module, ModuleGenCtx* IRGenCtx, const MachineModel* Model);
+
+  // installs the tier-up hook on Interp, which has to outlive the compiler's use
+  void Attach(Interpreter& Interp, size_t Threshold = kTierUpThreshold);
+
+private:
+  void Promote(Interpreter& Interp, Function* F);
+  std::vector<Function*> CollectCallees(Function* F) const;
+
+  ModuleGenCtx* IRGenCtx_;
+  const MachineModel* Model_;
+  std::unordered_map<std::string, Function*> Functions_;
+  // K_ symbols of the functions compiled so far
+  std::unordered_map<std::string, void*> Natives_;
+  std::vector<std::unique_ptr<JITModule>> Modules_;
+};
+
+} // namespace klang
+
+#endif
@@ -7,6 +7,7 @@
 #include <algorithm>
 #include <deque>
 #include <set>
+#include <vector>
 
 namespace klang {
 
@@ -131,6 +132,167 @@ AnalysisResult<T, BasicBlock> DataflowAnalysis(Function* F) {
   return DoAnalysis<T, BasicBlock, Function, Direction>(F);
 }
 
+// Dominator tree, computed with the iterative algorithm from
+// Cooper, Harvey & Kennedy, "A Simple, Fast Dominance Algorithm".
+// With Post set, the tree is built on the reversed CFG and rooted at a
+// virtual exit (nullptr) joining all exit blocks; blocks that cannot reach
+// an exit are not contained in it.
+template <typename BB, typename FN, bool Post = false>
+class DominatorTreeBase {
+public:
+  DominatorTreeBase(FN* F) : Root_(Post ? nullptr : F->Entry()) { Build(F); }
+
+  BB* Root() const { return Root_; }
+  bool Contains(BB* Block) const { return IDoms_.count(Block) != 0; }
+
+  BB* IDom(BB* Block) const {
+    auto It = IDoms_.find(Block);
+    if(It == IDoms_.end()) {
+      return nullptr;
+    }
+    return It->second;
+  }
+
+  const std::vector<BB*>& Children(BB* Block) const {
+    static const std::vector<BB*> Empty;
+    auto It = Children_.find(Block);
+    if(It == Children_.end()) {
+      return Empty;
+    }
+    return It->second;
+  }
+
+  bool Dominates(BB* A, BB* B) const {
+    while(B != nullptr) {
+      if(A == B) {
+        return true;
+      }
+      B = IDom(B);
+    }
+    return false;
+  }
+
+private:
+  static std::vector<BB*> Forward(BB* Block) {
+    return Post ? Block->Predecessors() : Block->Successors();
+  }
+
+  static std::vector<BB*> Backward(BB* Block) {
+    auto Blocks = Post ? Block->Successors() : Block->Predecessors();
+    if(Post && Block->IsExit()) {
+      Blocks.push_back(nullptr);
+    }
+    return Blocks;
+  }
+
+  std::vector<BB*> PostOrder(FN* F) const {
+    std::vector<BB*> Roots;
+    if(Post) {
+      for(auto *Block : (*F)) {
+        if(Block->IsExit()) {
+          Roots.push_back(Block);
+        }
+      }
+    } else {
+      Roots.push_back(Root_);
+    }
+
+    std::vector<BB*> Order;
+    std::set<BB*> Visited;
+    std::vector<std::pair<BB*, std::vector<BB*>>> Stack;
+    for(auto *Start : Roots) {
+      if(!Visited.insert(Start).second) {
+        continue;
+      }
+      Stack.emplace_back(Start, Forward(Start));
+      while(!Stack.empty()) {
+        auto &[Block, Next] = Stack.back();
+        if(Next.empty()) {
+          Order.push_back(Block);
+          Stack.pop_back();
+          continue;
+        }
+        auto *Succ = Next.back();
+        Next.pop_back();
+        if(Visited.insert(Succ).second) {
+          Stack.emplace_back(Succ, Forward(Succ));
+        }
+      }
+    }
+
+    if(Post) {
+      Order.push_back(Root_);
+    }
+    return Order;
+  }
+
+  void Build(FN* F) {
+    auto PostOrder = this->PostOrder(F);
+    std::unordered_map<BB*, size_t> Order;
+    for(size_t i = 0; i < PostOrder.size(); i++) {
+      Order[PostOrder[i]] = i;
+    }
+
+    auto Intersect = [&](BB* A, BB* B) {
+      while(A != B) {
+        while(Order[A] < Order[B]) {
+          A = IDoms_[A];
+        }
+        while(Order[B] < Order[A]) {
+          B = IDoms_[B];
+        }
+      }
+      return A;
+    };
+
+    IDoms_[Root_] = Root_;
+    bool Changed = true;
+    while(Changed) {
+      Changed = false;
+      for(auto It = PostOrder.rbegin(); It != PostOrder.rend(); ++It) {
+        auto *Block = *It;
+        if(Block == Root_) {
+          continue;
+        }
+
+        BB* NewIDom = nullptr;
+        bool Found = false;
+        for(auto *Pred : Backward(Block)) {
+          if(IDoms_.count(Pred) == 0) {
+            continue;
+          }
+          NewIDom = !Found ? Pred : Intersect(Pred, NewIDom);
+          Found = true;
+        }
+
+        auto Old = IDoms_.find(Block);
+        if(Old == IDoms_.end() || Old->second != NewIDom) {
+          IDoms_[Block] = NewIDom;
+          Changed = true;
+        }
+      }
+    }
+
+    // children are kept in reverse post order
+    IDoms_[Root_] = nullptr;
+    for(auto It = PostOrder.rbegin(); It != PostOrder.rend(); ++It) {
+      if(*It != Root_) {
+        Children_[IDoms_[*It]].push_back(*It);
+      }
+    }
+    if(Post) {
+      IDoms_.erase(Root_);
+    }
+  }
+
+  BB* Root_;
+  std::unordered_map<BB*, BB*> IDoms_;
+  std::unordered_map<BB*, std::vector<BB*>> Children_;
+};
+
+using DominatorTree = DominatorTreeBase<BasicBlock, Function>;
+using PostDominatorTree = DominatorTreeBase<BasicBlock, Function, true>;
+
 } // namespace klang
 
 #endif 
\ No newline at end of file
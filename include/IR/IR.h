@@ -1,6 +1,8 @@
 #ifndef _IR_H
 #define _IR_H
 
+#include <IR/Intrinsics.h>
+
 #include <vector>
 #include <set>
 #include <string>
@@ -36,7 +38,7 @@ private:
 
 class Function {
 public:
-  Function(const char* Name, size_t NumParams) : Name_(Name), NumParams_(NumParams), NumRegs_(0), Parent_(nullptr) {}
+  Function(const char* Name, size_t NumParams) : Name_(Name), Parent_(nullptr), NumParams_(NumParams), NumRegs_(0), NumBlocks_(0) {}
 
   ~Function();
 
@@ -55,6 +57,7 @@ public:
   BasicBlock* Entry() const { return BasicBlocks_[0]; }
 
   void AddBasicBlock(BasicBlock* BB);
+  void InsertBasicBlock(BasicBlock* BB, size_t Pos);
   BasicBlock* Remove(BasicBlock* BB);
 
   void Print() const;
@@ -64,11 +67,11 @@ protected:
   void SetParent(Module* Parent) { Parent_ = Parent; }
 
 private:
-  void PostOrderImpl(BasicBlock* Current, std::set<BasicBlock*> Visited, std::vector<BasicBlock*>& PostOrder) const;
+  void PostOrderImpl(BasicBlock* Current, std::set<BasicBlock*>& Visited, std::vector<BasicBlock*>& PostOrder) const;
 
   std::string Name_;
   Module* Parent_;
-  size_t NumParams_, NumRegs_;
+  size_t NumParams_, NumRegs_, NumBlocks_;
   std::vector<BasicBlock*> BasicBlocks_;
 };
 
@@ -151,6 +154,7 @@ public:
 
     Call,
     CallVoid,
+    TailCall,
 
     Ret,
     RetVoid,
@@ -554,14 +558,15 @@ public:
 
 class CallInst : public Instruction {
 public:
-  CallInst(const char* Callee, const Operand& RetVal, const std::vector<Operand>& Args) : Instruction(Call), Callee_(Callee) {
+  CallInst(const char* Callee, const Operand& RetVal, const std::vector<Operand>& Args) 
+    : Instruction(Call), Callee_(Callee), Intrinsic_(FindIntrinsic(Callee)) {
     AddOperand(RetVal);
     for(auto& Arg : Args) {
       AddOperand(Arg);
     }
   }
 
-  bool HasSideEffects() const override { return true; }
+  bool HasSideEffects() const override { return Intrinsic_ == nullptr || Intrinsic_->HasSideEffects(); }
 
   virtual bool IsTerminator() const override { return false; }
   virtual size_t NumSuccessor() const override { return 0; }
@@ -595,20 +600,24 @@ public:
   void Print() const override;
 
   const char* Callee() const { return Callee_.c_str(); }
+  // nullptr for calls to klang functions
+  const Intrinsic* GetIntrinsic() const { return Intrinsic_; }
 
 private:
   std::string Callee_;
+  const Intrinsic* Intrinsic_;
 };
 
 class CallVoidInst : public Instruction {
 public:
-  CallVoidInst(const char* Callee, const std::vector<Operand>& Args) : Instruction(CallVoid), Callee_(Callee) {
+  CallVoidInst(const char* Callee, const std::vector<Operand>& Args) 
+    : Instruction(CallVoid), Callee_(Callee), Intrinsic_(FindIntrinsic(Callee)) {
     for(auto& Arg : Args) {
       AddOperand(Arg);
     }
   }
 
-  bool HasSideEffects() const override { return true; }
+  bool HasSideEffects() const override { return Intrinsic_ == nullptr || Intrinsic_->HasSideEffects(); }
 
   virtual bool IsTerminator() const override { return false; }
   virtual size_t NumSuccessor() const override { return 0; }
@@ -641,6 +650,55 @@ public:
   void Print() const override;
 
   const char* Callee() const { return Callee_.c_str(); }
+  // nullptr for calls to klang functions
+  const Intrinsic* GetIntrinsic() const { return Intrinsic_; }
+
+private:
+  std::string Callee_;
+  const Intrinsic* Intrinsic_;
+};
+
+class TailCallInst : public Instruction {
+public:
+  TailCallInst(const char* Callee, const std::vector<Operand>& Args) : Instruction(TailCall), Callee_(Callee) {
+    for(auto& Arg : Args) {
+      AddOperand(Arg);
+    }
+  }
+
+  bool HasSideEffects() const override { return true; }
+
+  virtual bool IsTerminator() const override { return true; }
+  virtual size_t NumSuccessor() const override { return 0; }
+  virtual BasicBlock* Successor(size_t Id) const override { 
+    assert(false && "Invalid successor id");
+    return nullptr;
+  }
+  virtual bool Verify() const override { return true; }
+
+  virtual size_t Ins() const override { return Size(); }
+  virtual size_t Outs() const override { return 0; }
+
+  virtual Operand GetIn(size_t Id) const override { 
+    assert(Id < Ins() && "Invalid input id");
+    return GetOperand(Id); 
+  }
+  virtual Operand GetOut(size_t Id) const override { 
+    assert(false && "Invalid output id");
+    return Operand();
+  }
+
+  virtual void ReplaceIn(size_t Id, const Operand& New) override { 
+    assert(Id < Ins() && "Invalid input id");
+    SetOperand(Id, New);
+  }
+  virtual void ReplaceOut(size_t Id, const Operand& New) override { 
+    assert(false && "Invalid output id");
+  }
+
+  void Print() const override;
+
+  const char* Callee() const { return Callee_.c_str(); }
 
 private:
   std::string Callee_;
@@ -655,7 +713,12 @@ public:
 
   NORMAL_INST(2);
 
-  bool HasSideEffects() const override { return true; }
+  // the array_new intrinsic: an array nothing refers to can be dropped,
+  // unless its size may make the runtime stop the program
+  bool HasSideEffects() const override {
+    auto Size = GetOperand(1);
+    return !(Size.IsImmediate() && Size.Imm() >= 0 && Size.Imm() <= kArrayNewSafeSize);
+  }
 
 public:
   virtual size_t Ins() const override { return 1; }
@@ -844,6 +907,7 @@ public:
 
   void Call(const char* Callee, const Operand& RetVal, const std::vector<Operand>& Args) { Emit(new CallInst(Callee, RetVal, Args)); }
   void CallVoid(const char* Callee, const std::vector<Operand>& Args) { Emit(new CallVoidInst(Callee, Args)); }
+  void TailCall(const char* Callee, const std::vector<Operand>& Args) { Emit(new TailCallInst(Callee, Args)); }
 
   void ArrayNew(const Operand& RetVal, const Operand& Size) { Emit(new ArrayNewInst(RetVal, Size)); }
   void ArrayLoad(const Operand& RetVal, const Operand& Array, const Operand& Index) { Emit(new ArrayLoadInst(RetVal, Array, Index)); }
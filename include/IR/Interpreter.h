@@ -3,49 +3,151 @@
 
 #include <IR/IR.h>
 
+#include <cstring>
 #include <exception>
 #include <stdexcept>
 #include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
 
 namespace klang {
 
 using InterpreterFunction = std::function<int64_t(std::vector<int64_t>&)>;
+using TierUpFunction = std::function<void(Function*)>;
+using RootMarker = void (*)(const int64_t* Begin, const int64_t* End);
+
+#pragma region Bytecode
+enum class BytecodeOp : uint8_t {
+  Mov,      // A = B
+
+  // A = B op C, same order as BinaryInst::Operation
+  Add,
+  Sub,
+  Mul,
+  Div,
+  Mod,
+  And,
+  Or,
+  Xor,
+  Shl,
+  Shr,
+  Lt,
+  Le,
+  Gt,
+  Ge,
+  Eq,
+  Ne,
+
+  Jmp,      // pc = A
+  Jnz,      // pc = A != 0 ? B : C
+  Loop,     // counts an iteration of the loop headed here
+  Ret,      // return A
+  RetVoid,
+
+  Call,     // A = function B (args at C in the arg pool)
+  CallVoid,
+  TailCall,
+};
+
+// Operands are pre-decoded frame slots: parameters, then IR registers, then
+// the function's constants. Handler_ is the dispatch label of Op_, filled in
+// the first time the function runs.
+struct BytecodeInst {
+  const void* Handler_;
+  BytecodeOp Op_;
+  uint32_t A_, B_, C_;
+};
+
+struct BytecodeFunction {
+  std::string Name_;
+  uint32_t Index_;          // in the function table
+  size_t NumParams_;
+  size_t FrameSize_;
+  size_t ConstantBase_;
+  std::vector<int64_t> Constants_;
+  std::vector<BytecodeInst> Code_;
+  // argument lists of calls: count followed by the argument slots
+  std::vector<uint32_t> ArgPool_;
+  bool Threaded_;
+};
+
+// Functions are referred to by their index in the function table, resolved
+// when the caller is compiled. An entry is either IR, compiled on the first
+// call, or native.
+struct InterpreterEntry {
+  std::string Name_;
+  Function* IR_;
+  std::unique_ptr<BytecodeFunction> Code_;
+  InterpreterFunction Native_;
+  size_t Hotness_;          // calls plus loop iterations
+};
+
+// a suspended caller; its frame starts at Base_ in the frame stack
+struct CallFrame {
+  BytecodeFunction* Function_;
+  const BytecodeInst* CallPC_;
+  size_t Base_;
+};
+#pragma endregion
 
 class Interpreter {
 public:
-  Interpreter() : Regs_() {}
+  Interpreter() : TierUpThreshold_(0), StackTop_(0) {}
   ~Interpreter();
 
   void AddFunction(Function* F) {
-    InterpreterFunction IF = [&](std::vector<int64_t>& Args) {
-      return this->Execute(F, Args);
-    };
-    Funcs_[F->Name()] = std::move(IF);
+    Functions_[FunctionIndex(F->Name())].IR_ = F;
   }
 
   void AddNativeFunction(const char* Name, InterpreterFunction F) {
-    Funcs_[Name] = std::move(F);
+    Functions_[FunctionIndex(Name)].Native_ = std::move(F);
+  }
+
+  // LoadLabel of Label evaluates to the address of a copy of Value in the
+  // string layout of the runtime: the length, the characters and a NUL
+  void AddStringLiteral(const std::string& Label, const std::string& Value) {
+    auto &Words = StringLiterals_[Label];
+    Words.assign(Value.size() / sizeof(int64_t) + 2, 0);
+    Words[0] = static_cast<int64_t>(Value.size());
+    memcpy(&Words[1], Value.data(), Value.size());
+  }
+
+  int64_t RunFunction(const char* Name, std::vector<int64_t>& Args);
+
+  // Hook is called once for every function whose hotness reaches Threshold.
+  // It may replace the function with a native one, later calls then use it.
+  void SetTierUp(size_t Threshold, TierUpFunction Hook) {
+    TierUpThreshold_ = Threshold;
+    TierUp_ = std::move(Hook);
   }
 
-  int64_t RunFunction(const char* Name, std::vector<int64_t>& Args) {
-    auto It = Funcs_.find(Name);
-    if(It == Funcs_.end()) {
-      throw std::runtime_error("Unknown function");
-    }
-    return It->second(Args);
+  // Reports the words that may hold klang values while a function runs,
+  // for the collector of the runtime: the frame stack. Arguments of native
+  // calls are copies of slots in the caller's window.
+  void MarkRoots(RootMarker Mark) const {
+    Mark(Stack_.data(), Stack_.data() + Stack_.size());
   }
 
 private:
-  int64_t Execute(Function* F, std::vector<int64_t>& Args);
+  // runs the whole call tree on an explicit frame stack, without recursing
+  int64_t Execute(uint32_t Index, std::vector<int64_t>& Args);
 
-  int64_t LoadOperand(Operand Op, std::vector<int64_t>& Args);
-  void StoreOperand(size_t Reg, Operand Op);
+  BytecodeFunction* Compile(Function* F);
+  BytecodeFunction* Resolve(uint32_t Index);
+  uint32_t FunctionIndex(const std::string& Name);
 
-  std::unordered_map<size_t, int64_t> Regs_;
-  std::unordered_map<std::string, InterpreterFunction> Funcs_;
-  std::vector<std::vector<int64_t>> Arrays_;
+  std::vector<InterpreterEntry> Functions_;
+  std::unordered_map<std::string, uint32_t> FunctionIndices_;
+  std::map<std::string, std::vector<int64_t>> StringLiterals_;
+  size_t TierUpThreshold_;
+  TierUpFunction TierUp_;
+  // frame stack shared by nested Executes, the slots below StackTop_ belong
+  // to the activations suspended in a native call
+  std::vector<int64_t> Stack_;
+  size_t StackTop_;
 };
 
 } // namespace klang
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,48 @@
+#ifndef _INTRINSICS_H
+#define _INTRINSICS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace klang {
+
+// What a call to a runtime function may do. A call to a function that is not
+// an intrinsic may do anything.
+enum IntrinsicAttribute : unsigned {
+  kIntrinsicPure = 1 << 0,            // no effects, the result only depends on the arguments
+                                      // and the memory they point to
+  kIntrinsicAllocates = 1 << 1,       // the result is new memory nothing else refers to
+  kIntrinsicReadsStdin = 1 << 2,
+  kIntrinsicWritesStdout = 1 << 3,
+  kIntrinsicClobbersMemory = 1 << 4,  // may change or free memory klang code reads
+  kIntrinsicMayTrap = 1 << 5,         // stops the program on bad arguments, so an
+                                      // unused call can't be dropped
+};
+
+// A runtime function known to the compiler, see runtime/api.c. No intrinsic
+// keeps its arguments or writes through them unless it clobbers memory.
+struct Intrinsic {
+  const char* Name_;
+  size_t NumArgs_;
+  bool ReturnsValue_;
+  unsigned Attributes_;
+
+  bool Is(IntrinsicAttribute Attribute) const { return (Attributes_ & Attribute) != 0; }
+
+  // a call without side effects can be dropped when its result is unused
+  bool HasSideEffects() const {
+    return (Attributes_ & (kIntrinsicReadsStdin | kIntrinsicWritesStdout | kIntrinsicClobbersMemory | kIntrinsicMayTrap)) != 0;
+  }
+};
+
+// array_new succeeds for every size up to this, whatever the limit set at run
+// time (ARRAY_MIN_MAX_SIZE in runtime/api.c)
+constexpr int64_t kArrayNewSafeSize = 1 << 16;
+
+// nullptr unless Name is an intrinsic
+const Intrinsic* FindIntrinsic(const std::string& Name);
+
+} // namespace klang
+
+#endif
@@ -124,54 +124,51 @@ struct CopyPropState {
 bool CopyPropagate(Function* F);
 #pragma endregion
 
-#pragma region CommonSubexpressionElimination
-struct CSEValue {
-  CSEValue() : Operation_(BinaryInst::Add), RHS1(), RHS2() {}
-  CSEValue(BinaryInst::Operation Op, Operand RHS1, Operand RHS2) : Operation_(Op), RHS1(RHS1), RHS2(RHS2) {}
-
-  bool operator==(const CSEValue& Other) const {
-    return Operation_ == Other.Operation_ && RHS1 == Other.RHS1 && RHS2 == Other.RHS2;
-  }
-
-  bool operator<(const CSEValue& Other) const {
-    if(Operation_ != Other.Operation_) {
-      return Operation_ < Other.Operation_;
-    }
-    if(RHS1 != Other.RHS1) {
-      return RHS1 < Other.RHS1;
-    }
-    return RHS2 < Other.RHS2;
-  }
-
-  static std::optional<CSEValue> FromInstruction(const Instruction& Inst);
-
-  BinaryInst::Operation Operation_;
-  Operand RHS1, RHS2;
+#pragma region GlobalValueNumbering
+// An expression over value numbers: the instruction type (and binary
+// operation) applied to the value numbers of its inputs
+struct GVNExpression {
+  GVNExpression() : Type_(Instruction::Nop), Operation_(0), Args_{0, 0, 0}, Label_() {}
+
+  bool operator==(const GVNExpression& Other) const {
+    return Type_ == Other.Type_ && Operation_ == Other.Operation_
+      && Args_[0] == Other.Args_[0] && Args_[1] == Other.Args_[1] && Args_[2] == Other.Args_[2]
+      && Label_ == Other.Label_;
+  }
+
+  Instruction::InstructionType Type_;
+  size_t Operation_;
+  size_t Args_[3];
+  std::string Label_;
 };
 
-struct GCSEState {
-  GCSEState() : Values_(), Init_(false) {}
-
-  static GCSEState Empty(Function* Func) {
-    return GCSEState();
-  }
+struct GVNExpressionHash {
+  size_t operator()(const GVNExpression& Expr) const;
+};
 
-  void Meet(const GCSEState& Other);
-  void Transfer(const Instruction& Inst);
+bool GlobalValueNumbering(Function* F);
+#pragma endregion
 
-  bool operator==(const GCSEState& Other) const {
-    return Values_ == Other.Values_ && Init_ == Other.Init_;
-  }
+#pragma region InstCombine
+enum class CombinePattern : int {
+  RightImm,       // x op C
+  SameOperands,   // x op x
+};
 
-  void Intersect(const GCSEState& Other);
-  bool Contains(const CSEValue& Value) const;
+enum class CombineResult : int {
+  Left,           // x
+  Constant,       // C'
+};
 
-  std::set<CSEValue> Values_;
-  bool Init_;
+struct CombineRule {
+  BinaryInst::Operation Operation_;
+  CombinePattern Pattern_;
+  int64_t Imm_;
+  CombineResult Result_;
+  int64_t Value_;
 };
 
-bool LocalCSE(Function* F);
-bool GlobalCSE(Function* F);
+bool InstCombine(Function* F);
 #pragma endregion
 
 #pragma region DeadCodeElimination
@@ -196,9 +193,34 @@ struct LivenessState {
   std::set<size_t> LiveRegs_;
 };
 
+struct ReachingDefsState {
+  ReachingDefsState() : Defs_() {}
+
+  static ReachingDefsState Empty(Function* Func) {
+    return ReachingDefsState();
+  }
+
+  void Meet(const ReachingDefsState& Other);
+  void Transfer(const Instruction& Inst);
+
+  bool operator==(const ReachingDefsState& Other) const {
+    return Defs_ == Other.Defs_;
+  }
+
+  std::map<size_t, std::set<const Instruction*>> Defs_;
+};
+
 bool DeadCodeElimination(Function* F);
 #pragma endregion
 
+#pragma region SimplifyCFG
+bool SimplifyCFG(Function* F);
+#pragma endregion
+
+#pragma region TailCallElimination
+bool TailCallElimination(Function* F);
+#pragma endregion
+
 void OptimizeIR(Function* F);
 
 } // namespace klang
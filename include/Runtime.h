@@ -0,0 +1,44 @@
+#ifndef _RUNTIME_H
+#define _RUNTIME_H
+
+#include <cstdint>
+#include <cstdio>
+#include <unistd.h>
+
+// runtime/api.c, linked into the compiler for in-process execution
+extern "C" {
+void do_init_io(void);
+void do_flush(void);
+void do_printi(int64_t i);
+void do_prints(const void* s);
+int64_t do_inputi(void);
+int64_t do_random(void);
+void* do_inputs(void);
+void* do_array_new(int64_t size);
+int64_t do_array_load(void* arr, int64_t index);
+void do_array_store(void* arr, int64_t index, int64_t value);
+int64_t do_region_mark(void);
+void do_region_reset(int64_t mark);
+void do_region_end(void);
+int64_t do_strlen(const void* s);
+int64_t do_strcmp(const void* a, const void* b);
+int64_t do_strfind(const void* haystack, const void* needle);
+void* do_substr(const void* s, int64_t start, int64_t length);
+void* do_concat(const void* a, const void* b);
+int64_t do_charat(const void* s, int64_t index);
+void do_gc_set_roots(void (*scan)(void* context), void* context);
+void do_gc_mark_range(const int64_t* begin, const int64_t* end);
+}
+
+namespace klang {
+
+// the process setup runtime/main.c does before calling K_main
+inline void InitRuntime() {
+  setvbuf(stderr, nullptr, _IONBF, 0);
+  do_init_io();
+  alarm(20);
+}
+
+} // namespace klang
+
+#endif
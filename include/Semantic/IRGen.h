@@ -54,11 +54,16 @@ struct FuncGenCtx {
   FuncBuilder* B;
   ModuleGenCtx* MCtx;
   std::map<ASTName, Operand> Variables;
+  size_t StringCalls = 0;     // calls generated so far that may return a new string
+  bool InLoop = false;
+  std::vector<Instruction*> LoopReturns;  // returns generated inside the current loop
 };
 
 class IRGen {
 public:
-  IRGen(ASTModule* Module) : Module_(Module) {}
+  // StringRegions releases the strings of a loop iteration when the next
+  // one starts, see runtime/api.c
+  IRGen(ASTModule* Module, bool StringRegions = false) : Module_(Module), StringRegions_(StringRegions) {}
 
   bool Verify();
   std::pair<ModuleGenCtx, Module*> Generate();
@@ -70,6 +75,7 @@ private:
   Operand GenerateExpression(FuncGenCtx& Ctx, ASTExpression* E, bool CallVoid = false);
 
   ASTModule* Module_;
+  bool StringRegions_;
 };
 
 } // namespace klang
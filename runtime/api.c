@@ -1,73 +1,949 @@
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <memory.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <immintrin.h>
+
+// Output goes through one large buffer instead of a write per print. It is
+// flushed when full, before reading input, on exit and on fatal errors.
+// KLANG_UNBUFFERED=1 flushes after every print for interactive use.
+#define OUT_BUFFER_SIZE (1 << 16)
+
+static char out_buffer[OUT_BUFFER_SIZE];
+static size_t out_length;
+static int out_unbuffered;
+
+static void write_all(int fd, const char* data, size_t size) {
+    while(size > 0) {
+        ssize_t written = write(fd, data, size);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+void do_flush(void) {
+    write_all(STDOUT_FILENO, out_buffer, out_length);
+    out_length = 0;
+}
+
+static void out_write(const char* data, size_t size) {
+    if(out_length + size > OUT_BUFFER_SIZE) {
+        do_flush();
+        if(size > OUT_BUFFER_SIZE) {
+            write_all(STDOUT_FILENO, data, size);
+            return;
+        }
+    }
+    memcpy(out_buffer + out_length, data, size);
+    out_length += size;
+}
+
+static void out_end_line(void) {
+    if(out_length == OUT_BUFFER_SIZE) {
+        do_flush();
+    }
+    out_buffer[out_length++] = '\n';
+    if(out_unbuffered) {
+        do_flush();
+    }
+}
+
+// Don't lose the output when the time limit kills us or the program traps,
+// e.g. dividing by zero. The handler runs on its own stack so that it also
+// works after a stack overflow.
+#define SIGNAL_STACK_SIZE (1 << 16)
+
+static char signal_stack[SIGNAL_STACK_SIZE];
+
+static void flush_on_signal(int sig) {
+    do_flush();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+void do_init_io(void) {
+    const char* unbuffered = getenv("KLANG_UNBUFFERED");
+    out_unbuffered = unbuffered != NULL && strcmp(unbuffered, "0") != 0;
+    atexit(do_flush);
+
+    stack_t stack;
+    stack.ss_sp = signal_stack;
+    stack.ss_size = sizeof(signal_stack);
+    stack.ss_flags = 0;
+    sigaltstack(&stack, NULL);
+
+    static const int flushed_signals[] = { SIGALRM, SIGFPE, SIGSEGV, SIGBUS };
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = flush_on_signal;
+    action.sa_flags = SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    for(size_t i = 0; i < sizeof(flushed_signals) / sizeof(flushed_signals[0]); i++) {
+        sigaction(flushed_signals[i], &action, NULL);
+    }
+}
 
 void __attribute__((noreturn)) fatal(const char* msg) {
+    do_flush();
     fprintf(stderr, "Fatal error: %s\n", msg);
     exit(1);
 }
 
+static const char digit_pairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// writes the decimal digits of value so they end at end, two at a time
+static char* format_int(char* end, int64_t value) {
+    uint64_t n = value < 0 ? -(uint64_t)value : (uint64_t)value;
+    while(n >= 100) {
+        end -= 2;
+        memcpy(end, &digit_pairs[(n % 100) * 2], 2);
+        n /= 100;
+    }
+    if(n >= 10) {
+        end -= 2;
+        memcpy(end, &digit_pairs[n * 2], 2);
+    } else {
+        *--end = '0' + n;
+    }
+    if(value < 0) {
+        *--end = '-';
+    }
+    return end;
+}
+
 void do_printi(int64_t i) {
-    printf("%ld\n", i);
+    char buf[24];
+    char* start = format_int(buf + sizeof(buf), i);
+    out_write(start, buf + sizeof(buf) - start);
+    out_end_line();
+}
+
+/* Strings are their length followed by the characters and a NUL, so the
+ * length is known without a scan. String literals of compiled code have the
+ * same layout (see ModuleCodegen::GenerateStringLiterals), the others come
+ * from inputs, substr and concat. Strings are never modified. */
+struct string_t {
+    int64_t length;
+    char data[];
+};
+
+static const struct string_t* check_string(const struct string_t* s) {
+    if(!s) {
+        fatal("String is null");
+    }
+    return s;
+}
+
+void do_prints(const struct string_t* s) {
+    check_string(s);
+    out_write(s->data, s->length);
+    out_end_line();
+}
+
+// Input is read ahead in large chunks, or mapped as a whole when stdin is a
+// regular file, and scanned in place. inputi and inputs consume input the
+// way the fgets calls they replaced did: one line, or the start of a line
+// too long for their buffer.
+#define IN_BUFFER_SIZE (1 << 16)
+
+static char in_buffer[IN_BUFFER_SIZE];
+static const char* in_pos;
+static const char* in_end;
+static int in_started;
+static int in_done;
+
+static void in_map(void) {
+    struct stat st;
+    if(fstat(STDIN_FILENO, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+    off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    if(offset < 0 || offset >= st.st_size) {
+        return;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+    if(data == MAP_FAILED) {
+        return;
+    }
+    in_pos = (const char*)data + offset;
+    in_end = (const char*)data + st.st_size;
+    in_done = 1;
 }
 
-void do_prints(const char* s) {
-    puts(s); 
+// makes sure there is input at in_pos, returns 0 at the end of the input
+static int in_fill(void) {
+    if(in_pos < in_end) {
+        return 1;
+    }
+    if(!in_started) {
+        in_started = 1;
+        in_map();
+        if(in_pos < in_end) {
+            return 1;
+        }
+    }
+    if(in_done) {
+        return 0;
+    }
+    ssize_t n;
+    do {
+        n = read(STDIN_FILENO, in_buffer, sizeof(in_buffer));
+    } while(n < 0 && errno == EINTR);
+    if(n <= 0) {
+        in_done = 1;
+        return 0;
+    }
+    in_pos = in_buffer;
+    in_end = in_buffer + n;
+    return 1;
 }
 
+// same result as strtol on the line: leading blanks, an optional sign and
+// decimal digits, saturating on overflow
+static int64_t parse_int(const char* p, const char* end) {
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f')) {
+        p++;
+    }
+    int negative = 0;
+    if(p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    uint64_t limit = negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    uint64_t value = 0;
+    for(; p < end && *p >= '0' && *p <= '9'; p++) {
+        uint64_t digit = *p - '0';
+        if(value > (limit - digit) / 10) {
+            return negative ? INT64_MIN : INT64_MAX;
+        }
+        value = value * 10 + digit;
+    }
+    return negative ? (int64_t)(0 - value) : (int64_t)value;
+}
+
+// Copies the next line to line like fgets does: at most size - 1 characters
+// including the newline, the rest of a longer line stays for the next read.
+// There has to be input left.
+static size_t in_read_line(char* line, size_t size) {
+    size_t length = 0;
+    while(length < size - 1 && in_fill()) {
+        size_t n = in_end - in_pos;
+        if(n > size - 1 - length) {
+            n = size - 1 - length;
+        }
+        const char* newline = memchr(in_pos, '\n', n);
+        if(newline) {
+            n = newline - in_pos + 1;
+        }
+        memcpy(line + length, in_pos, n);
+        length += n;
+        in_pos += n;
+        if(newline) {
+            break;
+        }
+    }
+    return length;
+}
+
+// inputi used to read lines with fgets into 1024 bytes
+#define INPUTI_LINE_SIZE 1024
+
 int64_t do_inputi(void) {
-    char buf[1024];
-    if(!fgets(buf, sizeof(buf), stdin)) {
+    if(out_length > 0) {
+        do_flush();
+    }
+    if(!in_fill()) {
         fatal("Failed to read input");
     }
-    int64_t i;
-    i = strtol(buf, NULL, 10);
-    return i;
+
+    // the line is usually buffered already
+    size_t n = in_end - in_pos;
+    if(n > INPUTI_LINE_SIZE - 1) {
+        n = INPUTI_LINE_SIZE - 1;
+    }
+    const char* newline = memchr(in_pos, '\n', n);
+    if(newline || n == INPUTI_LINE_SIZE - 1) {
+        const char* end = newline ? newline : in_pos + n;
+        int64_t value = parse_int(in_pos, end);
+        in_pos = newline ? newline + 1 : end;
+        return value;
+    }
+
+    char line[INPUTI_LINE_SIZE];
+    size_t length = in_read_line(line, sizeof(line));
+    return parse_int(line, line + length);
+}
+
+// random() comes from xoshiro256**, seeded once from the kernel. With
+// KLANG_SECURE_RANDOM=1 it hands out kernel randomness instead, fetched a
+// block at a time.
+#define RANDOM_BLOCK_SIZE 64
+
+static uint64_t random_state[4];
+static uint64_t random_block[RANDOM_BLOCK_SIZE];
+static size_t random_next = RANDOM_BLOCK_SIZE;
+static int random_seeded;
+static int random_secure;
+
+static void get_entropy(void* data, size_t size) {
+    char* p = (char*)data;
+    while(size > 0) {
+        ssize_t n = getrandom(p, size, 0);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            fatal("Failed to get random bytes");
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+static void seed_random(void) {
+    const char* secure = getenv("KLANG_SECURE_RANDOM");
+    random_secure = secure != NULL && strcmp(secure, "0") != 0;
+    // the all-zero state is the one xoshiro can't leave
+    do {
+        get_entropy(random_state, sizeof(random_state));
+    } while((random_state[0] | random_state[1] | random_state[2] | random_state[3]) == 0);
+    random_seeded = 1;
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t xoshiro256ss(void) {
+    uint64_t result = rotl(random_state[1] * 5, 7) * 9;
+    uint64_t t = random_state[1] << 17;
+    random_state[2] ^= random_state[0];
+    random_state[3] ^= random_state[1];
+    random_state[1] ^= random_state[2];
+    random_state[0] ^= random_state[3];
+    random_state[2] ^= t;
+    random_state[3] = rotl(random_state[3], 45);
+    return result;
 }
 
 int64_t do_random(void) {
-    int64_t r;
-    int fd = open("/dev/urandom", O_RDONLY);
-    if(!fd) {
-        fatal("Failed to open /dev/urandom");
+    if(!random_seeded) {
+        seed_random();
+    }
+    if(!random_secure) {
+        return (int64_t)xoshiro256ss();
+    }
+    if(random_next == RANDOM_BLOCK_SIZE) {
+        get_entropy(random_block, sizeof(random_block));
+        random_next = 0;
+    }
+    return (int64_t)random_block[random_next++];
+}
+
+/* Arrays and input strings live on a heap of two tiers. Objects up to
+ * 4 KiB are carved out of 1 MiB slabs, one per power-of-two size class.
+ * Larger ones get an anonymous mapping of their own, which the kernel
+ * zeroes a page at a time as it is first touched.
+ *
+ * Memory is reclaimed by a non-moving mark-sweep collector. Compiled klang
+ * code keeps every live value in its stack frame across a call, because
+ * the register allocator spills around calls. The roots are therefore the
+ * callee-saved registers, which the runtime's own C code may use, the words
+ * of the machine stack between the collector and __libc_stack_end, and
+ * whatever a host registers with do_gc_set_roots.
+ * A word equal to the address of an object keeps that object alive.
+ * Arrays only hold integers, so marking doesn't recurse. A collection runs
+ * once the bytes allocated since the last one exceed the bytes that
+ * survived it (at least HEAP_MIN_THRESHOLD), and before giving up on a
+ * failed mapping.
+ *
+ * KLANG_GC=0 turns collection off. KLANG_HEAP_STATS=1 prints allocation
+ * and pause statistics to stderr at exit. */
+#define HEAP_MIN_CLASS 5
+#define HEAP_MAX_CLASS 12
+#define HEAP_SLAB_SIZE (1 << 20)
+#define HEAP_HUGE_PAGE_SIZE (1 << 21)
+#define HEAP_MIN_THRESHOLD (4 << 20)
+#define HEAP_MIN_OBJECTS 1024
+
+extern void* __libc_stack_end;
+
+struct heap_class {
+    char* next;
+    char* end;
+    void* free_list;
+};
+
+/* open addressing on the object address, bit 0 of bytes is the mark */
+struct heap_object {
+    uintptr_t address;
+    size_t bytes;
+};
+
+struct heap_stats {
+    int64_t small_objects;
+    int64_t small_bytes;
+    int64_t slabs;
+    int64_t large_objects;
+    int64_t large_bytes;
+    int64_t collections;
+    int64_t freed_objects;
+    int64_t freed_bytes;
+    int64_t total_pause_ns;
+    int64_t max_pause_ns;
+};
+
+static struct heap_class heap_classes[HEAP_MAX_CLASS + 1];
+static struct heap_object* heap_objects;
+static size_t heap_capacity;
+static size_t heap_count;
+static uintptr_t heap_low = UINTPTR_MAX;
+static uintptr_t heap_high;
+static size_t heap_allocated;
+static size_t heap_threshold = HEAP_MIN_THRESHOLD;
+static int heap_initialized;
+static int gc_disabled;
+static void (*gc_roots)(void* context);
+static void* gc_roots_context;
+static struct heap_stats heap_stats;
+
+static void print_heap_stats(void) {
+    do_flush();
+    fprintf(stderr, "heap: %lld small (%lld bytes in %lld slabs), %lld large (%lld bytes mapped)\n",
+        (long long)heap_stats.small_objects, (long long)heap_stats.small_bytes, (long long)heap_stats.slabs,
+        (long long)heap_stats.large_objects, (long long)heap_stats.large_bytes);
+    fprintf(stderr, "gc: %lld collections, %lld objects (%lld bytes) freed, pauses %.3f ms total, %.3f ms max\n",
+        (long long)heap_stats.collections, (long long)heap_stats.freed_objects, (long long)heap_stats.freed_bytes,
+        heap_stats.total_pause_ns / 1e6, heap_stats.max_pause_ns / 1e6);
+}
+
+static void init_heap(void) {
+    const char* gc = getenv("KLANG_GC");
+    const char* stats = getenv("KLANG_HEAP_STATS");
+    gc_disabled = gc != NULL && strcmp(gc, "0") == 0;
+    if(stats != NULL && strcmp(stats, "0") != 0) {
+        atexit(print_heap_stats);
+    }
+    heap_initialized = 1;
+}
+
+static size_t heap_slot(uintptr_t address) {
+    return (size_t)(((address >> 4) * 0x9e3779b97f4a7c15ULL) >> 32) & (heap_capacity - 1);
+}
+
+static void heap_insert(uintptr_t address, size_t bytes) {
+    size_t i = heap_slot(address);
+    while(heap_objects[i].address != 0) {
+        i = (i + 1) & (heap_capacity - 1);
+    }
+    heap_objects[i].address = address;
+    heap_objects[i].bytes = bytes;
+    heap_count++;
+}
+
+static void heap_resize(size_t capacity) {
+    struct heap_object* old = heap_objects;
+    size_t old_capacity = heap_capacity;
+    heap_objects = (struct heap_object*)calloc(capacity, sizeof(struct heap_object));
+    if(!heap_objects) {
+        fatal("Failed to allocate the heap table");
+    }
+    heap_capacity = capacity;
+    heap_count = 0;
+    for(size_t i = 0; i < old_capacity; i++) {
+        if(old[i].address != 0) {
+            heap_insert(old[i].address, old[i].bytes);
+        }
+    }
+    free(old);
+}
+
+static void heap_register(void* p, size_t bytes) {
+    if((heap_count + 1) * 2 > heap_capacity) {
+        heap_resize(heap_capacity ? heap_capacity * 2 : HEAP_MIN_OBJECTS);
+    }
+    uintptr_t address = (uintptr_t)p;
+    heap_insert(address, bytes);
+    if(address < heap_low) {
+        heap_low = address;
+    }
+    if(address >= heap_high) {
+        heap_high = address + 1;
     }
-    if(read(fd, &r, sizeof(r)) != sizeof(r)) {
-        fatal("Failed to read from /dev/urandom");
+}
+
+static void mark_word(int64_t word) {
+    uintptr_t address = (uintptr_t)word;
+    // every object is at least 16-byte aligned
+    if((address & 15) != 0 || address < heap_low || address >= heap_high) {
+        return;
+    }
+    for(size_t i = heap_slot(address); heap_objects[i].address != 0; i = (i + 1) & (heap_capacity - 1)) {
+        if(heap_objects[i].address == address) {
+            heap_objects[i].bytes |= 1;
+            return;
+        }
+    }
+}
+
+void do_gc_mark_range(const int64_t* begin, const int64_t* end) {
+    for(const int64_t* p = begin; p < end; p++) {
+        mark_word(*p);
+    }
+}
+
+void do_gc_set_roots(void (*scan)(void* context), void* context) {
+    gc_roots = scan;
+    gc_roots_context = context;
+}
+
+static void release(void* p, size_t bytes) {
+    if(bytes <= ((size_t)1 << HEAP_MAX_CLASS)) {
+        struct heap_class* c = &heap_classes[__builtin_ctzll(bytes)];
+        *(void**)p = c->free_list;
+        c->free_list = p;
+    } else {
+        munmap(p, bytes);
+    }
+}
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// its frame is below collect's, so the scan covers the registers collect
+// saved
+static void __attribute__((noinline)) mark_stack(void) {
+    const int64_t* stack = (const int64_t*)__builtin_frame_address(0);
+    do_gc_mark_range(stack, (const int64_t*)((uintptr_t)__libc_stack_end & ~(uintptr_t)7));
+}
+
+static void __attribute__((noinline)) collect(void) {
+    int64_t start = now_ns();
+    if(heap_count > 0) {
+        // the runtime's C callers may keep an object only in a callee-saved
+        // register, this saves all of them on the stack
+        __builtin_unwind_init();
+        mark_stack();
+        if(gc_roots) {
+            gc_roots(gc_roots_context);
+        }
+    }
+
+    // survivors move to a fresh table, which also drops their marks
+    struct heap_object* old = heap_objects;
+    size_t old_capacity = heap_capacity;
+    size_t live = 0;
+    heap_objects = (struct heap_object*)calloc(old_capacity, sizeof(struct heap_object));
+    if(old_capacity > 0 && !heap_objects) {
+        fatal("Failed to allocate the heap table");
+    }
+    heap_count = 0;
+    for(size_t i = 0; i < old_capacity; i++) {
+        if(old[i].address == 0) {
+            continue;
+        }
+        size_t bytes = old[i].bytes & ~(size_t)1;
+        if(old[i].bytes & 1) {
+            heap_insert(old[i].address, bytes);
+            live += bytes;
+        } else {
+            release((void*)old[i].address, bytes);
+            heap_stats.freed_objects++;
+            heap_stats.freed_bytes += bytes;
+        }
+    }
+    free(old);
+
+    heap_allocated = 0;
+    heap_threshold = live > HEAP_MIN_THRESHOLD ? live : HEAP_MIN_THRESHOLD;
+    int64_t pause = now_ns() - start;
+    heap_stats.collections++;
+    heap_stats.total_pause_ns += pause;
+    if(pause > heap_stats.max_pause_ns) {
+        heap_stats.max_pause_ns = pause;
+    }
+}
+
+static void* map_zeroed(size_t bytes) {
+    void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED && !gc_disabled) {
+        collect();
+        p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     }
-    close(fd);
-    return r;
+    if(p == MAP_FAILED) {
+        fatal("Out of memory");
+    }
+    return p;
+}
+
+static void* alloc_small(size_t bytes, size_t* block) {
+    int cls = 64 - __builtin_clzll(bytes - 1);
+    if(cls < HEAP_MIN_CLASS) {
+        cls = HEAP_MIN_CLASS;
+    }
+    struct heap_class* c = &heap_classes[cls];
+    *block = (size_t)1 << cls;
+    heap_stats.small_objects++;
+    heap_stats.small_bytes += *block;
+    if(c->free_list) {
+        void* p = c->free_list;
+        c->free_list = *(void**)p;
+        memset(p, 0, *block);
+        return p;
+    }
+    if(c->next == c->end) {
+        c->next = (char*)map_zeroed(HEAP_SLAB_SIZE);
+        c->end = c->next + HEAP_SLAB_SIZE;
+        heap_stats.slabs++;
+    }
+    void* p = c->next;
+    c->next += *block;
+    return p;
+}
+
+static void* alloc_large(size_t bytes, size_t* block) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    *block = (bytes + page - 1) / page * page;
+    void* p = map_zeroed(*block);
+#ifdef MADV_HUGEPAGE
+    if(*block >= HEAP_HUGE_PAGE_SIZE) {
+        madvise(p, *block, MADV_HUGEPAGE);
+    }
+#endif
+    heap_stats.large_objects++;
+    heap_stats.large_bytes += *block;
+    return p;
+}
+
+// zeroed and at least 16-byte aligned
+static void* heap_alloc(size_t bytes) {
+    if(!heap_initialized) {
+        init_heap();
+    }
+    if(heap_allocated >= heap_threshold && !gc_disabled) {
+        collect();
+    }
+    size_t block;
+    void* p;
+    if(bytes <= ((size_t)1 << HEAP_MAX_CLASS)) {
+        p = alloc_small(bytes, &block);
+    } else {
+        p = alloc_large(bytes, &block);
+    }
+    heap_register(p, block);
+    heap_allocated += block;
+    return p;
 }
 
-char* do_inputs() {
-    char* buffer = (char*)malloc(256);
-    if(!fgets(buffer, 256, stdin)) {
+/* Programs compiled with --string-regions bracket every loop that may
+ * create strings: region_mark before the loop, region_reset at the top of
+ * each iteration and region_end wherever the loop is left. While inside such
+ * a loop new strings are bump-allocated from the region instead of the heap,
+ * and a reset drops everything created since the mark at once. A string must
+ * not outlive the iteration that created it, which is why this is opt-in.
+ * The strings of the last iteration stay valid after the loop, only a reset
+ * of an enclosing loop frees them. Outside of loops strings come from the
+ * heap again. The chunks are kept for reuse. */
+#define REGION_CHUNK_SIZE (1 << 16)
+
+static char** region_chunks;
+static size_t region_num_chunks;
+static int64_t region_top;
+static int64_t region_depth;    // bracketed loops being run
+
+int64_t do_region_mark(void) {
+    region_depth++;
+    return region_top;
+}
+
+void do_region_reset(int64_t mark) {
+    if(mark < region_top) {
+        region_top = mark;
+    }
+}
+
+void do_region_end(void) {
+    if(region_depth > 0) {
+        region_depth--;
+    }
+}
+
+static char* region_alloc(size_t bytes) {
+    bytes = (bytes + 15) & ~(size_t)15;
+    size_t chunk = region_top / REGION_CHUNK_SIZE;
+    size_t offset = region_top % REGION_CHUNK_SIZE;
+    if(offset + bytes > REGION_CHUNK_SIZE) {
+        chunk++;
+        offset = 0;
+    }
+    if(chunk == region_num_chunks) {
+        char** chunks = (char**)realloc(region_chunks, (region_num_chunks + 1) * sizeof(char*));
+        if(!chunks) {
+            fatal("Failed to allocate string");
+        }
+        region_chunks = chunks;
+        region_chunks[region_num_chunks] = (char*)malloc(REGION_CHUNK_SIZE);
+        if(!region_chunks[region_num_chunks]) {
+            fatal("Failed to allocate string");
+        }
+        region_num_chunks++;
+    }
+    region_top = chunk * REGION_CHUNK_SIZE + offset + bytes;
+    return region_chunks[chunk] + offset;
+}
+
+static struct string_t* string_new(size_t length) {
+    size_t bytes = sizeof(struct string_t) + length + 1;
+    struct string_t* s = (struct string_t*)(region_depth > 0 ? region_alloc(bytes) : heap_alloc(bytes));
+    s->length = (int64_t)length;
+    s->data[length] = '\0';
+    return s;
+}
+
+// like fgets into 256 bytes: up to 255 characters, including the newline
+struct string_t* do_inputs() {
+    if(out_length > 0) {
+        do_flush();
+    }
+    if(!in_fill()) {
         fatal("Failed to read input");
     }
-    return buffer;
+    char line[256];
+    size_t length = in_read_line(line, sizeof(line));
+
+    struct string_t* s = string_new(length);
+    memcpy(s->data, line, length);
+    return s;
+}
+
+/* The scans over characters have an SSE2 version, which every x86-64 CPU
+ * runs, and an AVX2 version picked at run time. KLANG_SIMD=sse2 keeps to
+ * the SSE2 kernels. */
+static int simd_level;
+
+static int use_avx2(void) {
+    if(simd_level == 0) {
+        const char* simd = getenv("KLANG_SIMD");
+        __builtin_cpu_init();
+        simd_level = 1;
+        if(__builtin_cpu_supports("avx2") && (simd == NULL || strcmp(simd, "sse2") != 0)) {
+            simd_level = 2;
+        }
+    }
+    return simd_level == 2;
+}
+
+// index of the first difference of a and b in the first n characters, or n
+static size_t mismatch_sse2(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+        unsigned diff = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xffff;
+        if(diff) {
+            return i + __builtin_ctz(diff);
+        }
+    }
+    for(; i < n; i++) {
+        if(a[i] != b[i]) {
+            return i;
+        }
+    }
+    return n;
+}
+
+__attribute__((target("avx2")))
+static size_t mismatch_avx2(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+    for(; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+        unsigned diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if(diff) {
+            return i + __builtin_ctz(diff);
+        }
+    }
+    return i + mismatch_sse2(a + i, b + i, n - i);
+}
+
+/* First occurrence of the needle n (nn >= 1 characters) in the haystack h,
+ * or -1. Each step compares a block of positions against the first and the
+ * last character of the needle at once and only checks the positions where
+ * both match. */
+static int64_t find_sse2(const char* h, size_t hn, const char* n, size_t nn) {
+    size_t end = hn - nn + 1;
+    size_t i = 0;
+    __m128i first = _mm_set1_epi8(n[0]);
+    __m128i last = _mm_set1_epi8(n[nn - 1]);
+    for(; i + 16 <= end; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(h + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(h + i + nn - 1));
+        unsigned hits = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(x, first), _mm_cmpeq_epi8(y, last)));
+        while(hits) {
+            size_t pos = i + __builtin_ctz(hits);
+            if(memcmp(h + pos, n, nn) == 0) {
+                return (int64_t)pos;
+            }
+            hits &= hits - 1;
+        }
+    }
+    for(; i < end; i++) {
+        if(h[i] == n[0] && memcmp(h + i, n, nn) == 0) {
+            return (int64_t)i;
+        }
+    }
+    return -1;
+}
+
+__attribute__((target("avx2")))
+static int64_t find_avx2(const char* h, size_t hn, const char* n, size_t nn) {
+    size_t end = hn - nn + 1;
+    size_t i = 0;
+    __m256i first = _mm256_set1_epi8(n[0]);
+    __m256i last = _mm256_set1_epi8(n[nn - 1]);
+    for(; i + 32 <= end; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(h + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(h + i + nn - 1));
+        unsigned hits = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(x, first), _mm256_cmpeq_epi8(y, last)));
+        while(hits) {
+            size_t pos = i + __builtin_ctz(hits);
+            if(memcmp(h + pos, n, nn) == 0) {
+                return (int64_t)pos;
+            }
+            hits &= hits - 1;
+        }
+    }
+    int64_t rest = find_sse2(h + i, hn - i, n, nn);
+    return rest < 0 ? -1 : (int64_t)i + rest;
+}
+
+int64_t do_strlen(const struct string_t* s) {
+    return check_string(s)->length;
 }
 
+// -1, 0 or 1 as a is before, equal to or after b, comparing unsigned characters
+int64_t do_strcmp(const struct string_t* a, const struct string_t* b) {
+    check_string(a);
+    check_string(b);
+    size_t n = a->length < b->length ? a->length : b->length;
+    size_t i = use_avx2() ? mismatch_avx2(a->data, b->data, n) : mismatch_sse2(a->data, b->data, n);
+    if(i < n) {
+        return (unsigned char)a->data[i] < (unsigned char)b->data[i] ? -1 : 1;
+    }
+    return a->length < b->length ? -1 : a->length > b->length;
+}
+
+// index of the first occurrence of needle in haystack, or -1
+int64_t do_strfind(const struct string_t* haystack, const struct string_t* needle) {
+    check_string(haystack);
+    check_string(needle);
+    if(needle->length == 0) {
+        return 0;
+    }
+    if(needle->length > haystack->length) {
+        return -1;
+    }
+    if(use_avx2()) {
+        return find_avx2(haystack->data, haystack->length, needle->data, needle->length);
+    }
+    return find_sse2(haystack->data, haystack->length, needle->data, needle->length);
+}
+
+struct string_t* do_substr(const struct string_t* s, int64_t start, int64_t length) {
+    check_string(s);
+    if(start < 0 || length < 0 || start > s->length || length > s->length - start) {
+        fatal("Substring out of bounds");
+    }
+    struct string_t* result = string_new(length);
+    memcpy(result->data, s->data + start, length);
+    return result;
+}
+
+struct string_t* do_concat(const struct string_t* a, const struct string_t* b) {
+    check_string(a);
+    check_string(b);
+    struct string_t* result = string_new(a->length + b->length);
+    memcpy(result->data, a->data, a->length);
+    memcpy(result->data + a->length, b->data, b->length);
+    return result;
+}
+
+// the character at index as an unsigned byte
+int64_t do_charat(const struct string_t* s, int64_t index) {
+    check_string(s);
+    if(index < 0 || index >= s->length) {
+        fatal("String index out of bounds");
+    }
+    return (unsigned char)s->data[index];
+}
+
+/* One allocation per array: the size, a word of padding that keeps the
+ * elements 16-byte aligned, then the elements. Compiled code checks the
+ * bounds and reads the elements inline (kArrayDataOffset in Codegen.h) and
+ * only calls do_array_load/do_array_store to report a failed check.
+ * KLANG_MAX_ARRAY_SIZE sets the element limit, which never goes below
+ * ARRAY_MIN_MAX_SIZE: the compiler drops unused arrays up to that size
+ * (kArrayNewSafeSize in include/IR/Intrinsics.h). */
+#define ARRAY_DEFAULT_MAX_SIZE (1LL << 27)
+#define ARRAY_MIN_MAX_SIZE (1LL << 16)
+#define ARRAY_HARD_MAX_SIZE (1LL << 40)
+
 struct array_t {
-    int64_t* data;
     int64_t size;
+    int64_t reserved;
+    int64_t data[];
 };
 
+static int64_t array_max_size;
+
+static void init_arrays(void) {
+    const char* max_size = getenv("KLANG_MAX_ARRAY_SIZE");
+    array_max_size = ARRAY_DEFAULT_MAX_SIZE;
+    if(max_size != NULL) {
+        long long value = strtoll(max_size, NULL, 10);
+        if(value > 0) {
+            array_max_size = value < ARRAY_HARD_MAX_SIZE ? value : ARRAY_HARD_MAX_SIZE;
+            array_max_size = array_max_size > ARRAY_MIN_MAX_SIZE ? array_max_size : ARRAY_MIN_MAX_SIZE;
+        }
+    }
+}
+
 struct array_t* do_array_new(int64_t size) {
-    if(size > 100) {
-        fatal("Array size too large");
+    if(array_max_size == 0) {
+        init_arrays();
     }
-    
-    struct array_t* arr = (struct array_t*)malloc(sizeof(struct array_t));
-    if(!arr) {
-        fatal("Failed to allocate array");
+    if(size > array_max_size) {
+        fatal("Array size too large");
     }
-    arr->data = (int64_t*)malloc(size * sizeof(int64_t));
-    if(!arr->data) {
-        fatal("Failed to allocate array data");
+    if(size < 0) {
+        fatal("Negative array size");
     }
-    memset(arr->data, 0, size * sizeof(int64_t));
+
+    struct array_t* arr = (struct array_t*)heap_alloc(sizeof(struct array_t) + (size_t)size * sizeof(int64_t));
     arr->size = size;
     return arr;
 }
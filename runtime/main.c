@@ -5,10 +5,11 @@
 #include <sys/resource.h>
 
 extern int64_t K_main(void);
+extern void do_init_io(void);
 
 static void init_io(void) {
-    setvbuf(stdout, NULL, _IONBF, 0);
     setvbuf(stderr, NULL, _IONBF, 0);
+    do_init_io();
 }
 
 int main(int argc, char* argv[], char* envp[]) {
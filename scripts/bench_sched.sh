@@ -0,0 +1,45 @@
+#!/bin/bash
+
+# Times compilation of a single straight-line block of ~10k+ machine
+# instructions, which is dominated by the per-block passes (scheduling,
+# register allocation).
+
+set -e
+
+if [ $# -lt 1 ]; then
+    echo "Usage: bench_sched.sh <klang compiler> [statements]"
+    exit 1
+fi
+
+COMPILER=$1
+STATEMENTS=${2:-4000}
+SOURCE=$(mktemp --suffix .klang)
+OUT=$(mktemp --suffix .S)
+
+{
+    echo "function main() : int a, int b, int c, int d -> int {"
+    echo "  a := inputi();"
+    echo "  b := inputi();"
+    echo "  c := 1;"
+    echo "  d := 2;"
+    for ((i = 0; i < STATEMENTS; i++)); do
+        case $((i % 3)) in
+            0) echo "  c := c * a + b;" ;;
+            1) echo "  d := d + c * b;" ;;
+            2) echo "  a := a + d;" ;;
+        esac
+    done
+    echo "  printi(a);"
+    echo "  printi(c);"
+    echo "  printi(d);"
+    echo "  return 0;"
+    echo "}"
+} > $SOURCE
+
+START=$(date +%s%N)
+$COMPILER $SOURCE $OUT
+END=$(date +%s%N)
+
+echo "instructions: $(grep -c -v ':$' $OUT)"
+echo "compile time: $(( (END - START) / 1000000 )) ms"
+rm -f $SOURCE $OUT
@@ -13,14 +13,14 @@ fi
 
 SOURCE_FILE=$1
 EXE=$2
-OUT=$(mktemp --suffix .S)
+OUT=$(mktemp --suffix .o)
 
-$COMPILER $SOURCE_FILE $OUT
+$COMPILER --emit=obj $SOURCE_FILE $OUT
 if [ $? -ne 0 ]; then
     exit 1
 fi
 
-gcc -no-pie -o $EXE $OUT $RUNTIME_DIR/*
+gcc -O2 -no-pie -o $EXE $OUT $RUNTIME_DIR/*
 if [ $? -ne 0 ]; then
     exit 1
 fi
\ No newline at end of file
@@ -0,0 +1,76 @@
+#!/bin/bash
+
+# Runs every tests/<name>.klang in each execution mode and compares what it
+# prints with tests/<name>.out. Input comes from tests/<name>.in if there is
+# one. A first line of the form "/* flags: ... */" adds compiler flags.
+
+SCRIPT_DIR=$( cd -- "$( dirname -- "${BASH_SOURCE[0]}" )" &> /dev/null && pwd )
+TESTS_DIR="$SCRIPT_DIR/../tests"
+RUNTIME_DIR="$SCRIPT_DIR/../runtime"
+
+if [ $# -lt 1 ]; then
+    echo "Usage: run_tests.sh <klang compiler> [test name...]"
+    exit 1
+fi
+
+COMPILER=$1
+shift
+MODES="asm obj wrappers jit interp tiered"
+WORK=$(mktemp -d)
+trap 'rm -rf $WORK' EXIT
+
+# run <mode> <source> <flags> <input>: the program's output on stdout
+run() {
+    local mode=$1 source=$2 flags=$3 input=$4
+    case $mode in
+        asm|obj|wrappers)
+            local emit=asm out=$WORK/out.S extra=
+            if [ $mode = obj ]; then
+                emit=obj
+                out=$WORK/out.o
+            elif [ $mode = wrappers ]; then
+                extra=--runtime-wrappers
+            fi
+            $COMPILER $flags $extra --emit=$emit $source $out || return 1
+            gcc -no-pie -o $WORK/exe $out $RUNTIME_DIR/*.c $RUNTIME_DIR/*.S 2> /dev/null || return 1
+            $WORK/exe < $input
+            ;;
+        *)
+            $COMPILER $flags --$mode $source < $input
+            ;;
+    esac
+}
+
+if [ $# -gt 0 ]; then
+    TESTS="$*"
+else
+    TESTS=$(cd $TESTS_DIR && ls *.klang | sed 's/\.klang$//')
+fi
+
+FAILED=0
+for name in $TESTS; do
+    source=$TESTS_DIR/$name.klang
+    input=/dev/null
+    if [ -f $TESTS_DIR/$name.in ]; then
+        input=$TESTS_DIR/$name.in
+    fi
+    flags=$(head -n 1 $source | sed -n 's|^/\* flags: \(.*\) \*/$|\1|p')
+
+    for mode in $MODES; do
+        if ! run $mode $source "$flags" $input > $WORK/actual 2> $WORK/stderr; then
+            echo "FAIL $name ($mode): exited with an error"
+            sed 's/^/    /' $WORK/stderr
+            FAILED=$((FAILED + 1))
+        elif ! diff -q $TESTS_DIR/$name.out $WORK/actual > /dev/null; then
+            echo "FAIL $name ($mode): output differs"
+            diff $TESTS_DIR/$name.out $WORK/actual | head -n 10 | sed 's/^/    /'
+            FAILED=$((FAILED + 1))
+        fi
+    done
+done
+
+if [ $FAILED -ne 0 ]; then
+    echo "$FAILED failed"
+    exit 1
+fi
+echo "all passed"